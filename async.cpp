@@ -122,36 +122,36 @@ private:
      */
     void OnResolved(const boost::system::error_code& error,
                     tcp::resolver::iterator iterator) {
-        try {
-            if (error || (iterator == tcp::resolver::iterator())) {
-                // We failed. The exception is picked up below
-                throw std::runtime_error("Failed to resolve host");
-            }
-
-            // Connect
-            sck_ = std::make_unique<tcp::socket>(io_service_);
-
-            /* Initiate an async Connect operation.
+        if (error || (iterator == tcp::resolver::iterator())) {
+            /* We failed. We pass the error to the result_ property. At
+             * this moment, the future that the main-thread holds will
+             * unblock, and the exception will be thrown there when
+             * result.get() is called.
              *
-             * Ask asio to call OnConnected() when we have a connection
-             * or a connection-failed result.
-             *
-             * async_connect returns immediately
-             */
-            sck_->async_connect(*iterator,
-                                std::bind(&Request::OnConnected, this,
-                                          iterator, std::placeholders::_1));
-        } catch(...) {
-            /* We pick up the exception, and pass it to the result_
-             * property. At this moment, the future that the main-thread
-             * holds will unblock, and the exception will be re-thrown
-             * there when result.get() is called.
+             * make_exception_ptr() gives us the exception without
+             * throwing it here first, which is expensive.
              *
              * Since we don't start another async operation,
              * io_service_.run() will return, and our thread will exit.
              */
-            result_.set_exception(std::current_exception());
+            result_.set_exception(std::make_exception_ptr(
+                std::runtime_error("Failed to resolve host")));
+            return;
         }
+
+        // Connect
+        sck_ = std::make_unique<tcp::socket>(io_service_);
+
+        /* Initiate an async Connect operation.
+         *
+         * Ask asio to call OnConnected() when we have a connection
+         * or a connection-failed result.
+         *
+         * async_connect returns immediately
+         */
+        sck_->async_connect(*iterator,
+                            std::bind(&Request::OnConnected, this,
+                                      iterator, std::placeholders::_1));
     }
 
     /*! Callback that is called by asio when we are connected,
@@ -193,18 +193,15 @@ private:
     /* Callback when a request have been sent (or failed). */
     void OnSentRequest(const boost::system::error_code& error) {
 
-        try {
-            if (error) {
-                // Failure. Same work-flow as in OnResolved()
-                throw std::runtime_error("Failed to send request");
-            }
-
-            // Initiate fetching of the reply
-            FetchMoreData();
-        } catch(...) {
-            // Same work-flow as in OnResolved()
-            result_.set_exception(std::current_exception());
+        if (error) {
+            // Failure. Same work-flow as in OnResolved()
+            result_.set_exception(std::make_exception_ptr(
+                std::runtime_error("Failed to send request")));
+            return;
         }
+
+        // Initiate fetching of the reply
+        FetchMoreData();
     }
 
     /* Initiate a async read operation to get a reply or part of it.
@@ -0,0 +1,600 @@
+
+/*
+ * Logging for threads that must not wait, like the threads that run
+ * the event-loop.
+ *
+ * A message is a compact binary record: the call site, a time-stamp,
+ * and the arguments, copied as they are. Each thread puts its records
+ * in it's own lock-free ring, and a background thread formats them and
+ * writes them to stderr, a batch at a time. A thread that logs never
+ * takes a lock or makes a system call (except the first time, when its
+ * ring is made), and if its ring is full, the message is dropped and
+ * counted in stead of waiting.
+ *
+ * Each call site is rate-limited on its own, so a thousand failing
+ * connections give a few lines, and a note about how many similar
+ * messages were suppressed:
+ *
+ *    ASYNCLOG("Failed to connect to {}", endpoint);
+ *
+ * Arguments can be integers, strings and asio endpoints. Each "{}" in
+ * the format is replaced by the next argument.
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/basic_endpoint.hpp>
+
+namespace asynclog {
+
+using clock_t = std::chrono::steady_clock;
+
+/*! A place in the code that logs. One static instance per call site. */
+struct Site {
+    const char *format;
+
+    // The second we count messages for, and the count, in one word
+    std::atomic<std::uint64_t> window{0};
+    std::atomic<std::uint32_t> suppressed{0};
+
+    // The logger's list of sites, so it can report what was suppressed
+    Site *next = nullptr;
+    std::atomic<bool> listed{false};
+
+    constexpr explicit Site(const char *format) : format(format) {}
+
+    /*! Take a slot in the current second
+     *
+     * @returns false if the site has used up its rate
+     */
+    bool Allow(std::uint32_t per_second) {
+        if (!per_second) {
+            return true;
+        }
+
+        const auto now = static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::seconds>(
+                clock_t::now().time_since_epoch()).count());
+        auto state = window.load(std::memory_order_relaxed);
+        for(;;) {
+            std::uint64_t next = (now << 32) | 1;
+            if ((state >> 32) == now) {
+                if ((state & 0xffffffff) >= per_second) {
+                    suppressed.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                next = state + 1;
+            }
+            if (window.compare_exchange_weak(state, next,
+                                             std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+};
+
+/*! One message, as the logging thread left it */
+struct Record {
+    enum : char {
+        ARG_INT = 'i',
+        ARG_UINT = 'u',
+        ARG_STRING = 's',
+        ARG_ENDPOINT = 'e'
+    };
+
+    const Site *site = nullptr;
+    std::int64_t when = 0; // Nanoseconds, for ordering the threads
+    std::uint32_t suppressed = 0;
+    std::uint16_t size = 0; // Bytes used in args
+    char args[234];
+};
+
+static_assert(sizeof(Record) == 256, "A record should fill a slot");
+
+/*! Appends the arguments to a record
+ *
+ * A string that doesn't fit is cut short. Other arguments are left out
+ * if they don't fit whole.
+ */
+class Encoder
+{
+    Record& rec_;
+
+public:
+    explicit Encoder(Record& rec) : rec_(rec) {}
+
+    void Put(char type, const void *data, std::size_t len) {
+        const auto room = sizeof(rec_.args) - rec_.size;
+        if (room < 1 + sizeof(std::uint16_t)) {
+            return;
+        }
+        if (len > room - 1 - sizeof(std::uint16_t)) {
+            if (type != Record::ARG_STRING) {
+                return;
+            }
+            len = room - 1 - sizeof(std::uint16_t);
+        }
+        const auto len16 = static_cast<std::uint16_t>(len);
+
+        char *dst = rec_.args + rec_.size;
+        *dst++ = type;
+        std::memcpy(dst, &len16, sizeof(len16));
+        std::memcpy(dst + sizeof(len16), data, len);
+        rec_.size += static_cast<std::uint16_t>(1 + sizeof(len16) + len);
+    }
+};
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value
+                        && std::is_signed<T>::value>::type
+Encode(Encoder& enc, T value) {
+    const auto v = static_cast<std::int64_t>(value);
+    enc.Put(Record::ARG_INT, &v, sizeof(v));
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value
+                        && !std::is_signed<T>::value>::type
+Encode(Encoder& enc, T value) {
+    const auto v = static_cast<std::uint64_t>(value);
+    enc.Put(Record::ARG_UINT, &v, sizeof(v));
+}
+
+inline void Encode(Encoder& enc, const char *value) {
+    enc.Put(Record::ARG_STRING, value, std::strlen(value));
+}
+
+inline void Encode(Encoder& enc, const std::string& value) {
+    enc.Put(Record::ARG_STRING, value.data(), value.size());
+}
+
+/*! The address bytes, and the port in the last two */
+template <typename Protocol>
+void Encode(Encoder& enc,
+            const boost::asio::ip::basic_endpoint<Protocol>& ep) {
+    char buf[18] = {};
+    std::size_t len = 0;
+    const auto addr = ep.address();
+    if (addr.is_v4()) {
+        const auto bytes = addr.to_v4().to_bytes();
+        std::memcpy(buf, bytes.data(), bytes.size());
+        len = bytes.size();
+    } else {
+        const auto bytes = addr.to_v6().to_bytes();
+        std::memcpy(buf, bytes.data(), bytes.size());
+        len = bytes.size();
+    }
+    const auto port = ep.port();
+    std::memcpy(buf + len, &port, sizeof(port));
+    enc.Put(Record::ARG_ENDPOINT, buf, len + sizeof(port));
+}
+
+inline void EncodeAll(Encoder&) {}
+
+template <typename T, typename... Args>
+void EncodeAll(Encoder& enc, const T& first, const Args&... rest) {
+    Encode(enc, first);
+    EncodeAll(enc, rest...);
+}
+
+/*! A single-producer, single-consumer ring of records */
+class Ring
+{
+    static constexpr std::size_t slots = 1024;
+
+    std::array<Record, slots> records_;
+    alignas(64) std::atomic<std::uint64_t> head_{0}; // Written by the owner
+    alignas(64) std::atomic<std::uint64_t> tail_{0}; // Written by the logger
+
+public:
+    /*! Messages that did not fit */
+    std::atomic<std::uint64_t> dropped{0};
+
+    /*! A slot for the next record, or nullptr if the ring is full */
+    Record *Claim() {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == slots) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &records_[head % slots];
+    }
+
+    /*! Hand the claimed record to the logger */
+    void Publish() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    }
+
+    /*! Forget the records we have, without writing them */
+    void Skip() {
+        tail_.store(head_.load(std::memory_order_acquire),
+                    std::memory_order_release);
+    }
+
+    /*! Move the records we have to out */
+    void Drain(std::vector<Record>& out) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        const auto head = head_.load(std::memory_order_acquire);
+        for(; tail != head; ++tail) {
+            out.push_back(records_[tail % slots]);
+        }
+        tail_.store(tail, std::memory_order_release);
+    }
+};
+
+/*! Owns the rings, and the thread that writes them out */
+class Logger
+{
+    std::mutex mutex_; // For the thread, and flushing
+    std::condition_variable wake_;
+    std::mutex rings_mutex_;
+    std::vector<std::unique_ptr<Ring>> rings_;
+    std::unique_ptr<std::thread> thread_;
+    std::atomic<bool> running_{false};
+    bool stop_ = false;
+    std::uint64_t flush_requested_ = 0;
+    std::uint64_t flushed_ = 0;
+    std::atomic<std::uint32_t> rate_limit_{10};
+    std::atomic<Site *> sites_{nullptr};
+    std::uint64_t reported_dropped_ = 0;
+
+public:
+    static Logger& Instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    Logger(const Logger&) = delete;
+    Logger& operator = (const Logger&) = delete;
+
+    ~Logger() {
+        Stop();
+    }
+
+    /*! Max messages per second from each call site. 0 is unlimited. */
+    void SetRateLimit(std::uint32_t per_second) {
+        rate_limit_ = per_second;
+    }
+
+    template <typename... Args>
+    void Log(Site& site, const Args&... args) {
+        if (!site.listed.load(std::memory_order_relaxed)) {
+            AddSite(site);
+        }
+        if (!site.Allow(rate_limit_.load(std::memory_order_relaxed))) {
+            return;
+        }
+
+        auto& ring = GetRing();
+        auto *rec = ring.Claim();
+        if (!rec) {
+            return;
+        }
+
+        rec->site = &site;
+        rec->when = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            clock_t::now().time_since_epoch()).count();
+        rec->suppressed = site.suppressed.exchange(0,
+                                                   std::memory_order_relaxed);
+        rec->size = 0;
+        Encoder enc(*rec);
+        EncodeAll(enc, args...);
+        ring.Publish();
+
+        // The thread runs until the process exits, once it's started
+        if (!running_.load(std::memory_order_acquire)) {
+            Start();
+        }
+    }
+
+    /*! Wait until what has been logged so far is written out.
+     *
+     * Call this before _exit().
+     */
+    void Flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!thread_) {
+            return;
+        }
+        const auto request = ++flush_requested_;
+        wake_.notify_all();
+        wake_.wait(lock, [&]() { return flushed_ >= request; });
+    }
+
+private:
+    Logger() {
+        /* A child process gets a copy of the rings, but not the thread.
+         * Forget the thread, and start a new one for the child. The
+         * records in the rings, and the counts of dropped and suppressed
+         * messages, are the parent's to write.
+         */
+        ::pthread_atfork(nullptr, nullptr, []() {
+            auto& logger = Instance();
+            new(&logger.mutex_) std::mutex;
+            new(&logger.wake_) std::condition_variable;
+            new(&logger.rings_mutex_) std::mutex;
+            logger.thread_.release();
+            logger.running_ = false;
+            logger.stop_ = false;
+            logger.flush_requested_ = logger.flushed_ = 0;
+
+            logger.reported_dropped_ = 0;
+            for(auto& ring : logger.rings_) {
+                ring->Skip();
+                logger.reported_dropped_ += ring->dropped.load(
+                    std::memory_order_relaxed);
+            }
+            for(auto *site = logger.sites_.load(std::memory_order_acquire);
+                site; site = site->next) {
+                site->suppressed = 0;
+            }
+        });
+    }
+
+    /*! Write out what has been logged, and stop the thread */
+    void Stop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!thread_) {
+            return;
+        }
+        stop_ = true;
+        wake_.notify_all();
+        lock.unlock();
+
+        thread_->join();
+        thread_.reset();
+        running_ = false;
+    }
+
+    void AddSite(Site& site) {
+        if (site.listed.exchange(true)) {
+            return;
+        }
+        site.next = sites_.load(std::memory_order_relaxed);
+        while(!sites_.compare_exchange_weak(site.next, &site,
+                                            std::memory_order_release)) {
+            ;
+        }
+    }
+
+    Ring& GetRing() {
+        thread_local Ring *ring = nullptr;
+        if (!ring) {
+            /* Rings are kept for the life of the process, as the
+             * logger may still have records from threads that are gone.
+             */
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings_.push_back(std::make_unique<Ring>());
+            ring = rings_.back().get();
+        }
+        return *ring;
+    }
+
+    void Start() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!thread_) {
+            thread_ = std::make_unique<std::thread>([this]() { Run(); });
+            running_ = true;
+        }
+    }
+
+    void Run() {
+        std::vector<Record> batch;
+        std::string out;
+        for(;;) {
+            /* Read the requests before we drain, so we don't miss the
+             * last ones.
+             */
+            bool stop = false;
+            std::uint64_t flush = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop = stop_;
+                flush = flush_requested_;
+            }
+
+            batch.clear();
+            std::uint64_t dropped = 0;
+            {
+                std::lock_guard<std::mutex> lock(rings_mutex_);
+                for(auto& ring : rings_) {
+                    ring->Drain(batch);
+                    dropped += ring->dropped.load(std::memory_order_relaxed);
+                }
+            }
+
+            // The threads' messages, in the order they were logged
+            std::stable_sort(batch.begin(), batch.end(),
+                             [](const Record& a, const Record& b) {
+                                 return a.when < b.when;
+                             });
+
+            out.clear();
+            for(const auto& rec : batch) {
+                Format(rec, out);
+            }
+            ReportSuppressed(out, stop);
+            if (dropped > reported_dropped_) {
+                out += "Log: dropped " + std::to_string(
+                    dropped - reported_dropped_)
+                    + " messages (the ring was full)\n";
+                reported_dropped_ = dropped;
+            }
+            WriteAll(out);
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (flushed_ < flush) {
+                flushed_ = flush;
+                wake_.notify_all();
+            }
+            if (stop) {
+                return;
+            }
+            if (batch.empty()) {
+                wake_.wait_for(lock, std::chrono::milliseconds(10), [&]() {
+                    return stop_ || (flush_requested_ != flushed_);
+                });
+            }
+        }
+    }
+
+    /*! Tell about the messages that were suppressed in a second that
+     * is over, and that no later message from the site has told about.
+     */
+    void ReportSuppressed(std::string& out, bool all) {
+        const auto now = static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::seconds>(
+                clock_t::now().time_since_epoch()).count());
+        for(auto *site = sites_.load(std::memory_order_acquire); site;
+            site = site->next) {
+            if (!site->suppressed.load(std::memory_order_relaxed)
+                || (!all && ((site->window.load(std::memory_order_relaxed)
+                              >> 32) >= now))) {
+                continue;
+            }
+            if (const auto count = site->suppressed.exchange(
+                    0, std::memory_order_relaxed)) {
+                out += "Suppressed " + std::to_string(count)
+                    + " messages like \"" + site->format + "\"\n";
+            }
+        }
+    }
+
+    static void Format(const Record& rec, std::string& out) {
+        const char *arg = rec.args;
+        const char *end = rec.args + rec.size;
+
+        for(const char *p = rec.site->format; *p; ++p) {
+            if ((p[0] != '{') || (p[1] != '}')) {
+                out += *p;
+                continue;
+            }
+            ++p;
+
+            if (end - arg < 3) {
+                out += "{}";
+                continue;
+            }
+            const char type = *arg;
+            std::uint16_t len = 0;
+            std::memcpy(&len, arg + 1, sizeof(len));
+            const char *data = arg + 1 + sizeof(len);
+            if (len > end - data) {
+                arg = end;
+                out += "{}";
+                continue;
+            }
+            arg = data + len;
+            FormatArg(type, data, len, out);
+        }
+
+        if (rec.suppressed) {
+            out += " (" + std::to_string(rec.suppressed)
+                + " similar messages suppressed)";
+        }
+        out += '\n';
+    }
+
+    /*! Append an argument, if it has the size its type should have */
+    static void FormatArg(char type, const char *data, std::size_t len,
+                          std::string& out) {
+        using boost::asio::ip::address_v4;
+        using boost::asio::ip::address_v6;
+        const auto port_size = sizeof(unsigned short);
+
+        switch(type) {
+        case Record::ARG_INT:
+            if (len == sizeof(std::int64_t)) {
+                std::int64_t v = 0;
+                std::memcpy(&v, data, sizeof(v));
+                out += std::to_string(v);
+                return;
+            }
+            break;
+        case Record::ARG_UINT:
+            if (len == sizeof(std::uint64_t)) {
+                std::uint64_t v = 0;
+                std::memcpy(&v, data, sizeof(v));
+                out += std::to_string(v);
+                return;
+            }
+            break;
+        case Record::ARG_STRING:
+            out.append(data, len);
+            return;
+        case Record::ARG_ENDPOINT: {
+            unsigned short port = 0;
+            if (len == address_v4::bytes_type().size() + port_size) {
+                address_v4::bytes_type bytes;
+                std::memcpy(bytes.data(), data, bytes.size());
+                std::memcpy(&port, data + bytes.size(), port_size);
+                out += address_v4(bytes).to_string();
+            } else if (len == address_v6::bytes_type().size() + port_size) {
+                address_v6::bytes_type bytes;
+                std::memcpy(bytes.data(), data, bytes.size());
+                std::memcpy(&port, data + bytes.size(), port_size);
+                out += '[' + address_v6(bytes).to_string() + ']';
+            } else {
+                break;
+            }
+            out += ':' + std::to_string(port);
+            return;
+        }
+        }
+
+        out += "{?}"; // Not something we wrote
+    }
+
+    static void WriteAll(const std::string& data) {
+        for(std::size_t written = 0; written < data.size();) {
+            const auto bytes = ::write(STDERR_FILENO, data.data() + written,
+                                       data.size() - written);
+            if (bytes <= 0) {
+                return;
+            }
+            written += static_cast<std::size_t>(bytes);
+        }
+    }
+};
+
+template <typename... Args>
+void Log(Site& site, const Args&... args) {
+    Logger::Instance().Log(site, args...);
+}
+
+/*! Write out what has been logged. Call it before _exit(). */
+inline void Flush() {
+    Logger::Instance().Flush();
+}
+
+} // namespace asynclog
+
+/*! Log a message, without waiting for anything.
+ *
+ * Each use of the macro is a call site with it's own rate-limit.
+ */
+#define ASYNCLOG(format, ...) \
+    do { \
+        static ::asynclog::Site asynclog_site_(format); \
+        ::asynclog::Log(asynclog_site_, ##__VA_ARGS__); \
+    } while(false)
@@ -0,0 +1,204 @@
+/*
+ * A budget for the memory that the requests hold, so that a large batch
+ * of fetches can't make us run out of memory.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+
+/*! Coroutines waiting for something that another thread will tell them
+ *
+ * A waiter checks its condition, and calls Wait(), under the owner's
+ * lock. The coroutine's completion handler is put in the queue before
+ * the lock is released, so a Wake...() from another thread can't be
+ * lost in between. Waking posts the handler to the waiter's own
+ * executor, so the coroutine resumes on it's own IO thread. No thread
+ * touches an IO object that another thread may be waiting on.
+ *
+ * The methods must be called with the owner's lock held.
+ */
+class WaitQueue
+{
+    boost::asio::io_service& io_service_;
+    std::deque<std::function<void()>> waiters_;
+
+public:
+    explicit WaitQueue(boost::asio::io_service& io_service)
+        : io_service_(io_service) {}
+
+    /*! Suspend the coroutine until it's woken.
+     *
+     * lock is released while we wait, and is not held when we return.
+     */
+    void Wait(std::unique_lock<std::mutex>& lock,
+              boost::asio::yield_context yield) {
+        boost::asio::async_initiate<boost::asio::yield_context, void()>(
+            [this, &lock](auto handler) {
+                const auto ex = boost::asio::get_associated_executor(
+                    handler, io_service_.get_executor());
+                waiters_.push_back([ex, handler]() mutable {
+                    boost::asio::post(ex, std::move(handler));
+                });
+                lock.unlock();
+            }, yield);
+    }
+
+    bool Empty() const { return waiters_.empty(); }
+    std::size_t Size() const { return waiters_.size(); }
+
+    /*! Wake the one that has waited the longest */
+    void WakeOne() {
+        auto wake = std::move(waiters_.front());
+        waiters_.pop_front();
+        wake();
+    }
+
+    void WakeAll() {
+        while(!waiters_.empty()) {
+            WakeOne();
+        }
+    }
+};
+
+/*! Keeps track of how much data all our requests have buffered.
+ *
+ * When the cap is reached, readers must wait for memory to be released
+ * before they read more from their sockets. That way, slow consumers
+ * and huge responses push back on the servers (via TCP flow-control)
+ * in stead of growing our memory usage.
+ *
+ * To make sure we can always make progress, one reader at a time is
+ * allowed to go over the cap. The others wait for it to finish.
+ *
+ * Each waiter tells how much it's going to read. When memory is
+ * released, we only wake as many waiters as the room can take, in
+ * stead of all of them, only to have most go back to sleep.
+ */
+class MemoryBudget
+{
+    const std::size_t cap_;
+    std::size_t used_ = 0;
+    const void *overdraft_ = nullptr;
+    WaitQueue waiters_;
+    std::deque<std::size_t> wants_; // What each of the waiters will read
+    std::mutex mutex_;
+
+public:
+    /*! The memory used by one request.
+     *
+     * Releases the memory back to the budget when it goes out of scope.
+     */
+    class Account {
+        MemoryBudget& budget_;
+        std::size_t bytes_ = 0;
+
+    public:
+        Account(MemoryBudget& budget) : budget_(budget) {}
+        Account(const Account&) = delete;
+        ~Account() { budget_.Release(this, bytes_); }
+
+        /*! Suspend the coroutine until we are allowed to read more
+         *
+         * @param want How many bytes the next read can buffer
+         */
+        void WaitForRoom(std::size_t want, boost::asio::yield_context yield) {
+            budget_.WaitForRoom(this, want, yield);
+        }
+
+        /*! Register bytes that we have buffered */
+        void Add(std::size_t bytes) {
+            bytes_ += bytes;
+            budget_.Add(bytes);
+        }
+    };
+
+    MemoryBudget(boost::asio::io_service& io_service, std::size_t cap)
+        : cap_(cap), waiters_(io_service) {}
+
+    /*! Memory that outlives the request that used it, like a captured
+     * response waiting to be written. Can be called from any thread.
+     */
+    void Charge(std::size_t bytes) {
+        Add(bytes);
+    }
+
+    void Refund(std::size_t bytes) {
+        Release(nullptr, bytes);
+    }
+
+private:
+    void WaitForRoom(const Account *account, std::size_t want,
+                     boost::asio::yield_context yield) {
+        if (!cap_) {
+            return;
+        }
+
+        for(;;) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if ((used_ < cap_) || (overdraft_ == account)) {
+                return;
+            }
+
+            if (!overdraft_) {
+                overdraft_ = account;
+                return;
+            }
+
+            // Release() wakes us up, and we check again
+            wants_.push_back(want);
+            waiters_.Wait(lock, yield);
+        }
+    }
+
+    void Add(std::size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ += bytes;
+    }
+
+    void Release(const Account *account, std::size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ -= bytes;
+        if (overdraft_ == account) {
+            overdraft_ = nullptr;
+        }
+
+        WakeWaiters();
+    }
+
+    /*! Wake the waiters, in order, that fit in the room we have.
+     *
+     * The first one is woken if there is any room at all, even if it
+     * wants more. If there is no overdraft, one more can take it.
+     * Called with the lock held.
+     */
+    void WakeWaiters() {
+        std::size_t room = (used_ < cap_) ? cap_ - used_ : 0;
+        bool overdraft = !overdraft_;
+        while(!waiters_.Empty()) {
+            const auto want = wants_.front();
+            if (want <= room) {
+                room -= want;
+            } else if (room) {
+                room = 0;
+            } else if (overdraft) {
+                overdraft = false;
+            } else {
+                break;
+            }
+
+            wants_.pop_front();
+            waiters_.WakeOne();
+        }
+    }
+};
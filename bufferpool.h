@@ -0,0 +1,184 @@
+/*
+ * Fixed-size read buffers, carved out of large memory mappings and
+ * recycled between requests.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+
+/*! Fixed-size receive buffers, carved from 2 MiB regions.
+ *
+ * With tens of thousands of downloads in flight, the receive buffers
+ * span gigabytes, and with 4 KiB pages the TLB can't cover them. When
+ * huge pages are enabled, each region is first mapped with MAP_HUGETLB
+ * (from the pool the admin reserved in /proc/sys/vm/nr_hugepages). If
+ * that fails, we map a 2 MiB aligned region of normal pages and ask for
+ * transparent huge pages with madvise(). The kernel may still back it
+ * with normal pages; that's fine, it's just slower.
+ *
+ * Blocks are never returned to the OS; they are put on a free list and
+ * reused by the next request. Can be used from any thread.
+ */
+class BufferPool
+{
+    static constexpr std::size_t region_size = 2 * 1024 * 1024;
+
+    struct Region {
+        void *addr = nullptr;
+        std::size_t size = 0;
+    };
+
+    const std::size_t block_size_;
+    const bool huge_pages_;
+    mutable std::mutex mutex_;
+    std::vector<char *> free_;
+    std::vector<Region> regions_;
+    std::size_t hugetlb_regions_ = 0;
+    std::size_t thp_regions_ = 0;
+    std::size_t blocks_in_use_ = 0;
+    std::size_t peak_in_use_ = 0;
+
+public:
+    /*! A block from the pool. Returned to the pool when destroyed. */
+    class Block
+    {
+        BufferPool *pool_ = nullptr;
+        char *data_ = nullptr;
+
+    public:
+        Block() = default;
+        Block(BufferPool *pool, char *data) : pool_(pool), data_(data) {}
+        Block(Block&& v) : pool_(v.pool_), data_(v.data_) {
+            v.pool_ = nullptr;
+            v.data_ = nullptr;
+        }
+
+        Block& operator = (Block&& v) {
+            std::swap(pool_, v.pool_);
+            std::swap(data_, v.data_);
+            return *this;
+        }
+
+        ~Block() {
+            if (pool_) {
+                pool_->Release(data_);
+            }
+        }
+
+        char *data() const { return data_; }
+        std::size_t size() const { return pool_ ? pool_->block_size_ : 0; }
+    };
+
+    /*! Constructor
+     *
+     * @param block_size Bytes in each block. Rounded up to a cache-line.
+     * @param huge_pages Try to back the regions with huge pages.
+     */
+    BufferPool(std::size_t block_size, bool huge_pages)
+        : block_size_(std::min(region_size,
+                               (std::max<std::size_t>(block_size, 64) + 63)
+                                   & ~std::size_t(63)))
+        , huge_pages_(huge_pages)
+    {
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator = (const BufferPool&) = delete;
+
+    ~BufferPool() {
+        for(const auto& region : regions_) {
+            ::munmap(region.addr, region.size);
+        }
+    }
+
+    std::size_t GetBlockSize() const { return block_size_; }
+
+    /*! Get a block. Throws std::bad_alloc if we are out of memory. */
+    Block Get() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+            AddRegion();
+        }
+
+        auto *data = free_.back();
+        free_.pop_back();
+        peak_in_use_ = std::max(peak_in_use_, ++blocks_in_use_);
+        return {this, data};
+    }
+
+    void PrintStats(std::ostream& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "recv-pool: block-size=" << block_size_
+            << " regions=" << regions_.size()
+            << " hugetlb=" << hugetlb_regions_
+            << " thp-advised=" << thp_regions_
+            << " in-use=" << blocks_in_use_
+            << " peak-in-use=" << peak_in_use_
+            << std::endl;
+    }
+
+private:
+    void Release(char *data) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(data);
+        --blocks_in_use_;
+    }
+
+    /*! Map a new region, and put its blocks on the free list */
+    void AddRegion() {
+        Region region;
+        char *start = nullptr;
+
+        if (huge_pages_) {
+            region.addr = ::mmap(nullptr, region_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                                 -1, 0);
+            if (region.addr != MAP_FAILED) {
+                region.size = region_size;
+                start = static_cast<char *>(region.addr);
+                ++hugetlb_regions_;
+            }
+        }
+
+        if (!start) {
+            /* Transparent huge pages need a 2 MiB aligned range, so we
+             * map one region too much, and use the aligned part of it.
+             */
+            const auto size = huge_pages_ ? 2 * region_size : region_size;
+            region.addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (region.addr == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            region.size = size;
+            start = static_cast<char *>(region.addr);
+
+            if (huge_pages_) {
+                const auto addr = reinterpret_cast<std::uintptr_t>(start);
+                start += ((addr + region_size - 1) & ~(region_size - 1)) - addr;
+                if (::madvise(start, region_size, MADV_HUGEPAGE) == 0) {
+                    ++thp_regions_;
+                }
+            }
+        }
+
+        regions_.push_back(region);
+        for(std::size_t offset = 0; offset + block_size_ <= region_size;
+            offset += block_size_) {
+            free_.push_back(start + offset);
+        }
+    }
+};
+
+constexpr std::size_t BufferPool::region_size;
@@ -0,0 +1,378 @@
+
+/*
+ * Recordings of HTTP responses, with the timing they arrived with, so
+ * that benchmarks can be run against realistic traffic without the
+ * noise (or the need for a network) of live sites.
+ *
+ * "modern.cpp" records with --capture, and "replayserver.cpp" serves
+ * the recordings back on loopback.
+ *
+ * The file starts with a magic line, and is followed by one record per
+ * response. Numbers are stored as varints (7 bits per byte, least
+ * significant first), and each record starts with its own length, so
+ * a record that was cut short (say, by a crash) is simply ignored.
+ *
+ * Each record is written with a single write() to a file opened with
+ * O_APPEND, so several processes that share the file descriptor after
+ * fork() can record to the same file. In each process, the writes are
+ * done by a background thread.
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace capture {
+
+static const std::string magic = "HTTPCAP1\n";
+
+/*! A piece of the response, as it was read from the socket */
+struct Chunk {
+    /*! Micro-seconds since the previous chunk, or, for the first chunk,
+     * since the request was sent (the time to first byte).
+     */
+    std::uint32_t delay_us = 0;
+    std::uint32_t len = 0;
+};
+
+/*! One recorded response */
+struct Exchange {
+    enum : std::uint32_t {
+        FLAG_RESET = 1 // The connection failed in stead of being closed
+    };
+
+    std::string host;
+    std::uint32_t port = 80;
+    std::string path;
+    std::uint32_t flags = 0;
+    std::vector<Chunk> chunks;
+    std::string data; // All the chunks, back to back
+};
+
+inline void AppendVarint(std::string& out, std::uint64_t value) {
+    while(value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+/*! @returns false if we ran out of data */
+inline bool ReadVarint(const char *& p, const char *end, std::uint64_t& value) {
+    value = 0;
+    for(int shift = 0; (p != end) && (shift < 64); shift += 7) {
+        const auto byte = static_cast<unsigned char>(*p++);
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void AppendString(std::string& out, const std::string& value) {
+    AppendVarint(out, value.size());
+    out += value;
+}
+
+inline bool ReadString(const char *& p, const char *end, std::string& value) {
+    std::uint64_t len = 0;
+    if (!ReadVarint(p, end, len)
+        || (len > static_cast<std::uint64_t>(end - p))) {
+        return false;
+    }
+    value.assign(p, len);
+    p += len;
+    return true;
+}
+
+/*! Serialize a record, with the length in front */
+inline std::string Encode(const Exchange& ex) {
+    std::string body;
+    AppendString(body, ex.host);
+    AppendVarint(body, ex.port);
+    AppendString(body, ex.path);
+    AppendVarint(body, ex.flags);
+    AppendVarint(body, ex.chunks.size());
+    for(const auto& chunk : ex.chunks) {
+        AppendVarint(body, chunk.delay_us);
+        AppendVarint(body, chunk.len);
+    }
+
+    std::string rval;
+    AppendVarint(rval, body.size() + ex.data.size());
+    return rval + body + ex.data;
+}
+
+/*! Parse one record, and move p past it
+ *
+ * @returns false if the record is incomplete or damaged.
+ */
+inline bool Decode(const char *& p, const char *end, Exchange& ex) {
+    std::uint64_t record_len = 0;
+    if (!ReadVarint(p, end, record_len)
+        || (record_len > static_cast<std::uint64_t>(end - p))) {
+        return false;
+    }
+
+    const char *record_end = p + record_len;
+    std::uint64_t port = 0, flags = 0, count = 0;
+    if (!ReadString(p, record_end, ex.host)
+        || !ReadVarint(p, record_end, port)
+        || !ReadString(p, record_end, ex.path)
+        || !ReadVarint(p, record_end, flags)
+        || !ReadVarint(p, record_end, count)) {
+        return false;
+    }
+    ex.port = static_cast<std::uint32_t>(port);
+    ex.flags = static_cast<std::uint32_t>(flags);
+
+    std::uint64_t total = 0;
+    ex.chunks.clear();
+    for(std::uint64_t i = 0; i < count; ++i) {
+        std::uint64_t delay = 0, len = 0;
+        if (!ReadVarint(p, record_end, delay)
+            || !ReadVarint(p, record_end, len)) {
+            return false;
+        }
+        ex.chunks.push_back({static_cast<std::uint32_t>(delay),
+                             static_cast<std::uint32_t>(len)});
+        total += len;
+    }
+
+    if (total != static_cast<std::uint64_t>(record_end - p)) {
+        return false;
+    }
+    ex.data.assign(p, total);
+    p = record_end;
+    return true;
+}
+
+/*! Appends records to a capture file
+ *
+ * The records are written by a background thread, so the threads that
+ * record (the IO threads) don't wait for the disk. The thread is
+ * started by the first record, in the process that writes it; a worker
+ * forked before that gets it's own.
+ */
+class Writer
+{
+    /*! Called by the writer thread when a record is written (or dropped) */
+    using written_t = std::function<void()>;
+
+    int fd_ = -1;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::pair<Exchange, written_t>> queue_;
+    std::unique_ptr<std::thread> thread_;
+    pid_t pid_ = 0; // Where thread_ runs
+    bool busy_ = false;
+    bool stop_ = false;
+    int error_ = 0;
+
+public:
+    /*! Create (or truncate) the file */
+    explicit Writer(const std::string& path) {
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND
+                     | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("Cannot create " + path + ": "
+                                     + strerror(errno));
+        }
+        if (!WriteAll(magic)) {
+            throw std::runtime_error("Cannot write to " + path + ": "
+                                     + strerror(errno));
+        }
+    }
+
+    Writer(const Writer&) = delete;
+    Writer& operator = (const Writer&) = delete;
+
+    ~Writer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        if (thread_ && (pid_ == ::getpid())) {
+            thread_->join();
+        }
+        ::close(fd_);
+    }
+
+    /*! Queue a record. Can be called from any thread.
+     *
+     * @param written Called from the writer thread when the record is
+     *   written, or dropped because an earlier write failed.
+     * @returns false if an earlier write failed (see errno). The record
+     *   is not written then.
+     */
+    bool Write(Exchange&& ex, written_t written = {}) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (error_) {
+            lock.unlock();
+            if (written) {
+                written();
+            }
+            errno = error_;
+            return false;
+        }
+
+        if (!thread_ || (pid_ != ::getpid())) {
+            // A copy from our parent, without the thread. Leave it.
+            thread_.release();
+            pid_ = ::getpid();
+            thread_ = std::make_unique<std::thread>([this]() { Run(); });
+        }
+        queue_.emplace_back(std::move(ex), std::move(written));
+        lock.unlock();
+        cond_.notify_all();
+        return true;
+    }
+
+    /*! Wait until the queued records are written */
+    void Flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]() { return queue_.empty() && !busy_; });
+    }
+
+private:
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for(;;) {
+            cond_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return; // Stopped, with nothing left to write
+            }
+
+            auto item = std::move(queue_.front());
+            queue_.pop_front();
+            busy_ = true;
+            const bool failed = error_ != 0;
+            lock.unlock();
+
+            if (!failed && !WriteAll(Encode(item.first))) {
+                const int error = errno ? errno : EIO;
+                lock.lock();
+                error_ = error;
+                lock.unlock();
+            }
+            item.first = {}; // Release the memory before we report it
+            if (item.second) {
+                item.second();
+            }
+
+            lock.lock();
+            busy_ = false;
+            cond_.notify_all();
+        }
+    }
+
+    bool WriteAll(const std::string& data) {
+        /* With O_APPEND, a regular file gets the whole buffer in one
+         * go (short writes only happen when the disk is full).
+         */
+        return ::write(fd_, data.data(), data.size())
+            == static_cast<ssize_t>(data.size());
+    }
+};
+
+/*! Time the chunks of one response as they are read */
+class Recorder
+{
+    using clock_t = std::chrono::steady_clock;
+
+    Exchange exchange_;
+    clock_t::time_point last_;
+
+public:
+    Recorder(std::string host, std::uint32_t port, std::string path) {
+        exchange_.host = std::move(host);
+        exchange_.port = port;
+        exchange_.path = std::move(path);
+    }
+
+    /*! Call when the request has been sent */
+    void Sent() {
+        last_ = clock_t::now();
+    }
+
+    void Add(const char *data, std::size_t len) {
+        if (!len) {
+            return;
+        }
+
+        const auto now = clock_t::now();
+        const auto delay = std::chrono::duration_cast<
+            std::chrono::microseconds>(now - last_).count();
+        last_ = now;
+
+        exchange_.chunks.push_back({static_cast<std::uint32_t>(delay),
+                                    static_cast<std::uint32_t>(len)});
+        exchange_.data.append(data, len);
+    }
+
+    /*! The bytes of the response we hold */
+    std::size_t Size() const {
+        return exchange_.data.size();
+    }
+
+    /*! Hand the record to the writer
+     *
+     * @param reset true if the connection failed in stead of being closed.
+     * @param written See Writer::Write()
+     * @returns false if an earlier write failed.
+     */
+    bool Finish(Writer& writer, bool reset,
+                std::function<void()> written = {}) {
+        if (reset) {
+            exchange_.flags |= Exchange::FLAG_RESET;
+        }
+        return writer.Write(std::move(exchange_), std::move(written));
+    }
+};
+
+/*! Read all the complete records in a capture file */
+inline std::vector<Exchange> Load(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    const std::string data((std::istreambuf_iterator<char>(in)),
+                           std::istreambuf_iterator<char>());
+    if (data.compare(0, magic.size(), magic) != 0) {
+        throw std::runtime_error(path + " is not a capture file");
+    }
+
+    std::vector<Exchange> rval;
+    const char *p = data.data() + magic.size();
+    const char *end = data.data() + data.size();
+    Exchange ex;
+    while((p != end) && Decode(p, end, ex)) {
+        rval.push_back(std::move(ex));
+    }
+
+    return rval;
+}
+
+} // namespace capture
@@ -0,0 +1,140 @@
+/*
+ * The settings that the command line of "modern.cpp" ends up in.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "capture.h"
+#include "hosts.h"
+#include "resolver.h"
+
+/*! Tunables for the HTTP Client object.
+ *
+ * The defaults give the same behavior as the original example.
+ */
+struct Config
+{
+    /*! Let the IO thread spin on poll() in stead of sleeping in epoll.
+     *
+     * This trades CPU for latency: completions are picked up as soon as
+     * they are ready, in stead of after a sleep/wakeup cycle in the kernel.
+     */
+    bool busy_poll = false;
+
+    /*! How long the IO thread spins without finding any work before it
+     * falls back to blocking. Under low load this keeps us from burning a
+     * core while nothing happens.
+     */
+    std::chrono::microseconds spin_budget{200};
+
+    /*! Value for SO_BUSY_POLL on our sockets, in microseconds. 0 disables it. */
+    int socket_busy_poll_usec = 0;
+
+    /*! Number of threads running the event-loop */
+    int io_threads = 1;
+
+    /*! Largest body we accept for one request, in bytes. 0 is unlimited. */
+    std::size_t max_body_size = 0;
+
+    /*! Return the first max_body_size bytes of the body in stead of
+     * failing the request when the body is too large.
+     */
+    bool truncate_body = false;
+
+    /*! Cap for the bytes buffered by all the requests together. 0 is
+     * unlimited. When we reach it, requests stop reading from their
+     * sockets until some memory is released.
+     */
+    std::size_t max_buffered_bytes = 0;
+
+    /*! Addresses we use in stead of asking the DNS system */
+    HostOverrides host_overrides;
+
+    /*! Use our own DNS client in stead of the system resolver */
+    bool builtin_resolver = false;
+
+    /*! Settings for our own DNS client */
+    DnsResolver::Options dns;
+
+    /*! Max number of requests in each stage of a fetch. 0 is unlimited.
+     *
+     * A request that has finished one stage waits in the queue for the
+     * next one, so that slow DNS lookups don't hold up the transfers
+     * (or the other way around).
+     */
+    std::size_t max_resolving = 0;
+    std::size_t max_connecting = 0;
+    std::size_t max_transferring = 0;
+
+    /*! How long a preconnected socket can wait in the pool before we
+     * stop trusting it, and connect again.
+     */
+    std::chrono::milliseconds pool_idle_timeout{30000};
+
+    /*! Allocate the short-lived objects of each request from an arena,
+     * that is released in one go when the request is done.
+     */
+    bool request_arena = true;
+
+    /*! Measure how long the handlers run, and the event-loop lag */
+    bool monitor_loop = false;
+
+    /*! How often we measure the event-loop lag */
+    std::chrono::milliseconds lag_probe_interval{10};
+
+    /*! Print a backtrace of handlers that run for longer than this.
+     * 0 disables it. Implies monitor_loop.
+     */
+    std::chrono::milliseconds slow_handler{0};
+
+    /*! Record the responses, and their timing, to this file.
+     *
+     * It's opened before the workers are forked, so they all append
+     * to the same file.
+     */
+    std::shared_ptr<capture::Writer> capture;
+
+    /*! Read into blocks from a shared pool, in stead of a small buffer
+     * on the coroutine's stack.
+     */
+    bool recv_pool = false;
+
+    /*! Bytes in each block from the receive pool */
+    std::size_t recv_block_size = 16 * 1024;
+
+    /*! Back the receive pool with huge pages, if we can get them */
+    bool huge_pages = false;
+
+    /*! Local addresses to connect from. The connections are spread over
+     * them, so that each destination gets one range of ephemeral ports
+     * per address. Empty lets the kernel pick.
+     */
+    std::vector<boost::asio::ip::address> source_addresses;
+
+    /*! Ephemeral ports to use for our connections, in stead of the
+     * system-wide net.ipv4.ip_local_port_range. 0 uses the system range.
+     */
+    unsigned short local_port_min = 0;
+    unsigned short local_port_max = 0;
+
+    /*! Follow up to this many redirects. 0 gives the redirect response
+     * to the caller.
+     */
+    std::size_t max_redirects = 0;
+
+    /*! Number of permanent redirects (301 and 308) we remember, so that
+     * we can go straight to the new location the next time. 0 disables
+     * the cache.
+     */
+    std::size_t redirect_cache_size = 1024;
+};
@@ -0,0 +1,95 @@
+/*
+ * Idle keep-alive connections, kept for reuse by later requests to the
+ * same origin.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <sys/socket.h>
+#include <boost/asio.hpp>
+
+/*! Idle, connected sockets, ready to be used by a request.
+ *
+ * The sockets are opened in advance by Request::Preconnect(), so that
+ * the first requests in a burst don't have to wait for DNS and the
+ * TCP handshake. Each socket is used for one request only.
+ */
+class ConnectionPool
+{
+    using tcp = boost::asio::ip::tcp;
+
+    struct Idle {
+        tcp::socket sck;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    const std::chrono::milliseconds idle_timeout_;
+    std::map<std::string, std::deque<Idle>> idle_;
+    std::mutex mutex_;
+
+public:
+    ConnectionPool(std::chrono::milliseconds idle_timeout)
+        : idle_timeout_(idle_timeout) {}
+
+    /*! Add a connected socket for origin ("host:port") */
+    void Put(const std::string& origin, tcp::socket sck) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_[origin].push_back({std::move(sck),
+            std::chrono::steady_clock::now()});
+    }
+
+    /*! Get a connected socket for origin
+     *
+     * Sockets that have been idle for too long, or that the server has
+     * closed, are discarded.
+     *
+     * @returns true if a socket was moved to sck
+     */
+    bool Take(const std::string& origin, tcp::socket& sck) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = idle_.find(origin);
+        if (it == idle_.end()) {
+            return false;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        auto& sockets = it->second;
+        bool found = false;
+        while(!sockets.empty() && !found) {
+            auto& idle = sockets.front();
+            if (((now - idle.since) < idle_timeout_) && IsAlive(idle.sck)) {
+                sck = std::move(idle.sck);
+                found = true;
+            }
+            sockets.pop_front();
+        }
+
+        if (sockets.empty()) {
+            idle_.erase(it);
+        }
+
+        return found;
+    }
+
+private:
+    /*! An idle HTTP connection has nothing to read until we send a
+     * request. If it has, the server has closed it (or is confused).
+     */
+    static bool IsAlive(tcp::socket& sck) {
+        char ch = 0;
+        const auto bytes = ::recv(sck.native_handle(), &ch, 1,
+                                  MSG_PEEK | MSG_DONTWAIT);
+        return (bytes < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+    }
+};
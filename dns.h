@@ -0,0 +1,308 @@
+
+/*
+ * Just enough of the DNS wire format (RFC 1035) to ask for, and answer,
+ * A and AAAA records.
+ *
+ * Used by the built-in resolver in "modern.cpp" and by the stand-in
+ * DNS server in "dnsserver.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+namespace dns {
+
+enum : std::uint16_t {
+    TYPE_A = 1,
+    TYPE_CNAME = 5,
+    TYPE_AAAA = 28,
+    CLASS_IN = 1
+};
+
+enum : std::uint16_t {
+    FLAG_RESPONSE = 0x8000,
+    FLAG_AUTHORITATIVE = 0x0400,
+    FLAG_TRUNCATED = 0x0200,
+    FLAG_RECURSION_DESIRED = 0x0100,
+    FLAG_RECURSION_AVAILABLE = 0x0080,
+    RCODE_MASK = 0x000f
+};
+
+enum : std::uint16_t {
+    RCODE_OK = 0,
+    RCODE_SERVFAIL = 2,
+    RCODE_NXDOMAIN = 3
+};
+
+/*! Largest message we send or expect over UDP (without EDNS) */
+constexpr std::size_t max_udp_size = 512;
+
+/*! A parsed DNS message, with the parts we care about */
+struct Message
+{
+    std::uint16_t id = 0;
+    std::uint16_t flags = 0;
+    std::string qname;
+    std::uint16_t qtype = 0;
+    std::vector<boost::asio::ip::address> addresses;
+
+    bool IsResponse() const { return flags & FLAG_RESPONSE; }
+    bool IsTruncated() const { return flags & FLAG_TRUNCATED; }
+    int Rcode() const { return flags & RCODE_MASK; }
+};
+
+namespace detail {
+
+inline void Put16(std::string& out, std::uint16_t value) {
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value & 0xff);
+}
+
+inline void Put32(std::string& out, std::uint32_t value) {
+    Put16(out, static_cast<std::uint16_t>(value >> 16));
+    Put16(out, static_cast<std::uint16_t>(value & 0xffff));
+}
+
+inline bool Get16(const std::uint8_t *data, std::size_t len,
+                  std::size_t& pos, std::uint16_t& value) {
+    if (pos + 2 > len) {
+        return false;
+    }
+    value = static_cast<std::uint16_t>((data[pos] << 8) | data[pos + 1]);
+    pos += 2;
+    return true;
+}
+
+/*! Encode "www.example.com" as labels */
+inline bool PutName(std::string& out, const std::string& name) {
+    std::size_t start = 0;
+    while(start < name.size()) {
+        auto end = name.find('.', start);
+        if (end == std::string::npos) {
+            end = name.size();
+        }
+
+        const auto label_len = end - start;
+        if (!label_len || (label_len > 63)) {
+            return false;
+        }
+
+        out += static_cast<char>(label_len);
+        out.append(name, start, label_len);
+        start = end + 1;
+    }
+
+    out += '\0';
+    return true;
+}
+
+/*! Decode a (possibly compressed) name, and move pos past it */
+inline bool GetName(const std::uint8_t *data, std::size_t len,
+                    std::size_t& pos, std::string& name) {
+    name.clear();
+    auto cursor = pos;
+    bool jumped = false;
+
+    // Bound the number of labels so that pointer loops can't hang us
+    for(int labels = 0; labels < 128; ++labels) {
+        if (cursor >= len) {
+            return false;
+        }
+
+        const auto label_len = data[cursor];
+        if (!label_len) {
+            if (!jumped) {
+                pos = cursor + 1;
+            }
+            return true;
+        }
+
+        if ((label_len & 0xc0) == 0xc0) {
+            if (cursor + 2 > len) {
+                return false;
+            }
+            if (!jumped) {
+                pos = cursor + 2;
+            }
+            cursor = ((label_len & 0x3f) << 8) | data[cursor + 1];
+            jumped = true;
+            continue;
+        }
+
+        if (cursor + 1 + label_len > len) {
+            return false;
+        }
+
+        if (!name.empty()) {
+            name += '.';
+        }
+        name.append(reinterpret_cast<const char *>(data + cursor + 1),
+                    label_len);
+        cursor += 1 + label_len;
+    }
+
+    return false;
+}
+
+inline bool SameName(const std::string& a, const std::string& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for(std::size_t i = 0; i < a.size(); ++i) {
+        if (::tolower(a[i]) != ::tolower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace detail
+
+/*! Make a standard, recursive query for one name and type */
+inline bool MakeQuery(std::string& out, std::uint16_t id,
+                      const std::string& name, std::uint16_t type) {
+    out.clear();
+    detail::Put16(out, id);
+    detail::Put16(out, FLAG_RECURSION_DESIRED);
+    detail::Put16(out, 1); // qdcount
+    detail::Put16(out, 0); // ancount
+    detail::Put16(out, 0); // nscount
+    detail::Put16(out, 0); // arcount
+    if (!detail::PutName(out, name)) {
+        return false;
+    }
+    detail::Put16(out, type);
+    detail::Put16(out, CLASS_IN);
+    return true;
+}
+
+/*! Parse a query or a response
+ *
+ * For responses, the A or AAAA records (matching the question) in the
+ * answer section are added to msg.addresses. CNAME records are followed
+ * only as far as the answer section goes, which is what recursive
+ * resolvers give us.
+ */
+inline bool Parse(const std::uint8_t *data, std::size_t len, Message& msg) {
+    std::size_t pos = 0;
+    std::uint16_t qdcount = 0, ancount = 0, unused = 0, qclass = 0;
+
+    if (!detail::Get16(data, len, pos, msg.id)
+        || !detail::Get16(data, len, pos, msg.flags)
+        || !detail::Get16(data, len, pos, qdcount)
+        || !detail::Get16(data, len, pos, ancount)
+        || !detail::Get16(data, len, pos, unused)
+        || !detail::Get16(data, len, pos, unused)
+        || (qdcount != 1)
+        || !detail::GetName(data, len, pos, msg.qname)
+        || !detail::Get16(data, len, pos, msg.qtype)
+        || !detail::Get16(data, len, pos, qclass)) {
+        return false;
+    }
+
+    msg.addresses.clear();
+    std::string name;
+    for(std::uint16_t i = 0; i < ancount; ++i) {
+        std::uint16_t type = 0, rclass = 0, ttl_hi = 0, ttl_lo = 0, rdlen = 0;
+        if (!detail::GetName(data, len, pos, name)
+            || !detail::Get16(data, len, pos, type)
+            || !detail::Get16(data, len, pos, rclass)
+            || !detail::Get16(data, len, pos, ttl_hi)
+            || !detail::Get16(data, len, pos, ttl_lo)
+            || !detail::Get16(data, len, pos, rdlen)
+            || (pos + rdlen > len)) {
+            return false;
+        }
+
+        if ((rclass == CLASS_IN) && (type == msg.qtype)) {
+            if ((type == TYPE_A) && (rdlen == 4)) {
+                boost::asio::ip::address_v4::bytes_type bytes;
+                std::copy(data + pos, data + pos + 4, bytes.begin());
+                msg.addresses.push_back(boost::asio::ip::address_v4(bytes));
+            } else if ((type == TYPE_AAAA) && (rdlen == 16)) {
+                boost::asio::ip::address_v6::bytes_type bytes;
+                std::copy(data + pos, data + pos + 16, bytes.begin());
+                msg.addresses.push_back(boost::asio::ip::address_v6(bytes));
+            }
+        }
+
+        pos += rdlen;
+    }
+
+    return true;
+}
+
+/*! Make a response to a query
+ *
+ * Only the addresses that match the query type are included. If the
+ * answer does not fit in max_size bytes, we send what fits and set the
+ * truncated flag, like a real server would.
+ */
+inline void MakeResponse(std::string& out, const Message& query,
+                         std::uint16_t rcode,
+                         const std::vector<boost::asio::ip::address>& addresses,
+                         std::size_t max_size = max_udp_size) {
+    std::string question;
+    detail::PutName(question, query.qname);
+    detail::Put16(question, query.qtype);
+    detail::Put16(question, CLASS_IN);
+
+    std::vector<std::string> answers;
+    for(const auto& addr : addresses) {
+        const bool v4 = addr.is_v4();
+        if ((v4 && (query.qtype != TYPE_A))
+            || (!v4 && (query.qtype != TYPE_AAAA))) {
+            continue;
+        }
+
+        std::string rr;
+        detail::Put16(rr, 0xc00c); // Pointer to the name in the question
+        detail::Put16(rr, query.qtype);
+        detail::Put16(rr, CLASS_IN);
+        detail::Put32(rr, 60); // ttl
+        if (v4) {
+            const auto bytes = addr.to_v4().to_bytes();
+            detail::Put16(rr, static_cast<std::uint16_t>(bytes.size()));
+            rr.append(bytes.begin(), bytes.end());
+        } else {
+            const auto bytes = addr.to_v6().to_bytes();
+            detail::Put16(rr, static_cast<std::uint16_t>(bytes.size()));
+            rr.append(bytes.begin(), bytes.end());
+        }
+        answers.push_back(std::move(rr));
+    }
+
+    std::uint16_t flags = FLAG_RESPONSE | FLAG_RECURSION_AVAILABLE
+        | (query.flags & FLAG_RECURSION_DESIRED) | rcode;
+
+    std::size_t size = 12 + question.size();
+    std::uint16_t ancount = 0;
+    for(const auto& rr : answers) {
+        if (size + rr.size() > max_size) {
+            flags |= FLAG_TRUNCATED;
+            break;
+        }
+        size += rr.size();
+        ++ancount;
+    }
+
+    out.clear();
+    detail::Put16(out, query.id);
+    detail::Put16(out, flags);
+    detail::Put16(out, 1);
+    detail::Put16(out, ancount);
+    detail::Put16(out, 0);
+    detail::Put16(out, 0);
+    out += question;
+    for(std::uint16_t i = 0; i < ancount; ++i) {
+        out += answers[i];
+    }
+}
+
+} // namespace dns
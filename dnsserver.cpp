@@ -0,0 +1,311 @@
+
+/*
+ * A stand-in DNS server, for testing and benchmarking the built-in
+ * resolver in "modern.cpp" without touching the real DNS system.
+ *
+ * It answers A and AAAA queries over UDP and TCP from a zone-file with
+ * "name address" lines, and can make up IPv4 addresses for any other
+ * name. To exercise the resolver's error handling, it can drop queries,
+ * and send truncated UDP replies to force a retry over TCP.
+ *
+ *    dnsserver --port 5353 --synthesize --drop 0.05 --truncate 0.1
+ *    modern --builtin-resolver --dns-server 127.0.0.1:5353 \
+ *       --lookup-only --urls-file hosts.txt
+ *
+ * This code is in the public domain.
+ */
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <random>
+#include <functional>
+#include <chrono>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/program_options.hpp>
+
+#include "dns.h"
+
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+struct Options
+{
+    std::string address = "127.0.0.1";
+    unsigned short port = 5353;
+    std::string zone_file;
+    bool synthesize = false;
+    double drop = 0.0;
+    double truncate = 0.0;
+    int delay_ms = 0;
+    unsigned seed = 0;
+};
+
+class DnsServer
+{
+    using addresses_t = std::vector<boost::asio::ip::address>;
+
+    const Options options_;
+    boost::asio::io_service io_service_;
+    std::map<std::string, addresses_t> zone_;
+    std::mt19937 random_;
+
+public:
+    DnsServer(const Options& options)
+        : options_(options), random_(options.seed)
+    {
+        if (!options_.zone_file.empty()) {
+            LoadZone(options_.zone_file);
+        }
+    }
+
+    void Run() {
+        const udp::endpoint ep(boost::asio::ip::address::from_string(
+            options_.address), options_.port);
+
+        boost::asio::spawn(io_service_, std::bind(&DnsServer::ServeUdp, this,
+                                                  ep, std::placeholders::_1));
+        boost::asio::spawn(io_service_, std::bind(&DnsServer::AcceptTcp, this,
+                                                  tcp::endpoint(ep.address(),
+                                                                ep.port()),
+                                                  std::placeholders::_1));
+        std::clog << "Serving DNS on " << ep << " (UDP and TCP)" << std::endl;
+        io_service_.run();
+    }
+
+private:
+    void LoadZone(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+
+        std::string line;
+        while(std::getline(in, line)) {
+            std::istringstream words(line.substr(0, line.find('#')));
+            std::string name, address;
+            if (words >> name >> address) {
+                zone_[Normalize(name)].push_back(
+                    boost::asio::ip::address::from_string(address));
+            }
+        }
+    }
+
+    static std::string Normalize(std::string name) {
+        for(auto& ch : name) {
+            ch = static_cast<char>(::tolower(ch));
+        }
+        if (!name.empty() && (name.back() == '.')) {
+            name.pop_back();
+        }
+        return name;
+    }
+
+    bool Roll(double probability) {
+        return (probability > 0.0)
+            && (std::uniform_real_distribution<>(0.0, 1.0)(random_)
+                < probability);
+    }
+
+    /*! Make the reply to a query. Returns false if we should not reply */
+    bool Answer(const dns::Message& query, std::string& reply,
+                std::size_t max_size) {
+        const auto name = Normalize(query.qname);
+        auto it = zone_.find(name);
+
+        if (it != zone_.end()) {
+            dns::MakeResponse(reply, query, dns::RCODE_OK, it->second,
+                              max_size);
+            return true;
+        }
+
+        if (options_.synthesize) {
+            // Make up a stable address in 127/8 from the name
+            const auto hash = std::hash<std::string>()(name);
+            const addresses_t addresses = {boost::asio::ip::address_v4(
+                static_cast<std::uint32_t>((127u << 24) | (hash & 0xffffff)))};
+            dns::MakeResponse(reply, query, dns::RCODE_OK, addresses,
+                              max_size);
+            return true;
+        }
+
+        dns::MakeResponse(reply, query, dns::RCODE_NXDOMAIN, {}, max_size);
+        return true;
+    }
+
+    void ServeUdp(udp::endpoint ep, boost::asio::yield_context yield) {
+        udp::socket sck(io_service_, ep);
+        boost::system::error_code ec;
+        sck.set_option(udp::socket::receive_buffer_size(4 * 1024 * 1024), ec);
+
+        std::array<std::uint8_t, 4096> buffer;
+        std::string reply;
+
+        for(;;) {
+            udp::endpoint client;
+            const auto len = sck.async_receive_from(
+                boost::asio::buffer(buffer), client, yield);
+
+            dns::Message query;
+            if (!dns::Parse(buffer.data(), len, query) || query.IsResponse()
+                || Roll(options_.drop)) {
+                continue;
+            }
+
+            // A header-only reply with TC set sends the client to TCP
+            if (!Answer(query, reply, Roll(options_.truncate)
+                ? 0 : dns::max_udp_size)) {
+                continue;
+            }
+
+            if (options_.delay_ms) {
+                /* Wait in a coroutine of its own, with its own copy of the
+                 * reply, so that the queries after this one are delayed
+                 * by the same time, and not by the sum of the delays.
+                 */
+                boost::asio::spawn(io_service_, std::bind(
+                    &DnsServer::SendDelayed, this, std::ref(sck), reply,
+                    client, std::placeholders::_1));
+                continue;
+            }
+
+            sck.async_send_to(boost::asio::buffer(reply), client, yield[ec]);
+        }
+    }
+
+    void SendDelayed(udp::socket& sck, const std::string& reply,
+                     const udp::endpoint& client,
+                     boost::asio::yield_context yield) {
+        boost::asio::steady_timer timer(io_service_);
+        timer.expires_from_now(std::chrono::milliseconds(options_.delay_ms));
+        timer.async_wait(yield);
+
+        boost::system::error_code ec;
+        sck.async_send_to(boost::asio::buffer(reply), client, yield[ec]);
+    }
+
+    void AcceptTcp(tcp::endpoint ep, boost::asio::yield_context yield) {
+        tcp::acceptor acceptor(io_service_, ep);
+        boost::asio::steady_timer timer(io_service_);
+        for(;;) {
+            auto sck = std::make_shared<tcp::socket>(io_service_);
+            boost::system::error_code ec;
+            acceptor.async_accept(*sck, yield[ec]);
+            if (ec) {
+                std::cerr << "Accept failed on " << ep << ": "
+                    << ec.message() << std::endl;
+
+                /* Out of file descriptors, most likely. Give the
+                 * connections we have a chance to close, in stead of
+                 * spinning on the error.
+                 */
+                timer.expires_from_now(std::chrono::milliseconds(100));
+                timer.async_wait(yield[ec]);
+                continue;
+            }
+
+            boost::asio::spawn(io_service_, std::bind(
+                &DnsServer::ServeTcp, this, sck, std::placeholders::_1));
+        }
+    }
+
+    void ServeTcp(std::shared_ptr<tcp::socket> sck,
+                  boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        std::string reply;
+
+        // Each message is prefixed with a 16 bit length
+        for(;;) {
+            std::uint8_t len_bytes[2] = {};
+            boost::asio::async_read(*sck, boost::asio::buffer(len_bytes),
+                                    yield[ec]);
+            if (ec) {
+                return;
+            }
+
+            std::vector<std::uint8_t> buffer((len_bytes[0] << 8)
+                | len_bytes[1]);
+            boost::asio::async_read(*sck, boost::asio::buffer(buffer),
+                                    yield[ec]);
+
+            dns::Message query;
+            if (ec || !dns::Parse(buffer.data(), buffer.size(), query)
+                || !Answer(query, reply, 0xffff)) {
+                return;
+            }
+
+            len_bytes[0] = static_cast<std::uint8_t>(reply.size() >> 8);
+            len_bytes[1] = static_cast<std::uint8_t>(reply.size() & 0xff);
+            std::array<boost::asio::const_buffer, 2> buffers = {{
+                boost::asio::buffer(len_bytes), boost::asio::buffer(reply)
+            }};
+            boost::asio::async_write(*sck, buffers, yield[ec]);
+            if (ec) {
+                return;
+            }
+        }
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    namespace po = boost::program_options;
+
+    Options options;
+
+    po::options_description opts("Options");
+    opts.add_options()
+        ("help,h", "Print help and exit")
+        ("address", po::value(&options.address)->default_value(
+            options.address), "Address to listen on")
+        ("port", po::value(&options.port)->default_value(options.port),
+            "Port to listen on (UDP and TCP)")
+        ("zone", po::value(&options.zone_file),
+            "File with \"name address\" lines to serve")
+        ("synthesize", po::bool_switch(&options.synthesize),
+            "Make up an IPv4 address in 127/8 for names not in the zone")
+        ("drop", po::value(&options.drop)->default_value(options.drop),
+            "Probability for ignoring an UDP query")
+        ("truncate", po::value(&options.truncate)->default_value(
+            options.truncate),
+            "Probability for sending a truncated UDP reply")
+        ("delay", po::value(&options.delay_ms)->default_value(
+            options.delay_ms),
+            "Milliseconds to wait before each UDP reply")
+        ("seed", po::value(&options.seed)->default_value(options.seed),
+            "Seed for --drop and --truncate")
+        ;
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, opts), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: " << argv[0] << " [options]" << std::endl
+                << opts << std::endl;
+            return 0;
+        }
+
+        po::notify(vm);
+    } catch(const std::exception& ex) {
+        std::cerr << ex.what() << std::endl
+            << "Usage: " << argv[0] << " [options]" << std::endl
+            << opts << std::endl;
+        return -1;
+    }
+
+    try {
+        DnsServer server(options);
+        server.Run();
+    } catch(const std::exception& ex) {
+        std::cerr << "Caught exception " << ex.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,621 @@
+
+/*
+ * A misbehaving HTTP server, for benchmarking the clients.
+ *
+ * Real servers are slow, flaky, and sometimes downright hostile. To see
+ * how the Request implementations cope with that (and what it does to
+ * their tail latency), we need a server that misbehaves on demand,
+ * reproducibly, on loopback.
+ *
+ * Each rule is given as "port[/path]:fault[,fault...]", for example:
+ *
+ *    faultserver 8080: 8081:accept-delay=500 8082:blackhole \
+ *       8083/slow:first-byte-delay=200,rate=2000 8083:reset-after=4096
+ *
+ * Redirects are made with the status and location "faults":
+ *
+ *    faultserver 8080/old:status=301,location=/new 8080:
+ *
+ * Connections are kept open for more requests when the client asks for
+ * it with "Connection: keep-alive".
+ *
+ * A rule without a path applies to the whole port, and is also the
+ * default for paths that don't match any rule with a path. The longest
+ * matching path-prefix wins.
+ *
+ * The server uses the coroutine approach from "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <memory>
+#include <map>
+#include <vector>
+#include <random>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/program_options.hpp>
+
+using boost::asio::ip::tcp;
+
+/*! What can go wrong with a request */
+struct Faults
+{
+    /*! Probability (0.0 - 1.0) that we close the connection without a
+     * reply. The request headers are read first, as the rule is picked
+     * by the path, but not the body.
+     */
+    double drop = 0.0;
+
+    /*! Never accept() connections on this port. Port-level only. */
+    bool blackhole = false;
+
+    /*! Delay before each accept(), in milliseconds. Port-level only. */
+    int accept_delay_ms = 0;
+
+    /*! Delay between reading the request and sending the first byte */
+    int first_byte_delay_ms = 0;
+
+    /*! Bandwidth cap for the response, in bytes per second. 0 is unlimited */
+    std::size_t rate = 0;
+
+    /*! Largest number of bytes we hand to the kernel in one write */
+    std::size_t write_size = 16 * 1024;
+
+    /*! Send a TCP RST after this many bytes of the response. 0 disables */
+    std::size_t reset_after = 0;
+
+    /*! Send only this many bytes of the response, then close nicely.
+     * 0 disables */
+    std::size_t partial = 0;
+
+    /*! Pad the HTTP headers with junk to at least this many bytes */
+    std::size_t header_bytes = 0;
+
+    /*! Size of the body we send */
+    std::size_t body_size = 1024;
+
+    /*! Status code of the reply */
+    int status = 200;
+
+    /*! Value for a Location header, for redirects. Empty for none. */
+    std::string location;
+
+    /*! Parse "key=value,key,..." */
+    static Faults Parse(const std::string& spec) {
+        Faults f;
+        std::istringstream in(spec);
+        std::string item;
+
+        while(std::getline(in, item, ',')) {
+            if (item.empty()) {
+                continue;
+            }
+
+            const auto eq = item.find('=');
+            const auto key = item.substr(0, eq);
+            const auto value = (eq == std::string::npos)
+                ? std::string() : item.substr(eq + 1);
+
+            if (key == "drop") f.drop = std::stod(value);
+            else if (key == "blackhole") f.blackhole = true;
+            else if (key == "accept-delay") f.accept_delay_ms = std::stoi(value);
+            else if (key == "first-byte-delay") f.first_byte_delay_ms = std::stoi(value);
+            else if (key == "rate") f.rate = std::stoul(value);
+            else if (key == "write-size") f.write_size = std::max(1ul, std::stoul(value));
+            else if (key == "reset-after") f.reset_after = std::stoul(value);
+            else if (key == "partial") f.partial = std::stoul(value);
+            else if (key == "header-bytes") f.header_bytes = std::stoul(value);
+            else if (key == "body-size") f.body_size = std::stoul(value);
+            else if (key == "status") f.status = std::stoi(value);
+            else if (key == "location") f.location = value;
+            else {
+                throw std::invalid_argument("Unknown fault: " + key);
+            }
+        }
+
+        return f;
+    }
+};
+
+/*! All the rules for one port */
+struct PortRules
+{
+    Faults port_faults;
+    std::map<std::string, Faults> path_faults;
+
+    const Faults& Lookup(const std::string& path) const {
+        const Faults *best = &port_faults;
+        std::size_t best_len = 0;
+
+        for(const auto& it : path_faults) {
+            if ((it.first.size() > best_len)
+                && (path.compare(0, it.first.size(), it.first) == 0)) {
+                best = &it.second;
+                best_len = it.first.size();
+            }
+        }
+
+        return *best;
+    }
+};
+
+class FaultServer
+{
+    using strand_t = boost::asio::strand<
+        boost::asio::io_service::executor_type>;
+
+    boost::asio::io_service io_service_;
+    std::map<unsigned short, PortRules> rules_;
+    std::vector<std::unique_ptr<tcp::socket>> backlog_fillers_;
+    std::mutex backlog_fillers_mutex_;
+    std::mt19937 random_;
+    std::mutex random_mutex_;
+
+public:
+    FaultServer(unsigned seed) : random_(seed) {}
+
+    /*! Add a rule in the "port[/path]:fault[,fault...]" format */
+    void AddRule(const std::string& rule) {
+        const auto colon = rule.find(':');
+        if (colon == std::string::npos) {
+            throw std::invalid_argument("Missing ':' in rule: " + rule);
+        }
+
+        const auto target = rule.substr(0, colon);
+        const auto slash = target.find('/');
+        const auto port = static_cast<unsigned short>(
+            std::stoul(target.substr(0, slash)));
+        auto faults = Faults::Parse(rule.substr(colon + 1));
+
+        auto& port_rules = rules_[port];
+        if (slash == std::string::npos) {
+            port_rules.port_faults = faults;
+        } else {
+            port_rules.path_faults[target.substr(slash)] = faults;
+        }
+    }
+
+    void Run(const std::string& address, int threads) {
+        for(const auto& it : rules_) {
+            const tcp::endpoint ep(boost::asio::ip::address::from_string(
+                address), it.first);
+            boost::asio::spawn(io_service_, std::bind(&FaultServer::Accept,
+                                                      this, ep,
+                                                      std::cref(it.second),
+                                                      std::placeholders::_1));
+        }
+
+        std::vector<std::thread> workers;
+        for(int i = 1; i < threads; ++i) {
+            workers.emplace_back([this]() { io_service_.run(); });
+        }
+        io_service_.run();
+
+        for(auto& t : workers) {
+            t.join();
+        }
+    }
+
+private:
+    bool Roll(double probability) {
+        if (probability <= 0.0) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(random_mutex_);
+        return std::uniform_real_distribution<>(0.0, 1.0)(random_)
+            < probability;
+    }
+
+    void Accept(tcp::endpoint ep, const PortRules& rules,
+                boost::asio::yield_context yield) {
+        tcp::acceptor acceptor(io_service_);
+        acceptor.open(ep.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        acceptor.bind(ep);
+
+        if (rules.port_faults.blackhole) {
+            /* Never accept. Once the accept queue is full, the kernel
+             * silently drops new SYN's, so the clients connect() hangs.
+             * We fill the queue ourself so that it happens right away.
+             */
+            acceptor.listen(0);
+            const auto strand = boost::asio::make_strand(io_service_);
+            boost::asio::spawn(strand, std::bind(&FaultServer::FillBacklog,
+                                                 this,
+                                                 acceptor.local_endpoint(),
+                                                 strand,
+                                                 std::placeholders::_1));
+            boost::asio::steady_timer forever(io_service_,
+                std::chrono::steady_clock::time_point::max());
+            boost::system::error_code ec;
+            forever.async_wait(yield[ec]);
+            return;
+        }
+
+        acceptor.listen();
+        std::clog << "Listening on " << ep << std::endl;
+
+        boost::asio::steady_timer timer(io_service_);
+        for(;;) {
+            if (rules.port_faults.accept_delay_ms) {
+                timer.expires_from_now(std::chrono::milliseconds(
+                    rules.port_faults.accept_delay_ms));
+                timer.async_wait(yield);
+            }
+
+            auto sck = std::make_shared<tcp::socket>(io_service_);
+            boost::system::error_code ec;
+            acceptor.async_accept(*sck, yield[ec]);
+            if (ec) {
+                std::cerr << "Accept failed on " << ep << ": "
+                    << ec.message() << std::endl;
+
+                /* Out of file descriptors, most likely. Give the
+                 * connections we have a chance to close, in stead of
+                 * spinning on the error.
+                 */
+                timer.expires_from_now(std::chrono::milliseconds(100));
+                timer.async_wait(yield[ec]);
+                continue;
+            }
+
+            boost::asio::spawn(io_service_, std::bind(&FaultServer::Serve,
+                                                      this, sck, std::cref(rules),
+                                                      std::placeholders::_1));
+        }
+    }
+
+    /*! Connect until a connect times out. Then the queue is full.
+     *
+     * Runs in strand, so that the timeout can't cancel the socket
+     * while the coroutine uses it.
+     */
+    void FillBacklog(tcp::endpoint ep, strand_t strand,
+                     boost::asio::yield_context yield) {
+        boost::asio::steady_timer timer(io_service_);
+        std::size_t filled = 0;
+        for(; filled < 64; ++filled) {
+            auto sck = std::make_unique<tcp::socket>(io_service_);
+            auto *raw = sck.get();
+            auto connecting = std::make_shared<bool>(true);
+
+            timer.expires_from_now(std::chrono::milliseconds(100));
+            timer.async_wait(boost::asio::bind_executor(strand,
+                [raw, connecting](const boost::system::error_code& ec) {
+                    if (!ec && *connecting) {
+                        raw->cancel(); // The SYN was dropped
+                    }
+                }));
+
+            boost::system::error_code ec;
+            sck->async_connect(ep, yield[ec]);
+            *connecting = false;
+            timer.cancel();
+            if (ec) {
+                break;
+            }
+
+            std::lock_guard<std::mutex> lock(backlog_fillers_mutex_);
+            backlog_fillers_.push_back(std::move(sck));
+        }
+
+        std::clog << "Blackholing " << ep << " (" << filled
+            << " connections in the queue)" << std::endl;
+    }
+
+    void Serve(std::shared_ptr<tcp::socket> sck, const PortRules& rules,
+               boost::asio::yield_context yield) {
+        try {
+            boost::asio::streambuf request;
+            for(std::size_t served = 1;; ++served) {
+                if (!ServeOne(*sck, request, rules, served, yield)) {
+                    return;
+                }
+            }
+        } catch(const std::exception& ex) {
+            std::cerr << "Connection failed: " << ex.what() << std::endl;
+        }
+    }
+
+    /*! Serve one request on a connection
+     *
+     * @param served The number of the request on this connection
+     * @returns true if the client wants the connection kept open
+     */
+    bool ServeOne(tcp::socket& sck, boost::asio::streambuf& request,
+                  const PortRules& rules, std::size_t served,
+                  boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        boost::asio::async_read_until(sck, request, "\r\n\r\n", yield[ec]);
+        if (ec) {
+            if (served > 1) {
+                return false; // The client is done with the connection
+            }
+            throw boost::system::system_error(ec);
+        }
+
+        std::istream in(&request);
+        std::string method, path, line;
+        in >> method >> path;
+        std::getline(in, line);
+
+        std::size_t content_length = 0;
+        bool chunked = false;
+        bool keep_alive = false;
+        while(std::getline(in, line) && (line != "\r")) {
+            const auto colon = line.find(':');
+            auto name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(),
+                           ::tolower);
+            auto value = (colon == std::string::npos)
+                ? std::string() : line.substr(colon + 1);
+            if (name == "content-length") {
+                content_length = std::stoul(value);
+            } else if ((name == "transfer-encoding")
+                       && (value.find("chunked") != std::string::npos)) {
+                chunked = true;
+            } else if (name == "connection") {
+                std::transform(value.begin(), value.end(), value.begin(),
+                               ::tolower);
+                keep_alive = value.find("keep-alive") != std::string::npos;
+            }
+        }
+
+        const auto& f = rules.Lookup(path);
+        if (Roll(f.drop)) {
+            return false; // The socket is closed when we leave.
+        }
+
+        // Read (and throw away) the request body, if there is one
+        BodySink sink;
+        if (chunked) {
+            ReadChunkedBody(sck, request, sink, yield);
+        } else if (content_length) {
+            ReadBody(sck, request, content_length, sink, yield);
+        }
+
+        const auto reply = MakeReply(f, sink, keep_alive, served);
+        std::size_t limit = reply.size();
+        if (f.partial) {
+            limit = std::min(limit, f.partial);
+        }
+        if (f.reset_after) {
+            limit = std::min(limit, f.reset_after);
+        }
+
+        boost::asio::steady_timer timer(io_service_);
+        if (f.first_byte_delay_ms) {
+            timer.expires_from_now(std::chrono::milliseconds(
+                f.first_byte_delay_ms));
+            timer.async_wait(yield);
+        }
+
+        const auto started = std::chrono::steady_clock::now();
+        std::size_t sent = 0;
+        while(sent < limit) {
+            const auto bytes = std::min(f.write_size, limit - sent);
+            boost::asio::async_write(sck, boost::asio::buffer(
+                reply.data() + sent, bytes), yield);
+            sent += bytes;
+
+            if (f.rate && (sent < limit)) {
+                // Sleep until we are back below the bandwidth cap
+                timer.expires_at(started + std::chrono::microseconds(
+                    sent * 1000000 / f.rate));
+                timer.async_wait(yield);
+            }
+        }
+
+        if (f.reset_after && (sent < reply.size())) {
+            // A zero linger-time makes close() send a RST
+            sck.set_option(boost::asio::socket_base::linger(true, 0));
+            sck.close();
+            return false;
+        }
+
+        if (keep_alive && (sent == reply.size())) {
+            return true;
+        }
+
+        sck.shutdown(tcp::socket::shutdown_both);
+        return false;
+    }
+
+    /*! Counts and hashes the request body, so the client can check
+     * that its upload arrived intact.
+     */
+    struct BodySink {
+        std::size_t bytes = 0;
+        std::uint64_t fnv = 14695981039346656037ull; // FNV-1a
+
+        void Add(const char *data, std::size_t len) {
+            bytes += len;
+            for(std::size_t i = 0; i < len; ++i) {
+                fnv = (fnv ^ static_cast<unsigned char>(data[i]))
+                    * 1099511628211ull;
+            }
+        }
+    };
+
+    /*! Read len bytes of body, starting with what is already in buffer */
+    static void ReadBody(tcp::socket& sck, boost::asio::streambuf& buffer,
+                         std::size_t len, BodySink& sink,
+                         boost::asio::yield_context yield) {
+        while(len) {
+            if (!buffer.size()) {
+                buffer.commit(sck.async_read_some(buffer.prepare(64 * 1024),
+                                                  yield));
+            }
+
+            const auto bytes = std::min(len, buffer.size());
+            sink.Add(boost::asio::buffer_cast<const char *>(buffer.data()),
+                     bytes);
+            buffer.consume(bytes);
+            len -= bytes;
+        }
+    }
+
+    static void ReadChunkedBody(tcp::socket& sck,
+                                boost::asio::streambuf& buffer,
+                                BodySink& sink,
+                                boost::asio::yield_context yield) {
+        BodySink crlf;
+        for(;;) {
+            boost::asio::async_read_until(sck, buffer, "\r\n", yield);
+            std::istream in(&buffer);
+            std::string size_line;
+            std::getline(in, size_line);
+            const auto len = std::stoul(size_line, nullptr, 16);
+            if (!len) {
+                // No trailers from our clients; just the last CRLF
+                boost::asio::async_read_until(sck, buffer, "\r\n", yield);
+                return;
+            }
+
+            ReadBody(sck, buffer, len, sink, yield);
+            ReadBody(sck, buffer, 2, crlf, yield);
+        }
+    }
+
+    static const char *Reason(int status) {
+        switch(status) {
+        case 200: return "OK";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 404: return "Not Found";
+        }
+        return "Fault";
+    }
+
+    std::string MakeReply(const Faults& f, const BodySink& sink,
+                          bool keep_alive, std::size_t served) const {
+        std::ostringstream out;
+        out << "HTTP/1.1 " << f.status << ' ' << Reason(f.status) << "\r\n"
+            << "Content-Type: text/plain\r\n"
+            << "Content-Length: " << f.body_size << "\r\n";
+
+        if (keep_alive) {
+            // So the client can see that the connection was reused
+            out << "Connection: keep-alive\r\n"
+                << "X-Request-Number: " << served << "\r\n";
+        } else {
+            out << "Connection: close\r\n";
+        }
+
+        if (!f.location.empty()) {
+            out << "Location: " << f.location << "\r\n";
+        }
+
+        if (sink.bytes) {
+            out << "X-Body-Bytes: " << sink.bytes << "\r\n"
+                << "X-Body-Fnv1a: " << std::hex << sink.fnv << std::dec
+                << "\r\n";
+        }
+
+        static const std::string padding_name = "X-Padding: ";
+        while(static_cast<std::size_t>(out.tellp()) + 2 < f.header_bytes) {
+            const auto remaining = f.header_bytes
+                - static_cast<std::size_t>(out.tellp());
+            const auto value_len = std::min<std::size_t>(
+                4000, remaining > padding_name.size() + 4
+                    ? remaining - padding_name.size() - 4 : 1);
+            out << padding_name << std::string(value_len, 'p') << "\r\n";
+        }
+
+        out << "\r\n" << std::string(f.body_size, 'x');
+        return out.str();
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    namespace po = boost::program_options;
+
+    std::string address = "127.0.0.1";
+    std::vector<std::string> rules;
+    int threads = 1;
+    unsigned seed = 0;
+
+    po::options_description opts("Options");
+    opts.add_options()
+        ("help,h", "Print help and exit")
+        ("address", po::value(&address)->default_value(address),
+            "Address to listen on")
+        ("threads", po::value(&threads)->default_value(threads),
+            "Number of IO threads")
+        ("seed", po::value(&seed)->default_value(seed),
+            "Seed for the random faults (drop)")
+        ;
+
+    po::options_description hidden;
+    hidden.add_options()
+        ("rule", po::value(&rules)->required(), "port[/path]:faults");
+
+    po::options_description all;
+    all.add(opts).add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("rule", -1);
+
+    static const char *usage = " [options] port[/path]:fault[,fault...] ...\n"
+        "\nFaults:\n"
+        "  drop=P               Close without a reply with probability P\n"
+        "  blackhole            Never accept (port-level)\n"
+        "  accept-delay=MS      Sleep before each accept (port-level)\n"
+        "  first-byte-delay=MS  Sleep before sending the reply\n"
+        "  rate=BPS             Cap the reply to BPS bytes per second\n"
+        "  write-size=N         Write at most N bytes at a time\n"
+        "  reset-after=N        Send a RST after N bytes\n"
+        "  partial=N            Close nicely after N bytes\n"
+        "  header-bytes=N       Pad the headers to N bytes\n"
+        "  body-size=N          Size of the body (default 1024)\n"
+        "  status=N             Status code of the reply (default 200)\n"
+        "  location=URL         Location header, for redirects\n";
+
+    try {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(all)
+            .positional(positional).run(), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: " << argv[0] << usage << std::endl
+                << opts << std::endl;
+            return 0;
+        }
+
+        po::notify(vm);
+    } catch(const std::exception& ex) {
+        std::cerr << ex.what() << std::endl
+            << "Usage: " << argv[0] << usage << std::endl
+            << opts << std::endl;
+        return -1;
+    }
+
+    try {
+        FaultServer server(seed);
+        for(const auto& rule : rules) {
+            server.AddRule(rule);
+        }
+
+        server.Run(address, threads);
+    } catch(const std::exception& ex) {
+        std::cerr << "Caught exception " << ex.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Host names and addresses given on the command line: parsing of
+ * "address:port" strings, and the static host-name mappings from
+ * --resolve and --hosts-file.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+
+/*! Parse a port number */
+inline unsigned short ParsePort(const std::string& port) {
+    const auto num = std::stoul(port);
+    if (!num || (num > 0xffff)) {
+        throw std::invalid_argument("Invalid port: " + port);
+    }
+    return static_cast<unsigned short>(num);
+}
+
+/*! Parse an address with an optional port
+ *
+ * Accepts "1.2.3.4", "1.2.3.4:80", "::1", "[::1]" or "[::1]:80".
+ *
+ * @param port The port to use if the address has none
+ */
+inline boost::asio::ip::tcp::endpoint ParseEndpoint(std::string address,
+                                                     unsigned short port) {
+    if (!address.empty() && (address[0] == '[')) {
+        const auto end = address.find(']');
+        if (end == std::string::npos) {
+            throw std::invalid_argument("Invalid address: " + address);
+        }
+        if ((end + 1 < address.size()) && (address[end + 1] == ':')) {
+            port = ParsePort(address.substr(end + 2));
+        }
+        address = address.substr(1, end - 1);
+    } else if (std::count(address.begin(), address.end(), ':') == 1) {
+        const auto colon = address.find(':');
+        port = ParsePort(address.substr(colon + 1));
+        address.resize(colon);
+    }
+
+    return {boost::asio::ip::address::from_string(address), port};
+}
+
+/*! Static host-name to address mappings.
+ *
+ * These are consulted before the DNS system, so that requests to hosts
+ * with well-known addresses can start to connect right away.
+ *
+ * Entries are added either curl "--resolve" style, as
+ * "host:port:address[,address...]", or from a file in the
+ * "/etc/hosts" format, where the entries apply to any port.
+ *
+ * An address can have a port, as in "127.0.0.1:8080" or "[::1]:8080",
+ * to send the connection to another port than the one in the URL.
+ */
+class HostOverrides
+{
+    using tcp = boost::asio::ip::tcp;
+
+    // "host:port" or just "host" for entries from hosts-files
+    std::map<std::string, std::vector<tcp::endpoint>> entries_;
+
+public:
+    /*! Add a "host:port:address[,address...]" entry */
+    void Add(const std::string& spec) {
+        const auto host_end = spec.find(':');
+        const auto port_end = (host_end == std::string::npos)
+            ? host_end : spec.find(':', host_end + 1);
+        if (port_end == std::string::npos) {
+            throw std::invalid_argument(
+                "Expected host:port:address, got " + spec);
+        }
+
+        const auto port = ParsePort(spec.substr(host_end + 1,
+                                             port_end - host_end - 1));
+        auto& endpoints = entries_[Key(spec.substr(0, host_end), port)];
+
+        std::istringstream in(spec.substr(port_end + 1));
+        std::string address;
+        while(std::getline(in, address, ',')) {
+            endpoints.push_back(ParseEndpoint(address, port));
+        }
+    }
+
+    /*! Add all the entries in a hosts-file */
+    void Load(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+
+        std::string line;
+        while(std::getline(in, line)) {
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream words(line);
+            std::string address, host;
+            if (!(words >> address)) {
+                continue;
+            }
+
+            const auto ep = ParseEndpoint(address, 0);
+            while(words >> host) {
+                entries_[Key(host, 0)].push_back(ep);
+            }
+        }
+    }
+
+    /*! Look up a host
+     *
+     * @returns true if the host was found. The endpoints are then added to
+     *   endpoints.
+     */
+    template <typename EndpointsT>
+    bool Lookup(const std::string& host, const std::string& port,
+                EndpointsT& endpoints) const {
+        if (entries_.empty()) {
+            return false;
+        }
+
+        const auto port_num = ParsePort(port);
+        auto it = entries_.find(Key(host, port_num));
+        if (it == entries_.end()) {
+            it = entries_.find(Key(host, 0));
+            if (it == entries_.end()) {
+                return false;
+            }
+        }
+
+        for(auto ep : it->second) {
+            if (!ep.port()) {
+                ep.port(port_num);
+            }
+            endpoints.push_back(ep);
+        }
+
+        return true;
+    }
+
+private:
+    static std::string Key(std::string host, unsigned short port) {
+        std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+        if (port) {
+            host += ":" + std::to_string(port);
+        }
+        return host;
+    }
+};
@@ -0,0 +1,510 @@
+/*
+ * The HTTP bits of "modern.cpp": URLs, the errors a fetch can fail
+ * with, and the parsing of responses as they are read.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/utility/string_view.hpp>
+
+#include "hosts.h"
+
+/*! Errors from the fetch path that the system has no error code for.
+ *
+ * The fetch path reports failures as error codes, in stead of throwing
+ * exceptions. When thousands of hosts in a batch are dead, throwing and
+ * unwinding for each of them costs more CPU than the fetches.
+ */
+enum class FetchError
+{
+    invalid_url = 1,
+    connect_failed,
+    body_too_large,
+    upload_truncated,
+    too_many_redirects
+};
+
+class FetchErrorCategory : public boost::system::error_category
+{
+public:
+    const char *name() const noexcept override { return "fetch"; }
+
+    std::string message(int ev) const override {
+        switch(static_cast<FetchError>(ev)) {
+        case FetchError::invalid_url:
+            return "Invalid URL";
+        case FetchError::connect_failed:
+            return "Unable to connect to any host";
+        case FetchError::body_too_large:
+            return "The response body is too large";
+        case FetchError::upload_truncated:
+            return "The file ended before the request body was sent";
+        case FetchError::too_many_redirects:
+            return "Too many redirects";
+        }
+        return "Unknown fetch error";
+    }
+};
+
+inline const boost::system::error_category& fetch_category() {
+    static const FetchErrorCategory category;
+    return category;
+}
+
+inline boost::system::error_code make_error_code(FetchError e) {
+    return {static_cast<int>(e), fetch_category()};
+}
+
+namespace boost { namespace system {
+template<> struct is_error_code_enum<FetchError> : std::true_type {};
+}} // namespace boost::system
+
+/*! The parts of a "http://host[:port][/path]" URL that we care about.
+ *
+ * The scheme is optional, so a plain host-name works as before.
+ */
+struct Url
+{
+    std::string host;
+    std::string port = "80";
+    std::string path = "/";
+
+    static Url Parse(const std::string& url) {
+        Url rval;
+        if (!TryParse(url, rval)) {
+            throw std::invalid_argument("Invalid URL: " + url);
+        }
+        return rval;
+    }
+
+    /*! Parse without throwing
+     *
+     * @returns false if the URL is invalid
+     */
+    static bool TryParse(const std::string& url, Url& rval) {
+        static const std::string scheme = "http://";
+
+        auto start = url.compare(0, scheme.size(), scheme) ? 0 : scheme.size();
+        auto path_start = url.find('/', start);
+        if (path_start != std::string::npos) {
+            rval.path = url.substr(path_start);
+        }
+
+        auto authority = url.substr(start, path_start - start);
+        auto port_start = authority.rfind(':');
+        if ((port_start != std::string::npos)
+            && (authority.find(']', port_start) == std::string::npos)) {
+            rval.port = authority.substr(port_start + 1);
+            authority.resize(port_start);
+        }
+
+        // Strip the brackets from IPv6 literals
+        if ((authority.size() > 2) && (authority.front() == '[')
+            && (authority.back() == ']')) {
+            authority = authority.substr(1, authority.size() - 2);
+        }
+
+        rval.host = authority;
+
+        /* With a valid port here, the fetch path can convert it with
+         * ParsePort() without having to deal with exceptions.
+         */
+        return !rval.host.empty() && !rval.port.empty()
+            && (rval.port.size() <= 5)
+            && (rval.port.find_first_not_of("0123456789") == std::string::npos)
+            && (std::stoul(rval.port) > 0) && (std::stoul(rval.port) <= 0xffff);
+    }
+
+    /*! Where a Location header in the response for this URL points to
+     *
+     * The location can be absolute, or relative to this URL.
+     *
+     * @returns false if we can't go there (say, it's https)
+     */
+    bool Redirect(std::string location, Url& rval) const {
+        location = location.substr(0, location.find('#'));
+        if (location.empty()) {
+            return false;
+        }
+
+        if (location.compare(0, 2, "//") == 0) {
+            // Same scheme, other host
+            rval = {};
+            return TryParse("http:" + location, rval);
+        }
+
+        if (location.find("://") != std::string::npos) {
+            rval = {};
+            return (location.compare(0, 7, "http://") == 0)
+                && TryParse(location, rval);
+        }
+
+        rval = *this;
+        if (location.front() == '/') {
+            rval.path = location;
+        } else {
+            // Relative to the "directory" of our path
+            const auto dir = path.substr(0, path.find('?'));
+            rval.path = dir.substr(0, dir.rfind('/') + 1) + location;
+        }
+        return true;
+    }
+
+    /*! The "host:port" we connect to, in lower case */
+    std::string Origin() const {
+        auto rval = host + ":" + port;
+        std::transform(rval.begin(), rval.end(), rval.begin(), ::tolower);
+        return rval;
+    }
+
+    /*! The value for the Host header */
+    std::string HostHeader() const {
+        std::string rval;
+        AppendHostHeader(rval);
+        return rval;
+    }
+
+    /*! Append the value for the Host header to any kind of string */
+    template <typename StringT>
+    void AppendHostHeader(StringT& out) const {
+        const bool v6 = host.find(':') != std::string::npos;
+        if (v6) {
+            out += '[';
+        }
+        out.append(host.data(), host.size());
+        if (v6) {
+            out += ']';
+        }
+        if (port != "80") {
+            out += ':';
+            out.append(port.data(), port.size());
+        }
+    }
+};
+
+/*! The reply from a HTTP server.
+ *
+ * The data is kept as it was received; the socket reads straight into
+ * the end of it (Prepare() and Commit()). While we read, we only look
+ * for the end of the headers. When we find it, we note the status code
+ * and where each header line starts and ends. Header values are not
+ * parsed until someone asks for them, and the body is a view into the
+ * received data, so consumers that only need the status or one header
+ * pay for just that. A chunked body is followed chunk by chunk as it
+ * arrives, so that we know where it ends.
+ */
+class Response
+{
+public:
+    using view_t = boost::string_view;
+
+private:
+    struct Line {
+        std::uint32_t begin;
+        std::uint32_t end;
+    };
+
+    std::string data_;
+    std::size_t header_size_ = 0;
+    int status_ = 0;
+    std::vector<Line> lines_;
+    std::size_t committed_ = 0; // The part of data_ we have received
+
+    // For chunked bodies
+    bool chunked_ = false;
+    bool last_chunk_ = false;
+    std::size_t next_chunk_ = 0; // Where the next chunk-size line starts
+
+public:
+    /*! Room for len more bytes at the end of the data
+     *
+     * The data is not received until Commit() is called.
+     */
+    char *Prepare(std::size_t len) {
+        data_.resize(committed_ + len);
+        return &data_[committed_];
+    }
+
+    /*! Receive len bytes that were written to Prepare() */
+    void Commit(std::size_t len) {
+        const auto searched = committed_;
+        committed_ += len;
+        data_.resize(committed_);
+
+        if (!header_size_) {
+            FindEndOfHeaders(searched);
+        }
+        if (chunked_ && !last_chunk_) {
+            FollowChunks();
+        }
+    }
+
+    /*! Add data received from the server */
+    void Append(const char *data, std::size_t len) {
+        std::memcpy(Prepare(len), data, len);
+        Commit(len);
+    }
+
+    /*! Unused room from Prepare(), that the next one can use without
+     * growing the buffer
+     */
+    std::size_t GetSpare() const { return data_.capacity() - committed_; }
+
+    /*! Make room for a body of len bytes, so that it's not moved as it
+     * grows
+     */
+    void ReserveBody(std::size_t len) {
+        if (header_size_) {
+            data_.reserve(header_size_ + len);
+        }
+    }
+
+    /*! Cut the body to at most len bytes */
+    void TruncateBody(std::size_t len) {
+        if (header_size_ && (data_.size() > header_size_ + len)) {
+            data_.resize(header_size_ + len);
+            committed_ = data_.size();
+        }
+    }
+
+    /*! True when we have received all the headers */
+    bool HasHeaders() const { return header_size_ != 0; }
+
+    /*! The size of the headers, including the empty line after them */
+    std::size_t GetHeaderSize() const { return header_size_; }
+
+    /*! The HTTP status code, or 0 if we don't have it */
+    int GetStatus() const { return status_; }
+
+    /*! The value of the first header with this name, or an empty view.
+     *
+     * The name is case-insensitive.
+     */
+    view_t GetHeader(view_t name) const {
+        for(const auto& line : lines_) {
+            const view_t text(data_.data() + line.begin, line.end - line.begin);
+            if ((text.size() > name.size()) && (text[name.size()] == ':')
+                && std::equal(name.begin(), name.end(), text.begin(),
+                              [](char a, char b) {
+                                  return ::tolower(a) == ::tolower(b);
+                              })) {
+                return Trim(text.substr(name.size() + 1));
+            }
+        }
+        return {};
+    }
+
+    /*! Get the value of the Content-Length header
+     *
+     * @returns false if there is none, or it's not a number we can use
+     */
+    bool GetContentLength(std::size_t& length) const {
+        const auto value = GetHeader("Content-Length");
+        if (value.empty() || (value.size() >= 19)
+            || (value.find_first_not_of("0123456789") != view_t::npos)) {
+            return false;
+        }
+        length = std::stoull(value.to_string());
+        return true;
+    }
+
+    /*! True when we have all of the response
+     *
+     * We know that from the Content-Length, or the last chunk of a
+     * chunked body, and the trailers after it. Without them, the body
+     * ends when the server closes the connection, and we can't tell.
+     */
+    bool IsComplete() const {
+        if (!header_size_) {
+            return false;
+        }
+        if ((status_ == 204) || (status_ == 304)) {
+            return true;
+        }
+
+        std::size_t length = 0;
+        if (GetContentLength(length)) {
+            return data_.size() >= header_size_ + length;
+        }
+
+        if (chunked_) {
+            return last_chunk_;
+        }
+
+        return false;
+    }
+
+    /*! True if the server lets us send another request on the connection */
+    bool KeepsAlive() const {
+        const auto connection = GetHeader("Connection");
+        if (HasToken(connection, "close")) {
+            return false;
+        }
+        return view_t(data_).starts_with("HTTP/1.1")
+            || HasToken(connection, "keep-alive");
+    }
+
+    /*! The body, or what we have of it so far */
+    view_t GetBody() const {
+        if (!header_size_) {
+            return {};
+        }
+        return view_t(data_).substr(header_size_);
+    }
+
+    /*! Everything we received, headers and body */
+    const std::string& GetData() const { return data_; }
+
+    /*! Move the received data out of the object */
+    std::string TakeData() {
+        header_size_ = 0;
+        status_ = 0;
+        lines_.clear();
+        committed_ = 0;
+        chunked_ = last_chunk_ = false;
+        next_chunk_ = 0;
+        return std::move(data_);
+    }
+
+private:
+    /*! Look for the end of the headers
+     *
+     * @param searched How much of data_ we have already searched
+     */
+    void FindEndOfHeaders(std::size_t searched) {
+        static const std::string end_of_headers = "\r\n\r\n";
+        const auto pos = data_.find(end_of_headers,
+                                    searched > 3 ? searched - 3 : 0);
+        if (pos == std::string::npos) {
+            return;
+        }
+        header_size_ = pos + end_of_headers.size();
+
+        // Index the lines. The first one is the status line.
+        std::size_t begin = 0;
+        while(begin < pos) {
+            auto end = data_.find("\r\n", begin);
+            if (begin) {
+                lines_.push_back({static_cast<std::uint32_t>(begin),
+                                  static_cast<std::uint32_t>(end)});
+            } else {
+                ParseStatus(view_t(data_.data(), end));
+            }
+            begin = end + 2;
+        }
+
+        chunked_ = HasToken(GetHeader("Transfer-Encoding"), "chunked");
+        next_chunk_ = header_size_;
+    }
+
+    /*! Step over the chunks we have all of
+     *
+     * Each chunk is a line with the size in hex (and maybe extensions
+     * after a ';'), the data, and a CRLF. The last chunk has size 0,
+     * and is followed by trailer lines, and an empty line.
+     */
+    void FollowChunks() {
+        while(next_chunk_ < data_.size()) {
+            const auto eol = data_.find("\r\n", next_chunk_);
+            if (eol == std::string::npos) {
+                return; // Not all of the size line yet
+            }
+
+            std::size_t size = 0;
+            std::size_t digits = 0;
+            for(auto pos = next_chunk_; pos < eol; ++pos, ++digits) {
+                const int value = HexValue(data_[pos]);
+                if (value < 0) {
+                    break;
+                }
+                if (digits == 15) {
+                    return; // Too large to be real. It never completes.
+                }
+                size = (size << 4) | static_cast<std::size_t>(value);
+            }
+            if (!digits) {
+                return; // Not a chunk. It never completes.
+            }
+
+            if (size) {
+                next_chunk_ = eol + 2 + size + 2;
+                continue;
+            }
+
+            // The last chunk. The trailers end with an empty line.
+            const auto trailers = eol + 2;
+            if (data_.compare(trailers, 2, "\r\n") == 0) {
+                last_chunk_ = true;
+            } else if (data_.size() - trailers >= 2) {
+                last_chunk_ = data_.find("\r\n\r\n", trailers)
+                    != std::string::npos;
+            }
+            return;
+        }
+    }
+
+    static int HexValue(char ch) {
+        if ((ch >= '0') && (ch <= '9')) {
+            return ch - '0';
+        }
+        if ((ch >= 'a') && (ch <= 'f')) {
+            return ch - 'a' + 10;
+        }
+        if ((ch >= 'A') && (ch <= 'F')) {
+            return ch - 'A' + 10;
+        }
+        return -1;
+    }
+
+    /*! Get the code from "HTTP/1.1 200 OK" */
+    void ParseStatus(view_t line) {
+        const auto space = line.find(' ');
+        if ((line.substr(0, 5) != "HTTP/") || (space == view_t::npos)
+            || (line.size() < space + 4)) {
+            return;
+        }
+
+        int status = 0;
+        for(std::size_t i = space + 1; i < space + 4; ++i) {
+            if ((line[i] < '0') || (line[i] > '9')) {
+                return;
+            }
+            status = (status * 10) + (line[i] - '0');
+        }
+        status_ = status;
+    }
+
+    /*! Case-insensitive search for token in a header value */
+    static bool HasToken(view_t value, view_t token) {
+        return std::search(value.begin(), value.end(), token.begin(),
+                           token.end(), [](char a, char b) {
+                               return ::tolower(a) == ::tolower(b);
+                           }) != value.end();
+    }
+
+    static view_t Trim(view_t value) {
+        while(!value.empty() && ((value.front() == ' ')
+            || (value.front() == '\t'))) {
+            value.remove_prefix(1);
+        }
+        while(!value.empty() && ((value.back() == ' ')
+            || (value.back() == '\t'))) {
+            value.remove_suffix(1);
+        }
+        return value;
+    }
+};
@@ -0,0 +1,274 @@
+/*
+ * Measures how long the handlers on an io_service run, and how late its
+ * timers fire, to find code that blocks the event-loop.
+ *
+ * The handler timing needs "looptracking.h" to be hooked into asio, by
+ * defining this before any asio header is included:
+ *
+ *   #define BOOST_ASIO_CUSTOM_HANDLER_TRACKING "looptracking.h"
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#ifndef BOOST_ASIO_CUSTOM_HANDLER_TRACKING
+#   error Define BOOST_ASIO_CUSTOM_HANDLER_TRACKING as "looptracking.h" first
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+/*! A histogram with power-of-two buckets. Can be updated from any thread. */
+class Histogram
+{
+    static constexpr std::size_t num_buckets = 48;
+
+    std::array<std::atomic<std::uint64_t>, num_buckets> buckets_{};
+    std::atomic<std::uint64_t> count_{0};
+    std::atomic<std::uint64_t> sum_{0};
+    std::atomic<std::uint64_t> max_{0};
+
+public:
+    void Add(std::uint64_t value) {
+        std::size_t bucket = 0;
+        while((bucket + 1 < num_buckets) && (value >> bucket)) {
+            ++bucket;
+        }
+        buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+
+        auto max = max_.load(std::memory_order_relaxed);
+        while((value > max) && !max_.compare_exchange_weak(
+            max, value, std::memory_order_relaxed)) {
+            ;
+        }
+    }
+
+    /*! Print count, average, max and some percentiles.
+     *
+     * The percentiles are the upper bounds of their buckets.
+     */
+    void Print(std::ostream& out, const std::string& name) const {
+        const auto count = count_.load();
+        out << name << ": count=" << count
+            << " avg=" << (count ? sum_.load() / count : 0);
+
+        for(const auto percentile : {50, 90, 99}) {
+            const auto wanted = (count * percentile + 99) / 100;
+            std::uint64_t seen = 0, bound = 0;
+            for(std::size_t i = 0; (i < num_buckets) && (seen < wanted); ++i) {
+                seen += buckets_[i].load();
+                bound = (std::uint64_t(1) << i) - 1;
+            }
+            out << " p" << percentile << "<=" << bound;
+        }
+
+        out << " max=" << max_.load() << std::endl;
+    }
+};
+
+/*! Watches the event-loop for handlers that block it.
+ *
+ * When one handler (or one step of a coroutine) runs for a long time,
+ * every other request on the io_service has to wait. The monitor
+ * measures:
+ *
+ *  - How long each handler runs, via the hooks in "looptracking.h".
+ *  - The event-loop lag: how late a timer that should fire at regular
+ *    intervals actually runs.
+ *
+ * If slow_handler is set, a watchdog thread looks for handlers that have
+ * run for longer than that, and sends their thread a signal. The signal
+ * handler prints the stack of the thread, so we can see where it's stuck.
+ */
+class LoopMonitor
+{
+    static constexpr int backtrace_signal = SIGUSR2;
+
+    // One per IO thread
+    class ThreadObserver : public looptracking::Observer {
+        Histogram& runtime_;
+        int depth_ = 0;
+        std::chrono::steady_clock::time_point started_;
+
+    public:
+        const pthread_t thread = ::pthread_self();
+
+        // Nanoseconds since the epoch of steady_clock, 0 when idle
+        std::atomic<std::int64_t> running_since{0};
+
+        // The value of running_since we last reported
+        std::int64_t reported = 0;
+
+        ThreadObserver(Histogram& runtime) : runtime_(runtime) {}
+
+        void OnBegin() override {
+            if (!depth_++) {
+                started_ = std::chrono::steady_clock::now();
+                running_since.store(started_.time_since_epoch().count(),
+                                    std::memory_order_relaxed);
+            }
+        }
+
+        void OnEnd() override {
+            if (!--depth_) {
+                running_since.store(0, std::memory_order_relaxed);
+                runtime_.Add(std::chrono::duration_cast<
+                    std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - started_).count());
+            }
+        }
+    };
+
+    boost::asio::io_service& io_service_;
+    const std::chrono::milliseconds probe_interval_;
+    const std::chrono::milliseconds slow_handler_;
+    Histogram runtime_;
+    Histogram lag_;
+    boost::asio::steady_timer probe_;
+    std::chrono::steady_clock::time_point probe_due_;
+    bool stopped_ = false;
+    std::deque<ThreadObserver> observers_;
+    std::thread watchdog_;
+    std::mutex mutex_;
+    std::condition_variable wake_watchdog_;
+
+public:
+    LoopMonitor(boost::asio::io_service& io_service,
+                std::chrono::milliseconds probe_interval,
+                std::chrono::milliseconds slow_handler)
+        : io_service_(io_service), probe_interval_(probe_interval)
+        , slow_handler_(slow_handler), probe_(io_service)
+    {
+        if (slow_handler_.count() > 0) {
+            InstallSignalHandler();
+            watchdog_ = std::thread([this]() { Watch(); });
+        }
+
+        io_service_.post([this]() {
+            probe_due_ = std::chrono::steady_clock::now();
+            StartProbe();
+        });
+    }
+
+    ~LoopMonitor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        wake_watchdog_.notify_all();
+        if (watchdog_.joinable()) {
+            watchdog_.join();
+        }
+    }
+
+    /*! Call from each IO thread before it runs the event-loop */
+    void AttachThread() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        observers_.emplace_back(runtime_);
+        looptracking::CurrentObserver() = &observers_.back();
+    }
+
+    /*! Stop the lag probe, so that the event-loop can run out of work */
+    void Stop() {
+        io_service_.post([this]() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+            probe_.cancel();
+        });
+    }
+
+    void Print(std::ostream& out) const {
+        runtime_.Print(out, "handler-runtime-us");
+        lag_.Print(out, "loop-lag-us");
+    }
+
+private:
+    void StartProbe() {
+        probe_due_ += probe_interval_;
+        probe_.expires_at(probe_due_);
+        probe_.async_wait([this](const boost::system::error_code& ec) {
+            if (ec) {
+                return;
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            lag_.Add(std::chrono::duration_cast<std::chrono::microseconds>(
+                now - probe_due_).count());
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!stopped_) {
+                // Don't try to catch up if we have been blocked for long
+                if (probe_due_ + probe_interval_ < now) {
+                    probe_due_ = now;
+                }
+                StartProbe();
+            }
+        });
+    }
+
+    void Watch() {
+        const auto period = std::max(slow_handler_ / 2,
+                                     std::chrono::milliseconds(1));
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(!wake_watchdog_.wait_for(lock, period, [this]() {
+            return stopped_; })) {
+
+            const auto now = std::chrono::steady_clock::now()
+                .time_since_epoch().count();
+            const auto limit = std::chrono::duration_cast<
+                std::chrono::nanoseconds>(slow_handler_).count();
+
+            for(std::size_t i = 0; i < observers_.size(); ++i) {
+                auto& observer = observers_[i];
+                const auto since = observer.running_since.load(
+                    std::memory_order_relaxed);
+                if (!since || (since == observer.reported)
+                    || (now - since < limit)) {
+                    continue;
+                }
+
+                observer.reported = since;
+                std::cerr << "Slow handler: IO thread " << i
+                    << " has been running one handler for "
+                    << (now - since) / 1000000 << " ms:" << std::endl;
+                ::pthread_kill(observer.thread, backtrace_signal);
+            }
+        }
+    }
+
+    static void InstallSignalHandler() {
+        // The first call loads libgcc, which is not safe in a signal handler
+        void *frames[1];
+        ::backtrace(frames, 1);
+
+        struct sigaction action = {};
+        action.sa_handler = [](int) {
+            void *frames[64];
+            const auto count = ::backtrace(frames, 64);
+            ::backtrace_symbols_fd(frames, count, STDERR_FILENO);
+        };
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        ::sigaction(backtrace_signal, &action, nullptr);
+    }
+};
@@ -0,0 +1,81 @@
+
+/*
+ * Hooks into asio's custom handler tracking, so that we can see when
+ * asio starts and finishes running a handler (or a step of a coroutine).
+ *
+ * Include it by defining, before any asio header is included:
+ *
+ *   #define BOOST_ASIO_CUSTOM_HANDLER_TRACKING "looptracking.h"
+ *
+ * Each thread can have an Observer. If it has none, the hooks cost a
+ * thread-local load and a branch per handler.
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+namespace looptracking {
+
+/*! Gets told when a handler starts and ends on the current thread.
+ *
+ * Handlers can run inside other handlers (for example when a strand
+ * dispatches), so the calls can be nested.
+ */
+class Observer
+{
+public:
+    virtual void OnBegin() = 0;
+    virtual void OnEnd() = 0;
+
+protected:
+    ~Observer() = default;
+};
+
+/*! The observer for the current thread, or nullptr */
+inline Observer *& CurrentObserver() {
+    static thread_local Observer *observer = nullptr;
+    return observer;
+}
+
+/*! Tells the observer about a handler, for as long as it's in scope */
+class Invocation
+{
+    Observer *const observer_;
+
+public:
+    Invocation() : observer_(CurrentObserver()) {
+        if (observer_) {
+            observer_->OnBegin();
+        }
+    }
+
+    Invocation(const Invocation&) = delete;
+
+    ~Invocation() {
+        if (observer_) {
+            observer_->OnEnd();
+        }
+    }
+};
+
+} // namespace looptracking
+
+// The only hook we use is the one around the handler invocation
+#define BOOST_ASIO_INHERIT_TRACKED_HANDLER
+#define BOOST_ASIO_ALSO_INHERIT_TRACKED_HANDLER
+#define BOOST_ASIO_HANDLER_TRACKING_INIT (void)0
+#define BOOST_ASIO_HANDLER_LOCATION(args) (void)0
+#define BOOST_ASIO_HANDLER_CREATION(args) (void)0
+#define BOOST_ASIO_HANDLER_COMPLETION(args) (void)0
+#define BOOST_ASIO_HANDLER_INVOCATION_BEGIN(args) \
+    ::looptracking::Invocation looptracking_invocation
+#define BOOST_ASIO_HANDLER_INVOCATION_END (void)0
+#define BOOST_ASIO_HANDLER_OPERATION(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_REGISTRATION(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_DEREGISTRATION(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_READ_EVENT 1
+#define BOOST_ASIO_HANDLER_REACTOR_WRITE_EVENT 2
+#define BOOST_ASIO_HANDLER_REACTOR_ERROR_EVENT 4
+#define BOOST_ASIO_HANDLER_REACTOR_EVENTS(args) (void)0
+#define BOOST_ASIO_HANDLER_REACTOR_OPERATION(args) (void)0
@@ -16,236 +16,614 @@
  * I put this code in the public domain.
  */
 
+// Let LoopMonitor see when asio runs a handler. Must come before asio.
+#define BOOST_ASIO_CUSTOM_HANDLER_TRACKING "looptracking.h"
+
 #include <iostream>
 #include <string>
-#include <sstream>
+#include <fstream>
+#include <iterator>
 #include <future>
-#include <thread>
 #include <memory>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
 #include <boost/asio.hpp>
-#include <boost/asio/spawn.hpp>
+#include <boost/program_options.hpp>
+
+#include "capture.h"
+#include "resultring.h"
+#include "asynclog.h"
+#include "hosts.h"
+#include "config.h"
+#include "request.h"
+#include "resultstore.h"
+#include "output.h"
+#include "supervisor.h"
 
 
 using boost::asio::ip::tcp;
 
-/*! HTTP Client object. */
-class Request
-{
-    boost::asio::io_service io_service_;
-    std::promise<std::string> result_;
+/*! The file we save an URL to with --download-dir
+ *
+ * The index keeps the names unique, and the rest tells which URL it was.
+ */
+std::string DownloadPath(const std::string& dir, std::size_t index,
+                         const std::string& url) {
+    std::string name = std::to_string(index) + '_';
+    for(const char ch : url.substr(0, 128)) {
+        name += std::isalnum(static_cast<unsigned char>(ch)) || (ch == '.')
+            || (ch == '-') ? ch : '_';
+    }
+    return dir + '/' + name;
+}
 
-public:
+/*! Fetch all the URLs, and keep the results in a store until all are done.
+ *
+ * Then print them, in the order the URLs were given.
+ *
+ * @returns The exit code for the program
+ */
+int FetchAllIntoStore(Request& req, const std::vector<std::string>& urls,
+                      const Output& output, ResultStore& store) {
+    std::vector<Outcome> outcomes(urls.size()); // Without the text
+    std::vector<std::string> errors(urls.size());
+    std::size_t pending = urls.size();
+    std::mutex mutex;
+    std::condition_variable all_done;
+
+    for(std::size_t i = 0; i < urls.size(); ++i) {
+        req.TryFetch(urls[i], [&, i](Request::Result& result) {
+            // Compress the page right away, from the IO thread
+            auto outcome = Outcome::Make(urls[i], result, output.format);
+            std::string error;
+            try {
+                store.Put(i, outcome.text);
+            } catch(const std::exception& ex) {
+                error = ex.what();
+            }
+            outcome.text.clear();
+            outcome.text.shrink_to_fit();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            outcomes[i] = std::move(outcome);
+            errors[i] = std::move(error);
+            if (!--pending) {
+                all_done.notify_all();
+            }
+        });
+    }
 
-    /*! Async fetch a single HTTP page, at the root-level "/".
-     *
-     * @param host The host we want to connect to
-     *
-     * @returns A future that will, at some later time, be able to provide
-     *  the content of the page, or throw an exception if the async
-     *  fetch failed. We need to return a future, in stead of a string, since
-     *  this is an Async method that is expected to return immediately.
-     *
-     * @Note This is not production-grade code, as we don't look at the
-     *   HTTP headers from the server, and don't validate the length of
-     *   the returned data. We also don't deal with redirects or authentication.
-     *   This is intentionally, as this code is meant to illustrate how we do
-     *   network IO, and not how we deal with an increasingly bloated HTTP
-     *   standard.
-     */
-    auto Fetch(const std::string& host) {
-
-        /* Ask asio to call Fetch_ from the IO thread
-         *
-         * At this time we don't have an event-loop thread running, so asio
-         * will just queue the request and execute it later for us.
-         */
-        boost::asio::spawn(io_service_, std::bind(&Request::Fetch_, this,
-                                                  host, std::placeholders::_1));
-        /* Start a thread for the actual work
-         *
-         * Note that we again use a C++11 lambda to execute the main scope
-         * of the thread. And that we, again, need to detach the thread from
-         * the local variable (since we soon will exit our scope, and the
-         * thread needs to carry out the work we assigned to it.
-         *
-         * As soon as io_service_.run() is called from within the lambda,
-         * asio will call Fetch_()
-         */
-        std::thread([=]() { io_service_.run();}).detach();
-
-        // Return the future to the caller.
-        return result_.get_future();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        all_done.wait(lock, [&]() { return !pending; });
     }
 
-private:
+    int rval = 0;
+    for(std::size_t i = 0; i < urls.size(); ++i) {
+        auto& outcome = outcomes[i];
+        outcome.failed = outcome.failed || !errors[i].empty();
+        outcome.text = errors[i].empty() ? store.Get(i) : errors[i];
+        if (!outcome.Print(i, urls[i], urls.size() > 1, output)) {
+            rval = -1;
+        }
+    }
 
-    /*! The implementation of the async resolve and fetch.
-     *
-     * This is run from the thread we started in Fetch()
-     */
-    void Fetch_(const std::string& host, boost::asio::yield_context yield) {
-        std::string rval;
-        boost::system::error_code ec;
+    return rval;
+}
 
-        try {
-            // Construct a resolver instance
-            tcp::resolver resolver(io_service_);
-
-            /* Note that we call async_resolve. What do you think it will
-             * return? A future? An iterator?
-             *
-             * The beauty here is that async_resolve will actually suspend
-             * the processing of this method here, save the stack, and return
-             * the thread to asio.
-             *
-             * When asio has finished the resolve request, it will restore
-             * the stack, and resume the processing exactly where we left off
-             * (at least, that is how it appears to our code), so that
-             * what is returned is the iterator.
-             *
-             * From a coding perspective, this is exactly what we did in
-             * "traditional.cpp". However, in this case the thread was
-             * free for other jobs while asio waited for the DNS system.
-             *
-             * Another huge benefit is that in the debugger, and in a core-dump,
-             * we will see the full stack-trace of Fetch_, not just a
-             * callback that implements a fragment of the functionality.
-             */
-            auto address_it = resolver.async_resolve({host, "80"}, yield);
-
-            /* Use decltype to copy the type from address_it in stead of
-             * typing it. That way we really don't need to know or care about
-             * the actual type returned by async_resolve()
-             */
-            decltype(address_it) addr_end;
-
-            /* Again, our loop looks like a loop. Even if the thread will
-             * be able to do many other things while we wait for network IO
-             * inside the loop.
-             */
-            for(; address_it != addr_end; ++address_it) {
-                // Construct a TCP socket instance
-                tcp::socket sck(io_service_);
-
-                /* Again, we do an async operation where the stack will be
-                 * saved, the thread released to other tasks, before the stack
-                 * is restored and the processing resumes where it left off.
-                 */
-                sck.async_connect(*address_it, yield[ec]);
-                if (ec) {
-                    std::cerr << "Failed to connect to "
-                        << address_it->endpoint() << std::endl;
-
-                    // Try another IP
-                    continue;
-                }
+int main(int argc, char *argv[])
+{
+    namespace po = boost::program_options;
+
+    Config config;
+    std::vector<std::string> urls;
+    std::string urls_file;
+    std::vector<std::string> resolve;
+    std::vector<std::string> hosts_files;
+    std::vector<std::string> dns_servers;
+    long dns_timeout_ms = config.dns.timeout.count();
+    bool lookup_only = false;
+    bool stage_stats = false;
+    bool status_only = false;
+    bool no_request_arena = false;
+    bool collect = false;
+    long lag_probe_ms = config.lag_probe_interval.count();
+    long slow_handler_ms = config.slow_handler.count();
+    std::size_t store_budget = 64 * 1024 * 1024;
+    std::string spill_dir = "/tmp";
+    std::string capture_file;
+    std::vector<std::string> source_addresses;
+    std::string upload_file;
+    std::string download_dir;
+    std::string output_order = "input";
+    std::string output_format = "text";
+    std::string write_out;
+    std::string output_ring;
+    std::size_t output_ring_size = 64 * 1024 * 1024;
+    std::unique_ptr<resultring::Writer> ring;
+    Output output;
+    std::size_t reorder_window = 0;
+    std::shared_ptr<Body> body;
+    std::string upload_method = "POST";
+    bool chunked_upload = false;
+    bool upload_from_memory = false;
+    std::string local_port_range;
+    std::size_t max_redirects = config.max_redirects;
+    std::size_t redirect_cache_size = config.redirect_cache_size;
+    unsigned log_rate_limit = 10;
+    Supervisor::Options supervisor;
+    supervisor.workers = 1;
+    std::size_t preconnect = 0;
+    long spin_budget_usec = config.spin_budget.count();
+
+    po::options_description opts("Options");
+    opts.add_options()
+        ("help,h", "Print help and exit")
+        ("busy-poll", po::bool_switch(&config.busy_poll),
+            "Spin on the event-loop in stead of sleeping in the kernel")
+        ("spin-budget", po::value(&spin_budget_usec)->default_value(
+            spin_budget_usec),
+            "Microseconds to spin without work before blocking (--busy-poll)")
+        ("so-busy-poll", po::value(&config.socket_busy_poll_usec)
+            ->default_value(config.socket_busy_poll_usec),
+            "SO_BUSY_POLL value for sockets, in microseconds (0 disables)")
+        ("io-threads", po::value(&config.io_threads)->default_value(
+            config.io_threads),
+            "Number of threads running the event-loop")
+        ("urls-file", po::value(&urls_file),
+            "Read the URLs to fetch from this file, one per line")
+        ("max-body-size", po::value(&config.max_body_size)->default_value(
+            config.max_body_size),
+            "Fail requests with a larger body than this, in bytes (0 is unlimited)")
+        ("truncate-body", po::bool_switch(&config.truncate_body),
+            "Truncate bodies larger than --max-body-size in stead of failing")
+        ("max-buffered", po::value(&config.max_buffered_bytes)->default_value(
+            config.max_buffered_bytes),
+            "Pause reading when all requests together buffer this many bytes "
+            "(0 is unlimited)")
+        ("resolve", po::value(&resolve),
+            "Use these addresses for host:port, as host:port:address[,address...]. "
+            "Can be repeated")
+        ("hosts-file", po::value(&hosts_files),
+            "Load host-name to address mappings from a file in the /etc/hosts "
+            "format. Can be repeated")
+        ("builtin-resolver", po::bool_switch(&config.builtin_resolver),
+            "Use our own asynchronous DNS client in stead of getaddrinfo()")
+        ("dns-server", po::value(&dns_servers),
+            "DNS server for --builtin-resolver, as address[:port]. Can be "
+            "repeated. Default is the servers in /etc/resolv.conf")
+        ("dns-timeout", po::value(&dns_timeout_ms)->default_value(
+            dns_timeout_ms),
+            "Milliseconds to wait for a DNS reply before trying again")
+        ("dns-retries", po::value(&config.dns.retries)->default_value(
+            config.dns.retries),
+            "How many times to try again when a DNS query times out")
+        ("dns-max-in-flight", po::value(&config.dns.max_in_flight)
+            ->default_value(config.dns.max_in_flight),
+            "Max number of DNS queries in flight")
+        ("lookup-only", po::bool_switch(&lookup_only),
+            "Only resolve the hosts, and print their addresses")
+        ("max-resolving", po::value(&config.max_resolving)->default_value(
+            config.max_resolving),
+            "Max number of requests resolving host-names at the same time "
+            "(0 is unlimited)")
+        ("max-connecting", po::value(&config.max_connecting)->default_value(
+            config.max_connecting),
+            "Max number of requests connecting at the same time "
+            "(0 is unlimited)")
+        ("max-transferring", po::value(&config.max_transferring)
+            ->default_value(config.max_transferring),
+            "Max number of requests sending and receiving at the same time "
+            "(0 is unlimited)")
+        ("preconnect", po::value(&preconnect)->default_value(preconnect),
+            "Open up to this many connections to each host before the "
+            "fetches start")
+        ("no-request-arena", po::bool_switch(&no_request_arena),
+            "Allocate the short-lived objects of each request from the heap "
+            "in stead of from a per-request arena")
+        ("workers", po::value(&supervisor.workers)->default_value(
+            supervisor.workers),
+            "Fetch in this many processes, sharded by host-name")
+        ("ring-size", po::value(&supervisor.ring_size)->default_value(
+            supervisor.ring_size),
+            "Bytes in the shared-memory ring from each worker (--workers)")
+        ("max-restarts", po::value(&supervisor.max_restarts)->default_value(
+            supervisor.max_restarts),
+            "How many times to restart a worker that dies (--workers)")
+        ("collect", po::bool_switch(&collect),
+            "Keep the results compressed in memory until all are done, "
+            "and then print them")
+        ("store-budget", po::value(&store_budget)->default_value(
+            store_budget),
+            "Bytes of compressed results to keep in memory before we "
+            "spill to disk (--collect, 0 is unlimited)")
+        ("spill-dir", po::value(&spill_dir)->default_value(spill_dir),
+            "Where to spill results to (--collect)")
+        ("output-order", po::value(&output_order)->default_value(
+            output_order),
+            "Print the results in \"input\" order, or in \"completion\" "
+            "order (as soon as they are done)")
+        ("reorder-window", po::value(&reorder_window)->default_value(
+            reorder_window),
+            "In input order, don't start a fetch more than this many URLs "
+            "after the oldest one we have not printed (0 is unlimited)")
+        ("max-redirects", po::value(&max_redirects)->default_value(
+            max_redirects),
+            "Follow up to this many redirects (0 prints the redirect)")
+        ("redirect-cache-size", po::value(&redirect_cache_size)->default_value(
+            redirect_cache_size),
+            "Number of permanent redirects to remember, so that the next "
+            "fetch of the URL goes straight to the new location")
+        ("log-rate-limit", po::value(&log_rate_limit)->default_value(
+            log_rate_limit),
+            "Max messages per second from each place in the code that "
+            "logs from the IO threads (0 is unlimited)")
+        ("download-dir", po::value(&download_dir),
+            "Save the bodies to files in this directory, in stead of "
+            "printing them. Only the headers are printed")
+        ("upload", po::value(&upload_file),
+            "Send this file as the request body to each URL, with sendfile()")
+        ("upload-method", po::value(&upload_method)->default_value(
+            upload_method),
+            "HTTP method for --upload")
+        ("chunked-upload", po::bool_switch(&chunked_upload),
+            "Send the --upload body with chunked transfer-encoding")
+        ("upload-from-memory", po::bool_switch(&upload_from_memory),
+            "Load the --upload file into memory once, and send it with "
+            "MSG_ZEROCOPY in stead of sendfile()")
+        ("source-address", po::value(&source_addresses),
+            "Local address to connect from. Can be repeated; the connections "
+            "to each destination are spread over the addresses")
+        ("local-port-range", po::value(&local_port_range),
+            "Ephemeral ports for our connections, as low-high (needs Linux "
+            "6.3 or later)")
+        ("recv-pool", po::bool_switch(&config.recv_pool),
+            "Read into blocks from a shared pool in stead of a small buffer "
+            "on the stack")
+        ("recv-block-size", po::value(&config.recv_block_size)
+            ->default_value(config.recv_block_size),
+            "Bytes in each block from the receive pool (--recv-pool)")
+        ("huge-pages", po::bool_switch(&config.huge_pages),
+            "Back the receive pool with huge pages, or transparent huge "
+            "pages if none are reserved. Implies --recv-pool")
+        ("capture", po::value(&capture_file),
+            "Record the responses, and when their bytes arrived, to this "
+            "file. Serve them back with replayserver")
+        ("loop-stats", po::bool_switch(&config.monitor_loop),
+            "Measure the handler run-times and the event-loop lag, and print "
+            "them when done")
+        ("lag-probe-interval", po::value(&lag_probe_ms)->default_value(
+            lag_probe_ms),
+            "Milliseconds between the event-loop lag measurements "
+            "(--loop-stats)")
+        ("slow-handler", po::value(&slow_handler_ms)->default_value(
+            slow_handler_ms),
+            "Print a backtrace of handlers that run for longer than this, in "
+            "milliseconds (0 disables)")
+        ("status-only", po::bool_switch(&status_only),
+            "Print only the HTTP status code for each URL")
+        ("output-format", po::value(&output_format)->default_value(
+            output_format),
+            "\"text\" prints the responses, \"status\" is the same as "
+            "--status-only, and \"binary\" writes a record with the URL, "
+            "status, timings, headers and body for each URL "
+            "(\"resultstream.h\")")
+        ("write-out,w", po::value(&write_out),
+            "Print where the time went for each fetch to standard error, "
+            "like curl -w: the lookup, each connect attempt, the first "
+            "byte, the transfer, the bytes and the speed. \"text\" or "
+            "\"json\" (one object per line)")
+        ("output-ring", po::value(&output_ring),
+            "Start this command, and give it the results as binary records "
+            "through a ring in shared memory (\"resultring.h\")")
+        ("output-ring-size", po::value(&output_ring_size)->default_value(
+            output_ring_size),
+            "Bytes in the --output-ring. A result must fit in it")
+        ("stage-stats", po::bool_switch(&stage_stats),
+            "Print the queue metrics for each stage when done")
+        ;
+
+    po::options_description hidden;
+    hidden.add_options()
+        ("url", po::value(&urls),
+            "Host or URL (http://host[:port][/path]) to fetch");
+
+    po::options_description all;
+    all.add(opts).add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("url", -1);
+
+    try {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(all)
+            .positional(positional).run(), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: " << argv[0] << " [options] url..." << std::endl
+                << opts << std::endl;
+            return 0;
+        }
+
+        po::notify(vm);
+
+        if (!urls_file.empty()) {
+            std::ifstream in(urls_file);
+            if (!in) {
+                throw std::runtime_error("Cannot open " + urls_file);
+            }
 
-                /* Here we initiate an async write.
-                 *
-                 * As before, the thread can be used for other things
-                 * before processing resumes.
-                 *
-                 * Note the apparently missing error-handling.
-                 *
-                 * Here we do not supply [ec] to yield. That causes asio to
-                 * throw an exception if async_write fails. Since we are
-                 * inside a try/catch scope, the error will actually be dealt
-                 * with. (It's pretty awesome that exception handling works
-                 * as in traditional code when we effectively are in a
-                 * co-routine.
-                 */
-                boost::asio::async_write(sck,
-                                         boost::asio::buffer(GetRequest(host)),
-                                         yield);
-
-                /* We can use the stack - no need to put
-                 * data as properties (although it may give better
-                 * performance - that is something you can experiment with).
-                 */
-                char reply[1024] {}; // Zero-initialize the buffer
-
-                // Async read data until we fail. (As in the other examples)
-                while(!ec) {
-                    const auto rlen = sck.async_read_some(
-                        boost::asio::mutable_buffers_1(reply, sizeof(reply)),
-                                                          yield[ec]);
-
-                    // Append the read data to the data we will return
-                    rval.append(reply, rlen);
+            std::string line;
+            while(std::getline(in, line)) {
+                if (!line.empty() && (line[0] != '#')) {
+                    urls.push_back(line);
                 }
+            }
+        }
+
+        if (urls.empty()) {
+            throw std::runtime_error("No URL to fetch");
+        }
+
+        for(const auto& path : hosts_files) {
+            config.host_overrides.Load(path);
+        }
 
-                /* Just assume that we are done
-                 *
-                 * We set a value to the result_, and immediately the value
-                 * will be available to the main-thread that can get it from
-                 * result.get(). In this case, there is unlikely to be any
-                 * exceptions.
-                 *
-                 * Since we don't start another async operation,
-                 * io_service_.run() will return, and our thread will exit.
-                 */
-                result_.set_value(move(rval));
-                return; // Success!
+        // These are per port, so they take precedence over the hosts-files
+        for(const auto& spec : resolve) {
+            config.host_overrides.Add(spec);
+        }
+
+        for(const auto& server : dns_servers) {
+            const auto ep = ParseEndpoint(server, 53);
+            config.dns.servers.emplace_back(ep.address(), ep.port());
+        }
+
+        for(const auto& address : source_addresses) {
+            config.source_addresses.push_back(
+                boost::asio::ip::address::from_string(address));
+        }
+
+        if (!local_port_range.empty()) {
+            const auto dash = local_port_range.find('-');
+            if (dash == std::string::npos) {
+                throw std::runtime_error("Invalid --local-port-range: "
+                                         + local_port_range);
             }
+            config.local_port_min = ParsePort(local_port_range.substr(0, dash));
+            config.local_port_max = ParsePort(local_port_range.substr(dash + 1));
+            if (config.local_port_max < config.local_port_min) {
+                throw std::runtime_error("Invalid --local-port-range: "
+                                         + local_port_range);
+            }
+        }
 
-            // We failed.
-            throw std::runtime_error("Unable to connect to any host");
-        } catch(...) {
-
-            /* We pick up the exception, and pass it to the result_
-             * property. At this moment, the future that the main-thread
-             * holds will unblock, and the exception will be re-thrown
-             * there when result.get() is called.
-             *
-             * Since we don't start another async operation,
-             * io_service_.run() will return, and our thread will exit.
-             */
-            result_.set_exception(std::current_exception());
-            return;
+        if ((output_order != "input") && (output_order != "completion")) {
+            throw std::runtime_error("Invalid --output-order: "
+                                     + output_order);
+        }
+
+        auto& format = output.format;
+        if (output_format == "status") {
+            format = OutputFormat::status;
+        } else if (output_format == "binary") {
+            format = OutputFormat::binary;
+        } else if (output_format != "text") {
+            throw std::runtime_error("Invalid --output-format: "
+                                     + output_format);
+        }
+
+        if (!output_ring.empty()) {
+            // The ring carries binary records
+            if (format == OutputFormat::status) {
+                throw std::runtime_error("--output-ring can't be used with "
+                                         "the status output format");
+            }
+            format = OutputFormat::binary;
         }
-    }
 
-    // Construct a simple HTTP request to the host
-    std::string GetRequest(const std::string& host) const {
-        std::ostringstream req;
-        req << "GET / HTTP/1.1\r\nHost: " << host << " \r\n"
-            << "Connection: close\r\n\r\n";
+        if (status_only) {
+            if (format == OutputFormat::binary) {
+                throw std::runtime_error("--status-only can't be used with "
+                                         "binary output");
+            }
+            format = OutputFormat::status;
+        }
+
+        if (write_out == "text") {
+            output.write_out = WriteOut::text;
+        } else if (write_out == "json") {
+            output.write_out = WriteOut::json;
+        } else if (!write_out.empty()) {
+            throw std::runtime_error("Invalid --write-out: " + write_out);
+        }
+        if ((output.write_out != WriteOut::none) && lookup_only) {
+            throw std::runtime_error("--write-out can't be used with "
+                                     "--lookup-only");
+        }
+
+        if ((format == OutputFormat::binary) && lookup_only) {
+            throw std::runtime_error("--output-format binary can't be used "
+                                     "with --lookup-only");
+        }
+
+        if ((!upload_file.empty() || !download_dir.empty())
+            && (lookup_only || collect || (supervisor.workers > 1))) {
+            throw std::runtime_error("--upload and --download-dir can't be "
+                                     "used with --lookup-only, --collect or "
+                                     "--workers");
+        }
+
+        if (!upload_file.empty() && !download_dir.empty()) {
+            throw std::runtime_error("--upload can't be used with "
+                                     "--download-dir");
+        }
 
-        return req.str();
+        if (!upload_file.empty()) {
+            if (upload_from_memory) {
+                std::ifstream in(upload_file, std::ios::binary);
+                if (!in) {
+                    throw std::runtime_error("Cannot open " + upload_file);
+                }
+                body = Body::FromMemory(std::make_shared<const std::string>(
+                    std::istreambuf_iterator<char>(in),
+                    std::istreambuf_iterator<char>()));
+            } else {
+                body = Body::FromFile(upload_file);
+            }
+            body->method = upload_method;
+            body->chunked = chunked_upload;
+        }
+
+        if (!capture_file.empty()) {
+            config.capture = std::make_shared<capture::Writer>(capture_file);
+        }
+
+        if (!output_ring.empty()) {
+            // Before we start any threads
+            ring = std::make_unique<resultring::Writer>(output_ring_size);
+            ring->StartConsumer(output_ring);
+            output.ring = ring.get();
+        }
+    } catch(const std::exception& ex) {
+        std::cerr << ex.what() << std::endl
+            << "Usage: " << argv[0] << " [options] url..." << std::endl
+            << opts << std::endl;
+        return -1;
     }
-};
 
-int main(int argc, char *argv[])
-{
-    // Check that we have one and only one argument (the host-name)
-    assert(argc == 2 && *argv[1]);
+    config.spin_budget = std::chrono::microseconds(spin_budget_usec);
+    config.dns.timeout = std::chrono::milliseconds(dns_timeout_ms);
+    config.request_arena = !no_request_arena;
+    config.lag_probe_interval = std::chrono::milliseconds(
+        std::max(lag_probe_ms, 1L));
+    config.slow_handler = std::chrono::milliseconds(slow_handler_ms);
+    config.max_redirects = max_redirects;
+    config.redirect_cache_size = redirect_cache_size;
+    asynclog::Logger::Instance().SetRateLimit(log_rate_limit);
+
+    if ((supervisor.workers > 1) && !lookup_only) {
+        // The workers make their own HTTP Client objects
+        try {
+            supervisor.output = output;
+            supervisor.preconnect = preconnect;
+            supervisor.stage_stats = stage_stats;
+            supervisor.completion_order = output_order == "completion";
+            return output.Finish(Supervisor(config, urls, supervisor).Run());
+        } catch(const std::exception& ex) {
+            std::cerr << "Caught exception " << ex.what() << std::endl;
+            return -2;
+        }
+    }
 
     // Construct our HTTP Client object
-    Request req;
+    Request req(config);
+
+    if (lookup_only) {
+        std::vector<std::future<std::vector<tcp::endpoint>>> lookups;
+        for(const auto& url : urls) {
+            std::promise<std::vector<tcp::endpoint>> bad_url;
+            try {
+                lookups.push_back(req.Resolve(url));
+            } catch(...) {
+                bad_url.set_exception(std::current_exception());
+                lookups.push_back(bad_url.get_future());
+            }
+        }
 
-    // Initiate the fetch and get the future
-    auto result = req.Fetch(argv[1]);
+        int rval = 0;
+        for(std::size_t i = 0; i < lookups.size(); ++i) {
+            try {
+                std::cout << urls[i];
+                for(const auto& ep : lookups[i].get()) {
+                    std::cout << ' ' << ep.address();
+                }
+                std::cout << std::endl;
+            } catch(const std::exception& ex) {
+                std::cout << " error: " << ex.what() << std::endl;
+                rval = -1;
+            }
+        }
 
-    // Wait for the other thread to do it's job
-    result.wait();
+        if (stage_stats) {
+            req.PrintStageStats(std::clog);
+            req.PrintPoolStats(std::clog);
+            req.PrintSourceStats(std::clog);
+        }
+        req.PrintLoopStats(std::clog);
 
-    try {
-        // Get the page or an exception
-        std::cout << result.get();
-    } catch(const std::exception& ex) {
-        // Explain to the user that there was a problem
-        std::cerr << "Caught exception " << ex.what() << std::endl;
+        return rval;
+    }
 
-        // Error exit
-        return -1;
-    } catch(...) {
-        // Explain to the user that there was an ever bigger problem
-        std::cerr << "Caught exception!" << std::endl;
+    if (preconnect) {
+        PreconnectAll(req, urls, preconnect);
+    }
+
+    if (collect) {
+        ResultStore store(urls.size(), store_budget, spill_dir);
+        const auto rval = FetchAllIntoStore(req, urls, output, store);
+        if (stage_stats) {
+            req.PrintStageStats(std::clog);
+            req.PrintPoolStats(std::clog);
+            req.PrintSourceStats(std::clog);
+            req.PrintRedirectStats(std::clog);
+            store.PrintStats(std::clog);
+        }
+        req.PrintLoopStats(std::clog);
+        return output.Finish(rval);
+    }
+
+    /* Initiate the fetches. They run in parallel, as far as the
+     * --reorder-window lets them.
+     *
+     * TryFetch() reports failures as error codes, so a long list of dead
+     * hosts doesn't cost us an exception for each of them.
+     */
+    ResultPrinter printer(urls, output_order == "input", reorder_window,
+                          output);
+    for(std::size_t i = 0; i < urls.size(); ++i) {
+        printer.WaitForRoom(i);
+
+        if (!download_dir.empty()) {
+            const auto path = DownloadPath(download_dir, i, urls[i]);
+            req.TryDownload(urls[i], path, [&, i, path](Request::Result& result) {
+                auto outcome = Outcome::Make(urls[i], result, output.format);
+                if (!outcome.failed
+                    && (output.format != OutputFormat::binary)) {
+                    outcome.text += "Saved " + std::to_string(result.downloaded)
+                        + " bytes to " + path + "\n";
+                }
+                printer.Add(i, std::move(outcome));
+            });
+            continue;
+        }
+
+        auto done = [&, i](Request::Result& result) {
+            // From the IO thread. The main thread prints it.
+            printer.Add(i, Outcome::Make(urls[i], result, output.format));
+        };
+        if (body) {
+            req.TryUpload(urls[i], body, done);
+        } else {
+            req.TryFetch(urls[i], done);
+        }
+    }
+
+    const int rval = printer.Finish();
 
-        // Error exit
-        return -2;
+    if (stage_stats) {
+        printer.PrintStats(std::clog);
+        req.PrintStageStats(std::clog);
+        req.PrintPoolStats(std::clog);
+        req.PrintSourceStats(std::clog);
+        req.PrintRedirectStats(std::clog);
     }
+    req.PrintLoopStats(std::clog);
 
-    // Successful exit
-    return 0;
+    return output.Finish(rval);
 }
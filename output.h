@@ -0,0 +1,420 @@
+/*
+ * How "modern.cpp" prints the result of each fetch: as text, as status
+ * lines or as binary records, with an optional timing breakdown.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <boost/asio.hpp>
+
+#include "request.h"
+#include "resultstream.h"
+#include "resultring.h"
+
+/*! How we print the results */
+enum class OutputFormat {
+    text,   // The responses, as we got them
+    status, // The URL and the status code
+    binary  // Records for other programs; see "resultstream.h"
+};
+
+/*! How we print the timing of each fetch, like curl -w */
+enum class WriteOut {
+    none,
+    text, // A few lines per fetch
+    json  // An object per fetch, on one line
+};
+
+/*! How, and where, we print the results */
+struct Output {
+    OutputFormat format = OutputFormat::text;
+
+    /*! The timing breakdown, to standard error */
+    WriteOut write_out = WriteOut::none;
+
+    /*! Hand the binary records to a consumer process through shared
+     * memory, in stead of writing them to standard output.
+     */
+    resultring::Writer *ring = nullptr;
+
+    /*! Wait for the consumer of the ring to read the rest and exit
+     *
+     * @param rval The exit code so far
+     * @returns The exit code for the program
+     */
+    int Finish(int rval) const {
+        if (!ring) {
+            return rval;
+        }
+
+        const auto status = ring->Finish();
+        if (status != 0) {
+            std::cerr << "The --output-ring consumer ";
+            if (WIFSIGNALED(status)) {
+                std::cerr << "was killed by signal " << WTERMSIG(status);
+            } else {
+                std::cerr << "exited with status " << WEXITSTATUS(status);
+            }
+            std::cerr << std::endl;
+            return rval ? rval : -1;
+        }
+        return rval;
+    }
+};
+
+/*! What we show the user for one fetch */
+struct Outcome
+{
+    bool failed = false;
+
+    /*! The page, the status code, or the error message */
+    std::string text;
+
+    // For the binary format
+    int status = 0;
+    std::size_t header_size = 0; // The HTTP headers at the start of text
+    Request::Timings timings;
+    std::size_t redirects = 0;
+
+    static Outcome Make(const std::string& url, Request::Result& result,
+                        OutputFormat format) {
+        Outcome rval;
+        rval.status = result.response.GetStatus();
+        rval.header_size = result.response.HasHeaders()
+            ? result.response.GetHeaderSize()
+            : result.response.GetData().size();
+        rval.timings = result.timings;
+        rval.redirects = result.redirects;
+
+        if (result.ec) {
+            rval.failed = true;
+            rval.text = result.ec.message();
+        } else if (format == OutputFormat::status) {
+            // Only the status line was parsed to get this
+            rval.text = url + ' '
+                + std::to_string(result.response.GetStatus()) + '\n';
+        } else {
+            rval.text = result.response.TakeData();
+        }
+        return rval;
+    }
+
+    /*! Print it.
+     *
+     * @param index The position of the URL in the input
+     * @returns false if the fetch failed
+     */
+    bool Print(std::size_t index, const std::string& url, bool show_url,
+               const Output& output) const {
+        if (output.format == OutputFormat::binary) {
+            if (!WriteRecord(index, url, output.ring)) {
+                std::cerr << "Failed to write the result: " << strerror(errno)
+                    << std::endl;
+                return false;
+            }
+        } else if (!failed) {
+            std::cout << text;
+        }
+
+        if (output.write_out != WriteOut::none) {
+            WriteTimings(index, url, output.write_out);
+        }
+
+        if (!failed) {
+            return true;
+        }
+
+        // Explain to the user that there was a problem
+        std::cerr << "Failed: " << text;
+        if (show_url) {
+            std::cerr << " (" << url << ")";
+        }
+        std::cerr << std::endl;
+        return false;
+    }
+
+private:
+    static double Seconds(Request::Timings::duration_t duration) {
+        return std::chrono::duration<double>(duration).count();
+    }
+
+    static std::string Quote(const std::string& str) {
+        std::string rval = "\"";
+        for(const char ch : str) {
+            if ((ch == '"') || (ch == '\\')) {
+                rval += '\\';
+                rval += ch;
+            } else if (static_cast<unsigned char>(ch) < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", ch);
+                rval += buf;
+            } else {
+                rval += ch;
+            }
+        }
+        return rval + '"';
+    }
+
+    static std::string ErrorText(int error) {
+        if (!error) {
+            return "connected";
+        }
+        return boost::system::error_code(error,
+                                         boost::system::system_category())
+            .message();
+    }
+
+    /*! Print where the time went, with the names curl -w uses
+     *
+     * The transfer time is from the first byte until we were done, and
+     * the speed is the bytes we read over the whole fetch.
+     */
+    void WriteTimings(std::size_t index, const std::string& url,
+                      WriteOut format) const {
+        const auto& t = timings;
+        const auto transfer = (t.first_byte.count() && t.total.count())
+            ? t.total - t.first_byte : Request::Timings::duration_t{};
+        const double speed = t.total.count()
+            ? t.received / Seconds(t.total) : 0;
+        const auto attempts = std::min<std::size_t>(t.attempt_count,
+                                                    t.attempts.size());
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(6);
+        if (format == WriteOut::json) {
+            out << "{\"index\":" << index
+                << ",\"url\":" << Quote(url)
+                << ",\"http_code\":" << status;
+            if (failed) {
+                out << ",\"error\":" << Quote(text);
+            }
+            out << ",\"time_namelookup\":" << Seconds(t.resolved)
+                << ",\"time_connect\":" << Seconds(t.connected)
+                << ",\"time_pretransfer\":" << Seconds(t.sent)
+                << ",\"time_starttransfer\":" << Seconds(t.first_byte)
+                << ",\"time_transfer\":" << Seconds(transfer)
+                << ",\"time_total\":" << Seconds(t.total)
+                << ",\"size_download\":" << t.received
+                << ",\"speed_download\":" << std::setprecision(0) << speed
+                << std::setprecision(6)
+                << ",\"num_redirects\":" << redirects
+                << ",\"num_connects\":" << t.attempt_count
+                << ",\"connects\":[";
+            for(std::size_t i = 0; i < attempts; ++i) {
+                const auto& a = t.attempts[i];
+                std::ostringstream ep;
+                ep << a.Endpoint();
+                out << (i ? "," : "")
+                    << "{\"address\":" << Quote(ep.str())
+                    << ",\"start\":" << Seconds(a.started)
+                    << ",\"time\":" << Seconds(a.took)
+                    << ",\"result\":" << Quote(ErrorText(a.error)) << '}';
+            }
+            out << "]}\n";
+        } else {
+            out << "Timing for " << url << " (" << index << "): ";
+            if (failed) {
+                out << text;
+            } else {
+                out << "status " << status;
+            }
+            out << '\n'
+                << "  time_namelookup:    " << Seconds(t.resolved) << " s\n";
+            for(std::size_t i = 0; i < attempts; ++i) {
+                const auto& a = t.attempts[i];
+                out << "  connect " << a.Endpoint() << ": "
+                    << ErrorText(a.error) << " after " << Seconds(a.took)
+                    << " s, at " << Seconds(a.started) << " s\n";
+            }
+            if (t.attempt_count > attempts) {
+                out << "  (" << (t.attempt_count - attempts)
+                    << " more connect attempts)\n";
+            }
+            out << "  time_connect:       " << Seconds(t.connected) << " s\n"
+                << "  time_pretransfer:   " << Seconds(t.sent) << " s\n"
+                << "  time_starttransfer: " << Seconds(t.first_byte) << " s\n"
+                << "  time_transfer:      " << Seconds(transfer) << " s\n"
+                << "  time_total:         " << Seconds(t.total) << " s\n"
+                << "  size_download:      " << t.received << " bytes\n"
+                << "  speed_download:     " << std::setprecision(0) << speed
+                << " bytes/s\n"
+                << "  num_redirects:      " << redirects << '\n';
+        }
+
+        // In one piece, so the IO threads' log lines don't land in it
+        std::cerr << out.str() << std::flush;
+    }
+
+    /*! Write it to standard output, or to the ring, as a binary record
+     *
+     * The page goes out from the buffer we received it into, in the
+     * same writev() as the record header, or it's copied from there
+     * into the ring.
+     */
+    bool WriteRecord(std::size_t index, const std::string& url,
+                     resultring::Writer *ring) const {
+        resultstream::RecordHeader header;
+        header.index = static_cast<std::uint32_t>(index);
+        header.status = status;
+        header.resolved_us = timings.resolved.count();
+        header.connected_us = timings.connected.count();
+        header.sent_us = timings.sent.count();
+        header.first_byte_us = timings.first_byte.count();
+        header.total_us = timings.total.count();
+
+        iovec parts[4];
+        if (failed) {
+            header.flags = resultstream::RecordHeader::FLAG_FAILED;
+            resultstream::Gather(header, url, text, nullptr, 0, parts);
+        } else {
+            header.http_header_size = static_cast<std::uint32_t>(header_size);
+            resultstream::Gather(header, url, {}, text.data(), text.size(),
+                                 parts);
+        }
+
+        if (ring) {
+            return ring->Write(parts, 4);
+        }
+        return resultstream::WriteAll(STDOUT_FILENO, parts, 4);
+    }
+};
+
+/*! Prints the results in a batch, in input order or as they complete.
+ *
+ * The fetches complete in any order. In completion order, each result
+ * is printed as soon as the main thread gets to it. In input order,
+ * the results that complete before the ones in front of them wait in a
+ * reorder buffer. With a window, the buffer is bounded: the scheduler
+ * calls WaitForRoom() before it starts the next fetch, and that blocks
+ * (printing what it can) until the fetch is within window of the
+ * oldest result we have not printed. A slow URL at the head of the line
+ * then holds back new fetches, in stead of making us buffer all the
+ * pages behind it.
+ *
+ * Add() is called from the IO threads, the rest from the main thread.
+ */
+class ResultPrinter
+{
+    const std::vector<std::string>& urls_;
+    const bool ordered_;
+    const std::size_t window_;
+    const Output output_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::map<std::size_t, Outcome> done_; // Completed, not printed
+    std::size_t next_ = 0; // The next to print, in input order
+    std::size_t printed_ = 0;
+    std::size_t peak_buffered_ = 0;
+    int rval_ = 0;
+
+public:
+    /*! Constructor
+     *
+     * @param ordered Print in input order, in stead of completion order.
+     * @param window Max number of fetches started after the oldest one
+     *   we have not printed (input order only). 0 is unlimited.
+     */
+    ResultPrinter(const std::vector<std::string>& urls, bool ordered,
+                  std::size_t window, const Output& output)
+        : urls_(urls), ordered_(ordered), window_(window), output_(output) {}
+
+    void Add(std::size_t index, Outcome outcome) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_.emplace(index, std::move(outcome));
+        peak_buffered_ = std::max(peak_buffered_, done_.size());
+        ready_.notify_one();
+    }
+
+    /*! Wait until we can start the fetch for index, and print what's
+     * ready meanwhile.
+     */
+    void WaitForRoom(std::size_t index) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for(;;) {
+            PrintReady(lock);
+            if (!ordered_ || !window_ || (index < next_ + window_)) {
+                return;
+            }
+            ready_.wait(lock, [this]() { return HasReady(); });
+        }
+    }
+
+    /*! Print the rest of the results, as they complete
+     *
+     * @returns The exit code for the program
+     */
+    int Finish() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for(;;) {
+            PrintReady(lock);
+            if (printed_ == urls_.size()) {
+                return rval_;
+            }
+            ready_.wait(lock, [this]() { return HasReady(); });
+        }
+    }
+
+    void PrintStats(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "output: " << (ordered_ ? "input" : "completion")
+            << "-order window=" << window_
+            << " peak-buffered=" << peak_buffered_ << std::endl;
+    }
+
+private:
+    bool HasReady() const {
+        return ordered_ ? (done_.count(next_) != 0) : !done_.empty();
+    }
+
+    /*! Print what we can, without holding the lock while we print */
+    void PrintReady(std::unique_lock<std::mutex>& lock) {
+        std::vector<std::pair<std::size_t, Outcome>> batch;
+        if (ordered_) {
+            for(auto it = done_.find(next_); it != done_.end();
+                it = done_.find(++next_)) {
+                batch.emplace_back(it->first, std::move(it->second));
+                done_.erase(it);
+            }
+        } else {
+            for(auto& it : done_) {
+                batch.emplace_back(it.first, std::move(it.second));
+            }
+            done_.clear();
+        }
+
+        if (batch.empty()) {
+            return;
+        }
+
+        lock.unlock();
+        for(const auto& it : batch) {
+            if (!it.second.Print(it.first, urls_[it.first], urls_.size() > 1,
+                                 output_)) {
+                rval_ = -1;
+            }
+        }
+        std::cout.flush();
+        lock.lock();
+        printed_ += batch.size();
+    }
+};
@@ -0,0 +1,106 @@
+/*
+ * Remembers permanent redirects, so that we can go straight to where
+ * an URL was moved.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "http.h"
+
+/*! Remembers permanent redirects, so that later fetches of an URL that
+ * has moved go straight to the new location.
+ *
+ * Only 301 and 308 redirects are cached; the others may change with
+ * each request. The cache is bounded, and drops the entries that were
+ * used least recently.
+ */
+class RedirectCache
+{
+    using entry_t = std::pair<std::string, Url>;
+
+    const std::size_t capacity_;
+    std::list<entry_t> entries_; // The most recently used first
+    std::map<std::string, std::list<entry_t>::iterator> index_;
+    std::mutex mutex_;
+    std::size_t hits_ = 0;
+    std::size_t followed_ = 0;
+    std::size_t reused_ = 0;
+
+public:
+    explicit RedirectCache(std::size_t capacity) : capacity_(capacity) {}
+
+    /*! Get where from has moved to
+     *
+     * @returns true if to was set
+     */
+    bool Lookup(const Url& from, Url& to) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(Key(from));
+        if (it == index_.end()) {
+            return false;
+        }
+
+        entries_.splice(entries_.begin(), entries_, it->second);
+        to = it->second->second;
+        ++hits_;
+        return true;
+    }
+
+    /*! Remember that from has moved to to for good */
+    void Put(const Url& from, const Url& to) {
+        if (!capacity_) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto key = Key(from);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            it->second->second = to;
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return;
+        }
+
+        entries_.emplace_front(key, to);
+        index_[key] = entries_.begin();
+        if (entries_.size() > capacity_) {
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
+
+    /*! Count a redirect we followed
+     *
+     * @param reused True if the request went on the same connection
+     */
+    void Followed(bool reused) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++followed_;
+        reused_ += reused ? 1 : 0;
+    }
+
+    void PrintStats(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "redirects: followed=" << followed_
+            << " same-connection=" << reused_
+            << " cache-hits=" << hits_
+            << " cached=" << entries_.size() << std::endl;
+    }
+
+private:
+    static std::string Key(const Url& url) {
+        return url.Origin() + url.path;
+    }
+};
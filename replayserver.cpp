@@ -0,0 +1,310 @@
+
+/*
+ * Serves responses recorded with "modern --capture" back on loopback,
+ * with the timing they were recorded with.
+ *
+ * Benchmarks against live sites are noisy, and need a network. With a
+ * recording, the Request implementations can be compared against the
+ * same, realistic, traffic as many times as we want:
+ *
+ *    modern --capture sites.cap --urls-file sites.txt
+ *    replayserver --port 8080 sites.cap
+ *    modern --hosts-file loopback-hosts --urls-file sites-on-8080.txt
+ *
+ * Requests are matched on the host-name (without the port) and the
+ * path, so the URLs can be pointed at another port than the one they
+ * were recorded from. If the same URL was recorded several times, the
+ * recordings are served in turn. The first chunk of a response is sent
+ * after the recorded time to first byte, and the rest with the
+ * recorded gaps between them. Connections that failed while we
+ * recorded are reset after the last chunk.
+ *
+ * The server uses the coroutine approach from "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <memory>
+#include <map>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/program_options.hpp>
+
+#include "capture.h"
+
+using boost::asio::ip::tcp;
+
+class ReplayServer
+{
+    /*! The recordings of one URL */
+    struct Entry {
+        std::vector<capture::Exchange> exchanges;
+        std::size_t next = 0;
+    };
+
+    boost::asio::io_service io_service_;
+    std::map<std::string, Entry> entries_; // By host + path
+    std::set<unsigned short> ports_;
+    std::mutex mutex_;
+    const double speed_;
+
+public:
+    /*! @param speed How much faster than recorded we replay. 0 removes
+     *    all the delays.
+     */
+    ReplayServer(double speed) : speed_(speed) {}
+
+    void Load(const std::string& path) {
+        auto exchanges = capture::Load(path);
+        std::clog << "Loaded " << exchanges.size() << " responses from "
+            << path << std::endl;
+
+        for(auto& ex : exchanges) {
+            ports_.insert(static_cast<unsigned short>(ex.port));
+            entries_[Key(ex.host, ex.path)].exchanges.push_back(std::move(ex));
+        }
+    }
+
+    /*! Start serving
+     *
+     * @param port Listen on this port. If 0, we listen on all the ports
+     *   in the recordings.
+     */
+    void Run(const std::string& address, unsigned short port, int threads) {
+        std::set<unsigned short> ports = ports_;
+        if (port) {
+            ports = {port};
+        }
+
+        for(const auto p : ports) {
+            const tcp::endpoint ep(boost::asio::ip::address::from_string(
+                address), p);
+            boost::asio::spawn(io_service_, std::bind(&ReplayServer::Accept,
+                                                      this, ep,
+                                                      std::placeholders::_1));
+        }
+
+        std::vector<std::thread> workers;
+        for(int i = 1; i < threads; ++i) {
+            workers.emplace_back([this]() { io_service_.run(); });
+        }
+        io_service_.run();
+
+        for(auto& t : workers) {
+            t.join();
+        }
+    }
+
+private:
+    static std::string Key(std::string host, const std::string& path) {
+        std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+        return host + path;
+    }
+
+    /*! Get the host-name from the value of a Host header */
+    static std::string HostName(std::string value) {
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+
+        if (!value.empty() && (value.front() == '[')) {
+            // IPv6 literal
+            const auto end = value.find(']');
+            return value.substr(1, end == std::string::npos
+                                ? std::string::npos : end - 1);
+        }
+
+        return value.substr(0, value.find(':'));
+    }
+
+    /*! Pick the next recording for a request, or nullptr */
+    const capture::Exchange *Lookup(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            return nullptr;
+        }
+
+        auto& entry = it->second;
+        const auto *rval = &entry.exchanges[entry.next];
+        entry.next = (entry.next + 1) % entry.exchanges.size();
+        return rval;
+    }
+
+    void Accept(tcp::endpoint ep, boost::asio::yield_context yield) {
+        tcp::acceptor acceptor(io_service_);
+        acceptor.open(ep.protocol());
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        acceptor.bind(ep);
+        acceptor.listen();
+        std::clog << "Listening on " << ep << std::endl;
+
+        boost::asio::steady_timer timer(io_service_);
+        for(;;) {
+            auto sck = std::make_shared<tcp::socket>(io_service_);
+            boost::system::error_code ec;
+            acceptor.async_accept(*sck, yield[ec]);
+            if (ec) {
+                std::cerr << "Accept failed on " << ep << ": "
+                    << ec.message() << std::endl;
+
+                /* Out of file descriptors, most likely. Give the
+                 * connections we have a chance to close, in stead of
+                 * spinning on the error.
+                 */
+                timer.expires_from_now(std::chrono::milliseconds(100));
+                timer.async_wait(yield[ec]);
+                continue;
+            }
+
+            boost::asio::spawn(io_service_, std::bind(&ReplayServer::Serve,
+                                                      this, sck,
+                                                      std::placeholders::_1));
+        }
+    }
+
+    void Serve(std::shared_ptr<tcp::socket> sck,
+               boost::asio::yield_context yield) {
+        try {
+            boost::asio::streambuf request;
+            boost::asio::async_read_until(*sck, request, "\r\n\r\n", yield);
+            const auto received = std::chrono::steady_clock::now();
+
+            std::istream in(&request);
+            std::string method, path, line, host;
+            in >> method >> path;
+            std::getline(in, line);
+            while(std::getline(in, line) && (line != "\r")) {
+                const auto colon = line.find(':');
+                auto name = line.substr(0, colon);
+                std::transform(name.begin(), name.end(), name.begin(),
+                               ::tolower);
+                if ((name == "host") && (colon != std::string::npos)) {
+                    host = HostName(line.substr(colon + 1));
+                }
+            }
+
+            const auto *ex = Lookup(Key(host, path));
+            if (!ex) {
+                std::cerr << "Not recorded: " << host << path << std::endl;
+                static const std::string not_found =
+                    "HTTP/1.1 404 Not Found\r\n"
+                    "Content-Length: 0\r\n"
+                    "Connection: close\r\n\r\n";
+                boost::asio::async_write(*sck, boost::asio::buffer(not_found),
+                                         yield);
+                sck->shutdown(tcp::socket::shutdown_both);
+                return;
+            }
+
+            /* The chunks are sent at their recorded time after the
+             * request, so slow writes don't add up over the response.
+             */
+            boost::asio::steady_timer timer(io_service_);
+            auto when = received;
+            std::size_t offset = 0;
+            for(const auto& chunk : ex->chunks) {
+                if (speed_ > 0) {
+                    when += std::chrono::microseconds(
+                        static_cast<long long>(chunk.delay_us / speed_));
+                    timer.expires_at(when);
+                    timer.async_wait(yield);
+                }
+
+                boost::asio::async_write(*sck, boost::asio::buffer(
+                    ex->data.data() + offset, chunk.len), yield);
+                offset += chunk.len;
+            }
+
+            if (ex->flags & capture::Exchange::FLAG_RESET) {
+                // A zero linger-time makes close() send a RST
+                sck->set_option(boost::asio::socket_base::linger(true, 0));
+                sck->close();
+                return;
+            }
+
+            sck->shutdown(tcp::socket::shutdown_both);
+        } catch(const std::exception& ex) {
+            std::cerr << "Connection failed: " << ex.what() << std::endl;
+        }
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    namespace po = boost::program_options;
+
+    std::string address = "127.0.0.1";
+    std::vector<std::string> files;
+    unsigned short port = 0;
+    int threads = 1;
+    double speed = 1.0;
+
+    po::options_description opts("Options");
+    opts.add_options()
+        ("help,h", "Print help and exit")
+        ("address", po::value(&address)->default_value(address),
+            "Address to listen on")
+        ("port", po::value(&port)->default_value(port),
+            "Port to listen on. 0 listens on the ports in the recordings")
+        ("threads", po::value(&threads)->default_value(threads),
+            "Number of IO threads")
+        ("speed", po::value(&speed)->default_value(speed),
+            "Replay this many times faster than recorded. 0 sends "
+            "everything right away")
+        ;
+
+    po::options_description hidden;
+    hidden.add_options()
+        ("file", po::value(&files)->required(), "capture file");
+
+    po::options_description all;
+    all.add(opts).add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("file", -1);
+
+    static const char *usage = " [options] capture-file ...";
+
+    try {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(all)
+            .positional(positional).run(), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: " << argv[0] << usage << std::endl
+                << opts << std::endl;
+            return 0;
+        }
+
+        po::notify(vm);
+    } catch(const std::exception& ex) {
+        std::cerr << ex.what() << std::endl
+            << "Usage: " << argv[0] << usage << std::endl
+            << opts << std::endl;
+        return -1;
+    }
+
+    try {
+        ReplayServer server(speed);
+        for(const auto& file : files) {
+            server.Load(file);
+        }
+
+        server.Run(address, port, threads);
+    } catch(const std::exception& ex) {
+        std::cerr << "Caught exception " << ex.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,1846 @@
+/*
+ * The HTTP client of "modern.cpp": fetches URLs on an io_service, with
+ * one coroutine per request.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/container/pmr/monotonic_buffer_resource.hpp>
+#include <boost/container/pmr/string.hpp>
+#include <boost/container/pmr/vector.hpp>
+
+#include "hosts.h"
+#include "resolver.h"
+#include "config.h"
+#include "budget.h"
+#include "bufferpool.h"
+#include "sourceports.h"
+#include "loopmonitor.h"
+#include "http.h"
+#include "connectionpool.h"
+#include "redirectcache.h"
+#include "capture.h"
+#include "asynclog.h"
+
+namespace pmr = boost::container::pmr;
+
+/*! One stage (resolve, connect or transfer) in a fetch.
+ *
+ * Limits how many requests can be in the stage at the same time. The
+ * others wait in a queue, and are let in, in the order they arrived,
+ * as the requests ahead of them leave the stage.
+ */
+class Stage
+{
+public:
+    struct Stats {
+        std::size_t entered = 0;
+        std::size_t active = 0;
+        std::size_t queued = 0;
+        std::size_t peak_active = 0;
+        std::size_t peak_queued = 0;
+        std::chrono::microseconds waited{0};
+    };
+
+    /*! A place in the stage.
+     *
+     * The constructor suspends the coroutine until we are let in, and the
+     * destructor leaves the stage.
+     */
+    class Slot {
+        Stage& stage_;
+
+    public:
+        Slot(Stage& stage, boost::asio::yield_context yield)
+            : stage_(stage) { stage_.Enter(yield); }
+        Slot(const Slot&) = delete;
+        ~Slot() { stage_.Leave(); }
+    };
+
+private:
+    const std::string name_;
+    const std::size_t limit_;
+    WaitQueue waiters_;
+    Stats stats_;
+    mutable std::mutex mutex_;
+
+public:
+    Stage(boost::asio::io_service& io_service, std::string name,
+          std::size_t limit)
+        : name_(std::move(name)), limit_(limit), waiters_(io_service) {}
+
+    const std::string& GetName() const { return name_; }
+
+    Stats GetStats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    void Enter(boost::asio::yield_context yield) {
+        const auto start = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++stats_.entered;
+        if (!limit_ || (stats_.active < limit_)) {
+            Admit();
+            return;
+        }
+
+        /* Leave() hands us it's place before it wakes us up, so we are
+         * in when we resume.
+         */
+        stats_.queued = waiters_.Size() + 1;
+        stats_.peak_queued = std::max(stats_.peak_queued, stats_.queued);
+        waiters_.Wait(lock, yield);
+
+        lock.lock();
+        stats_.waited += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+    }
+
+    void Leave() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --stats_.active;
+
+        if (!waiters_.Empty()) {
+            // Hand our place over to the first one in the queue
+            Admit();
+            waiters_.WakeOne();
+            stats_.queued = waiters_.Size();
+        }
+    }
+
+    void Admit() {
+        ++stats_.active;
+        stats_.peak_active = std::max(stats_.peak_active, stats_.active);
+    }
+};
+
+/*! A request body that is sent without copying it through our memory.
+ *
+ * The body is either a range of a file, that the kernel sends straight
+ * from the page-cache with sendfile(), or a buffer in memory, that is
+ * sent with MSG_ZEROCOPY when it's large enough to pay for the page
+ * pinning. Several requests can share the same body.
+ */
+struct Body
+{
+    /*! Closes the file when the last request using it is done */
+    struct File {
+        const int fd;
+        explicit File(int fd) : fd(fd) {}
+        File(const File&) = delete;
+        ~File() { ::close(fd); }
+    };
+
+    std::string method = "POST";
+    std::string content_type = "application/octet-stream";
+
+    /*! Send with "Transfer-Encoding: chunked" in stead of a
+     * Content-Length header.
+     */
+    bool chunked = false;
+
+    // A range of a file
+    std::shared_ptr<File> file;
+    off_t offset = 0;
+    std::size_t length = 0;
+
+    // Or a buffer
+    std::shared_ptr<const std::string> data;
+
+    /*! Send all of a file */
+    static std::shared_ptr<Body> FromFile(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path + ": "
+                                     + strerror(errno));
+        }
+
+        auto rval = std::make_shared<Body>();
+        rval->file = std::make_shared<File>(fd);
+        struct stat st = {};
+        if (::fstat(fd, &st) != 0) {
+            throw std::runtime_error("Cannot stat " + path + ": "
+                                     + strerror(errno));
+        }
+        rval->length = static_cast<std::size_t>(st.st_size);
+        return rval;
+    }
+
+    /*! Send a buffer. It's not copied, so it must not change. */
+    static std::shared_ptr<Body> FromMemory(
+        std::shared_ptr<const std::string> data) {
+        auto rval = std::make_shared<Body>();
+        rval->length = data->size();
+        rval->data = std::move(data);
+        return rval;
+    }
+};
+
+/*! Writes the body of a response to a file, in stead of to memory.
+ *
+ * When the server tells us the Content-Length, the file is preallocated
+ * with fallocate() (so we get ENOSPC up front, in stead of a SIGBUS
+ * later), and mapped. The socket reads go straight into the mapping, so
+ * the body is never copied by us. The pages we are done with are
+ * dropped from our mapping as we go; they stay in the page-cache until
+ * the kernel writes them, so a multi-GB download doesn't grow our
+ * resident memory.
+ *
+ * Without a Content-Length, or if the file-system can't preallocate,
+ * we write what we read with pwrite().
+ */
+class FileSink
+{
+    /*! How much we map-read before we drop the pages behind us */
+    static constexpr std::size_t release_interval = 64 * 1024 * 1024;
+
+    const std::string path_;
+    int fd_ = -1;
+    char *map_ = nullptr;
+    std::size_t map_size_ = 0;
+    std::size_t written_ = 0;
+    std::size_t released_ = 0;
+
+public:
+    explicit FileSink(std::string path) : path_(std::move(path)) {}
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator = (const FileSink&) = delete;
+
+    ~FileSink() {
+        Close();
+    }
+
+    /*! Create the file
+     *
+     * @param length The size of the body, if the server told us.
+     */
+    boost::system::error_code Open(const std::size_t *length) {
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     0644);
+        if (fd_ < 0) {
+            return {errno, boost::system::system_category()};
+        }
+
+        if (!length || !*length
+            || (::fallocate(fd_, 0, 0, static_cast<off_t>(*length)) != 0)) {
+            return {}; // We'll use pwrite()
+        }
+
+        void *mem = ::mmap(nullptr, *length, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd_, 0);
+        if (mem == MAP_FAILED) {
+            return {}; // We'll use pwrite()
+        }
+
+        ::madvise(mem, *length, MADV_SEQUENTIAL);
+        map_ = static_cast<char *>(mem);
+        map_size_ = *length;
+        return {};
+    }
+
+    bool IsOpen() const { return fd_ >= 0; }
+
+    /*! True if the socket can read straight into Cursor() */
+    bool IsMapped() const { return map_ != nullptr; }
+
+    /*! Where the next bytes go, when mapped */
+    char *Cursor() const { return map_ + written_; }
+
+    /*! Bytes left until the end of the mapping */
+    std::size_t Remaining() const { return map_size_ - written_; }
+
+    /*! Note that len bytes were read into Cursor() */
+    void Advance(std::size_t len) {
+        written_ += len;
+        if (written_ - released_ >= release_interval) {
+            // Page align, and leave the partial page for the next time
+            const auto end = written_ & ~std::size_t(4095);
+            ::madvise(map_ + released_, end - released_, MADV_DONTNEED);
+            released_ = end;
+        }
+    }
+
+    /*! Copy data to the file */
+    boost::system::error_code Write(const char *data, std::size_t len) {
+        if (map_) {
+            len = std::min(len, Remaining());
+            std::memcpy(Cursor(), data, len);
+            Advance(len);
+            return {};
+        }
+
+        while(len) {
+            const auto bytes = ::pwrite(fd_, data, len,
+                                        static_cast<off_t>(written_));
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return {errno, boost::system::system_category()};
+            }
+            data += bytes;
+            len -= static_cast<std::size_t>(bytes);
+            written_ += static_cast<std::size_t>(bytes);
+        }
+        return {};
+    }
+
+    /*! Bytes in the file so far */
+    std::size_t GetWritten() const { return written_; }
+
+    /*! Unmap and close the file.
+     *
+     * If the server sent less than it promised, the file is cut to what
+     * we got.
+     */
+    void Close() {
+        if (map_) {
+            ::munmap(map_, map_size_);
+            map_ = nullptr;
+            if (written_ < map_size_) {
+                if (::ftruncate(fd_, static_cast<off_t>(written_)) != 0) {
+                    const boost::system::error_code ec(
+                        errno, boost::system::system_category());
+                    ASYNCLOG("Failed to truncate {}: {}", path_,
+                             ec.message());
+                }
+            }
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+};
+
+constexpr std::size_t FileSink::release_interval;
+
+/*! HTTP Client object. */
+class Request
+{
+    using tcp = boost::asio::ip::tcp;
+
+    /*! Endpoints for a host, allocated from the request's arena */
+    using endpoints_t = pmr::vector<tcp::endpoint>;
+
+    /*! Bytes of the coroutine's stack we use for the arena. Most
+     * requests fit in this, and never touch the heap for their
+     * short-lived objects.
+     */
+    static constexpr std::size_t arena_stack_size = 2048;
+
+    /*! Buffers smaller than this are copied; MSG_ZEROCOPY costs more
+     * than a copy for small sends.
+     */
+    static constexpr std::size_t zerocopy_threshold = 16 * 1024;
+
+    /*! Bytes per chunk in chunked uploads */
+    static constexpr std::size_t upload_chunk_size = 1024 * 1024;
+
+    /*! Largest read straight into a mapped file, or a response */
+    static constexpr std::size_t max_read_size = 1024 * 1024;
+
+    /*! Most we reserve for a body from it's Content-Length, before we
+     * have received it.
+     */
+    static constexpr std::size_t max_body_reserve = 16 * 1024 * 1024;
+
+    /*! Socket option for the Linux SO_BUSY_POLL setting */
+    using busy_poll_option = boost::asio::detail::socket_option::integer<
+        SOL_SOCKET, SO_BUSY_POLL>;
+
+    /*! Let connect() pick the port after we bind to a local address */
+    using bind_no_port_option = boost::asio::detail::socket_option::integer<
+        IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT>;
+
+    /*! Per-socket range of ephemeral ports (Linux 6.3) */
+    using local_port_range_option = boost::asio::detail::socket_option::integer<
+        IPPROTO_IP, 51 /* IP_LOCAL_PORT_RANGE */>;
+
+    const Config config_;
+    boost::asio::io_service io_service_;
+    std::unique_ptr<boost::asio::io_service::work> work_;
+    std::vector<std::thread> threads_;
+    MemoryBudget budget_;
+    std::unique_ptr<DnsResolver> dns_;
+    Stage resolving_;
+    Stage connecting_;
+    Stage transferring_;
+    ConnectionPool pool_;
+    std::unique_ptr<LoopMonitor> monitor_;
+    std::unique_ptr<BufferPool> recv_pool_;
+    std::unique_ptr<SourcePorts> sources_;
+    std::unique_ptr<RedirectCache> redirects_;
+    std::once_flag port_range_warning_;
+
+public:
+    /*! Constructor
+     *
+     * Starts the threads for the event-loop. Since we may have many
+     * requests in flight at the same time, they share the threads,
+     * in stead of starting one thread per request.
+     */
+    Request(const Config& config = {})
+        : config_(config)
+        , work_(std::make_unique<boost::asio::io_service::work>(io_service_))
+        , budget_(io_service_, config.max_buffered_bytes)
+        , resolving_(io_service_, "resolve", config.max_resolving)
+        , connecting_(io_service_, "connect", config.max_connecting)
+        , transferring_(io_service_, "transfer", config.max_transferring)
+        , pool_(config.pool_idle_timeout)
+    {
+        if (config_.builtin_resolver) {
+            dns_ = std::make_unique<DnsResolver>(io_service_, config_.dns);
+        }
+
+        if (config_.monitor_loop || (config_.slow_handler.count() > 0)) {
+            monitor_ = std::make_unique<LoopMonitor>(
+                io_service_, config_.lag_probe_interval, config_.slow_handler);
+        }
+
+        if (!config_.source_addresses.empty()) {
+            sources_ = std::make_unique<SourcePorts>(config_.source_addresses);
+        }
+
+        if (config_.recv_pool || config_.huge_pages) {
+            recv_pool_ = std::make_unique<BufferPool>(config_.recv_block_size,
+                                                      config_.huge_pages);
+        }
+
+        if (config_.max_redirects) {
+            redirects_ = std::make_unique<RedirectCache>(
+                config_.redirect_cache_size);
+        }
+
+        for(int i = 0; i < std::max(config_.io_threads, 1); ++i) {
+            threads_.emplace_back([this]() { RunIoService();});
+        }
+    }
+
+    /*! Destructor
+     *
+     * Waits for all the requests in flight to finish.
+     */
+    ~Request() {
+        work_.reset();
+        if (monitor_) {
+            monitor_->Stop();
+        }
+        for(auto& t : threads_) {
+            t.join();
+        }
+
+        // The queued recordings are charged to budget_
+        if (config_.capture) {
+            config_.capture->Flush();
+        }
+    }
+
+    /*! Async fetch a single HTTP page.
+     *
+     * @param url The host we want to connect to, optionally with a
+     *   port and a path, as in "http://host:8080/path". If no path is
+     *   given, we fetch the root-level "/". Throws if the URL is invalid.
+     *
+     * @returns A future that will, at some later time, be able to provide
+     *  the content of the page, or throw an exception if the async
+     *  fetch failed. We need to return a future, in stead of a string, since
+     *  this is an Async method that is expected to return immediately.
+     *
+     * @Note This is not production-grade code, as we don't look at the
+     *   HTTP headers from the server, and don't validate the length of
+     *   the returned data. We also don't deal with authentication.
+     *   This is intentionally, as this code is meant to illustrate how we do
+     *   network IO, and not how we deal with an increasingly bloated HTTP
+     *   standard.
+     */
+    auto Fetch(const std::string& url) {
+        const auto target = Url::Parse(url);
+        auto result = std::make_shared<std::promise<std::string>>();
+
+        /* Ask asio to call Fetch_ from one of the IO threads we started
+         * in the constructor.
+         */
+        boost::asio::spawn(io_service_, [this, target, result](
+            boost::asio::yield_context yield) {
+                try {
+                    Result rval;
+                    const auto ec = FetchWithArena_(target, nullptr, nullptr,
+                                                    rval, yield);
+                    if (ec) {
+                        /* We pass the error to the result promise. At this
+                         * moment, the future that the main-thread holds will
+                         * unblock, and the exception will be thrown there
+                         * when result.get() is called.
+                         *
+                         * make_exception_ptr() gives us the exception
+                         * without throwing it here first.
+                         */
+                        result->set_exception(std::make_exception_ptr(
+                            boost::system::system_error(ec)));
+                        return;
+                    }
+
+                    result->set_value(rval.response.TakeData());
+                } catch(...) {
+                    // Out of memory, or something equally bad
+                    result->set_exception(std::current_exception());
+                }
+            });
+
+        // Return the future to the caller.
+        return result->get_future();
+    }
+
+    /*! When the steps of a fetch were done, counted from the start of
+     * it. The steps we did not get to are 0.
+     */
+    struct Timings {
+        using clock_t = std::chrono::steady_clock;
+        using duration_t = std::chrono::microseconds;
+
+        clock_t::time_point started;
+        duration_t resolved{};
+        duration_t connected{};
+        duration_t sent{};
+        duration_t first_byte{};
+        duration_t total{};
+
+        /*! A connect() to one of the host's addresses
+         *
+         * Plain data, so the workers can hand it over in shared memory.
+         */
+        struct Attempt {
+            sockaddr_in6 address{}; // Large enough for either family
+            duration_t started{};
+            duration_t took{};
+            int error = 0; // In the system category. 0 if it connected.
+
+            tcp::endpoint Endpoint() const {
+                tcp::endpoint ep;
+                std::memcpy(ep.data(), &address, sizeof(address));
+                return ep;
+            }
+        };
+
+        /*! The first connect attempts. attempt_count has all of them. */
+        std::array<Attempt, 4> attempts{};
+        std::uint32_t attempt_count = 0;
+
+        /*! Bytes read from the socket(s) */
+        std::uint64_t received = 0;
+
+        void Start() { started = clock_t::now(); }
+
+        void AddAttempt(const tcp::endpoint& endpoint, duration_t begin,
+                        const boost::system::error_code& ec) {
+            if (attempt_count < attempts.size()) {
+                auto& attempt = attempts[attempt_count];
+                std::memcpy(&attempt.address, endpoint.data(),
+                            std::min<std::size_t>(endpoint.size(),
+                                                  sizeof(attempt.address)));
+                attempt.started = begin;
+                attempt.took = Elapsed() - begin;
+                attempt.error = ec.value();
+            }
+            ++attempt_count;
+        }
+
+        duration_t Elapsed() const {
+            return std::chrono::duration_cast<duration_t>(clock_t::now()
+                                                          - started);
+        }
+    };
+
+    /*! The outcome of TryFetch() */
+    struct Result {
+        boost::system::error_code ec;
+        Response response;
+        Timings timings;
+
+        /*! Bytes saved to the file, from TryDownload() */
+        std::size_t downloaded = 0;
+
+        /*! Redirects we followed to get the response */
+        std::size_t redirects = 0;
+    };
+
+    /*! Async fetch a single HTTP page, without exceptions.
+     *
+     * Works like Fetch(), but failures, including invalid URLs, are
+     * reported in Result::ec. Use this when many of the fetches are
+     * expected to fail, as exceptions are expensive.
+     */
+    std::future<Result> TryFetch(const std::string& url) {
+        auto result = std::make_shared<std::promise<Result>>();
+        TryFetch(url, [result](Result& rval) {
+            result->set_value(std::move(rval));
+        });
+        return result->get_future();
+    }
+
+    /*! Async fetch a single HTTP page, and call handler when done.
+     *
+     * The handler is called from one of the IO threads, as soon as the
+     * fetch is done. It can move the response out of the result.
+     */
+    void TryFetch(const std::string& url,
+                  std::function<void(Result& result)> handler) {
+        TrySend_(url, nullptr, {}, std::move(handler));
+    }
+
+    /*! Async send a body (say, a file) to an URL, and get the reply.
+     *
+     * Works like TryFetch(), but sends body->method with the body. The
+     * body is not read into memory; see Body.
+     */
+    std::future<Result> TryUpload(const std::string& url,
+                                  std::shared_ptr<const Body> body) {
+        auto result = std::make_shared<std::promise<Result>>();
+        TryUpload(url, std::move(body), [result](Result& rval) {
+            result->set_value(std::move(rval));
+        });
+        return result->get_future();
+    }
+
+    /*! Async upload, and call handler when done. */
+    void TryUpload(const std::string& url, std::shared_ptr<const Body> body,
+                   std::function<void(Result& result)> handler) {
+        /* sendfile() has no MSG_NOSIGNAL, so a server that closes on
+         * us would kill the process with SIGPIPE. Unless someone else
+         * has decided what to do with it, we ignore it, and get EPIPE.
+         */
+        static std::once_flag sigpipe;
+        std::call_once(sigpipe, []() {
+            struct sigaction sa = {};
+            if ((::sigaction(SIGPIPE, nullptr, &sa) == 0)
+                && (sa.sa_handler == SIG_DFL)) {
+                ::signal(SIGPIPE, SIG_IGN);
+            }
+        });
+
+        TrySend_(url, std::move(body), {}, std::move(handler));
+    }
+
+    /*! Async fetch a page, and save the body to a file.
+     *
+     * The body never goes through memory; see FileSink. The response in
+     * the result has just the headers, and Result::downloaded tells how
+     * many bytes were saved. If the fetch fails, the file may be
+     * incomplete.
+     */
+    std::future<Result> TryDownload(const std::string& url,
+                                    const std::string& path) {
+        auto result = std::make_shared<std::promise<Result>>();
+        TryDownload(url, path, [result](Result& rval) {
+            result->set_value(std::move(rval));
+        });
+        return result->get_future();
+    }
+
+    /*! Async download to a file, and call handler when done. */
+    void TryDownload(const std::string& url, const std::string& path,
+                     std::function<void(Result& result)> handler) {
+        TrySend_(url, nullptr, path, std::move(handler));
+    }
+
+    /*! Async resolve the host in an URL, without fetching anything.
+     *
+     * @returns A future for the IP address(es) we would try to connect to.
+     */
+    std::future<std::vector<tcp::endpoint>> Resolve(const std::string& url) {
+        const auto target = Url::Parse(url);
+        auto result = std::make_shared<
+            std::promise<std::vector<tcp::endpoint>>>();
+
+        boost::asio::spawn(io_service_, [this, target, result](
+            boost::asio::yield_context yield) {
+                try {
+                    endpoints_t endpoints;
+                    Stage::Slot slot(resolving_, yield);
+                    const auto ec = Resolve_(target, endpoints, yield);
+                    if (ec) {
+                        result->set_exception(std::make_exception_ptr(
+                            boost::system::system_error(ec)));
+                        return;
+                    }
+                    result->set_value({endpoints.begin(), endpoints.end()});
+                } catch(...) {
+                    result->set_exception(std::current_exception());
+                }
+            });
+
+        return result->get_future();
+    }
+
+    /*! Open connections in advance for upcoming fetches.
+     *
+     * Resolves the host in the URL, and opens up to count connections to
+     * it. They are kept in a pool, and used by the next fetches to the
+     * same host and port, which then skip the DNS lookup and the TCP
+     * handshake. Each connection is used for one fetch.
+     *
+     * @returns A future for the number of connections that were opened.
+     */
+    std::future<std::size_t> Preconnect(const std::string& url,
+                                        std::size_t count) {
+        const auto target = Url::Parse(url);
+        auto result = std::make_shared<std::promise<std::size_t>>();
+
+        boost::asio::spawn(io_service_, [this, target, count, result](
+            boost::asio::yield_context yield) {
+                try {
+                    if (!count) {
+                        result->set_value(0);
+                        return;
+                    }
+
+                    endpoints_t endpoints;
+                    boost::system::error_code ec;
+                    {
+                        Stage::Slot slot(resolving_, yield);
+                        ec = Resolve_(target, endpoints, yield);
+                    }
+                    if (ec) {
+                        result->set_exception(std::make_exception_ptr(
+                            boost::system::system_error(ec)));
+                        return;
+                    }
+
+                    // Connect in parallel, and report when all are done
+                    struct Progress {
+                        std::size_t pending;
+                        std::size_t opened = 0;
+                        std::mutex mutex;
+                    };
+                    auto progress = std::make_shared<Progress>();
+                    progress->pending = count;
+
+                    for(std::size_t i = 0; i < count; ++i) {
+                        boost::asio::spawn(io_service_, [=](
+                            boost::asio::yield_context yield) {
+                                tcp::socket sck(io_service_);
+                                bool connected = false;
+                                {
+                                    Stage::Slot slot(connecting_, yield);
+                                    connected = !Connect_(sck, endpoints,
+                                                          yield);
+                                }
+                                if (connected) {
+                                    pool_.Put(target.Origin(), std::move(sck));
+                                }
+
+                                std::lock_guard<std::mutex> lock(
+                                    progress->mutex);
+                                if (connected) {
+                                    ++progress->opened;
+                                }
+                                if (!--progress->pending) {
+                                    result->set_value(progress->opened);
+                                }
+                            });
+                    }
+                } catch(...) {
+                    result->set_exception(std::current_exception());
+                }
+            });
+
+        return result->get_future();
+    }
+
+    /*! Print the handler run-times and the event-loop lag
+     *
+     * Only if Config::monitor_loop is set.
+     */
+    void PrintLoopStats(std::ostream& out) const {
+        if (monitor_) {
+            monitor_->Print(out);
+        }
+    }
+
+    /*! Print how the receive pool was backed, and how much it was used */
+    void PrintPoolStats(std::ostream& out) const {
+        if (recv_pool_) {
+            recv_pool_->PrintStats(out);
+        }
+    }
+
+    /*! Print how many redirects we followed, and the cache hits */
+    void PrintRedirectStats(std::ostream& out) const {
+        if (redirects_) {
+            redirects_->PrintStats(out);
+        }
+    }
+
+    /*! Print the connections from each local address (--source-address) */
+    void PrintSourceStats(std::ostream& out) const {
+        if (sources_) {
+            sources_->PrintStats(out);
+        }
+    }
+
+    /*! Print the queue metrics for the stages of the fetches */
+    void PrintStageStats(std::ostream& out) const {
+        for(const auto *stage : {&resolving_, &connecting_, &transferring_}) {
+            const auto stats = stage->GetStats();
+            out << stage->GetName() << ": entered=" << stats.entered
+                << " active=" << stats.active
+                << " queued=" << stats.queued
+                << " peak-active=" << stats.peak_active
+                << " peak-queued=" << stats.peak_queued
+                << " avg-wait-us=" << (stats.entered
+                    ? stats.waited.count() / stats.entered : 0)
+                << std::endl;
+        }
+    }
+
+private:
+
+    /*! Run the event-loop until we run out of work.
+     *
+     * The work_ object keeps the event-loop alive until the destructor
+     * is called, also between requests.
+     *
+     * In busy-poll mode we spin on poll(), which never sleeps in the
+     * kernel. When we have been idle for longer than the spin budget,
+     * we block in run_one() until something happens, and then start
+     * spinning again.
+     */
+    void RunIoService() {
+        if (monitor_) {
+            monitor_->AttachThread();
+        }
+
+        if (!config_.busy_poll) {
+            io_service_.run();
+            return;
+        }
+
+        auto idle_since = std::chrono::steady_clock::now();
+        while(!io_service_.stopped()) {
+            if (io_service_.poll()) {
+                idle_since = std::chrono::steady_clock::now();
+                continue;
+            }
+
+            if ((std::chrono::steady_clock::now() - idle_since)
+                < config_.spin_budget) {
+                continue;
+            }
+
+            // Low load. Let the kernel wake us up.
+            io_service_.run_one();
+            idle_since = std::chrono::steady_clock::now();
+        }
+    }
+
+    /*! Find the address(es) for a host without asking the DNS system
+     *
+     * @returns true if the endpoints were found
+     */
+    bool Lookup(const Url& url, endpoints_t& endpoints) const {
+        boost::system::error_code ec;
+        const auto address = boost::asio::ip::address::from_string(url.host,
+                                                                   ec);
+        if (!ec) {
+            endpoints.emplace_back(address, static_cast<unsigned short>(
+                std::stoul(url.port)));
+            return true;
+        }
+
+        return config_.host_overrides.Lookup(url.host, url.port, endpoints);
+    }
+
+    /*! Open the socket, and apply our socket options
+     *
+     * @param source Set to the local address we bound to, if any.
+     */
+    boost::system::error_code PrepareSocket(tcp::socket& sck,
+                                            const tcp::endpoint& ep,
+                                            boost::asio::ip::address& source) {
+        boost::system::error_code ec;
+        sck.open(ep.protocol(), ec);
+        if (ec) {
+            return ec;
+        }
+
+        if (config_.local_port_min) {
+            // Linux 6.3 and later. The high port goes in the upper half.
+            const auto range = (static_cast<std::uint32_t>(
+                config_.local_port_max) << 16) | config_.local_port_min;
+            sck.set_option(local_port_range_option(
+                static_cast<int>(range)), ec);
+            if (ec) {
+                std::call_once(port_range_warning_, [&ec]() {
+                    ASYNCLOG("Failed to set IP_LOCAL_PORT_RANGE: {}",
+                             ec.message());
+                });
+            }
+        }
+
+        if (sources_ && sources_->Pick(ep, source)) {
+            /* Without this, bind() would pick the port right away, and
+             * reserve it for all destinations. With it, the port is
+             * picked by connect(), so the same port can be used towards
+             * different destinations.
+             */
+            sck.set_option(bind_no_port_option(1), ec);
+            if (!ec) {
+                sck.bind(tcp::endpoint(source, 0), ec);
+            }
+            if (ec) {
+                return ec;
+            }
+        }
+
+        if (config_.socket_busy_poll_usec > 0) {
+            sck.set_option(busy_poll_option(config_.socket_busy_poll_usec), ec);
+            if (ec) {
+                // Raising it above net.core.busy_read needs CAP_NET_ADMIN
+                ASYNCLOG("Failed to set SO_BUSY_POLL: {}", ec.message());
+            }
+        }
+
+        return {};
+    }
+
+    /*! Get the IP address(es) for the host in the URL
+     *
+     * The addresses are added to endpoints.
+     */
+    boost::system::error_code Resolve_(const Url& url,
+                                       endpoints_t& endpoints,
+                                       boost::asio::yield_context yield) {
+        /* Our own tables, or an IP number in the URL, saves us the
+         * round-trip to the DNS system.
+         */
+        if (Lookup(url, endpoints)) {
+            return {};
+        }
+
+        boost::system::error_code ec;
+        if (dns_) {
+            // Our own resolver sends the queries from this thread
+            const auto port = ParsePort(url.port);
+            for(const auto& address : dns_->AsyncResolve(url.host, yield[ec])) {
+                endpoints.emplace_back(address, port);
+            }
+            return ec;
+        }
+
+        // Construct a resolver instance
+        tcp::resolver resolver(io_service_);
+
+        /* Note that we call async_resolve. What do you think it will
+         * return? A future? An iterator?
+         *
+         * The beauty here is that async_resolve will actually suspend
+         * the processing of this method here, save the stack, and return
+         * the thread to asio.
+         *
+         * When asio has finished the resolve request, it will restore
+         * the stack, and resume the processing exactly where we left off
+         * (at least, that is how it appears to our code), so that
+         * what is returned is the iterator.
+         *
+         * From a coding perspective, this is exactly what we did in
+         * "traditional.cpp". However, in this case the thread was
+         * free for other jobs while asio waited for the DNS system.
+         *
+         * Another huge benefit is that in the debugger, and in a core-dump,
+         * we will see the full stack-trace of Fetch_, not just a
+         * callback that implements a fragment of the functionality.
+         */
+        auto address_it = resolver.async_resolve({url.host, url.port},
+                                                 yield[ec]);
+
+        /* Use decltype to copy the type from address_it in stead of
+         * typing it. That way we really don't need to know or care about
+         * the actual type returned by async_resolve()
+         */
+        decltype(address_it) addr_end;
+        for(; address_it != addr_end; ++address_it) {
+            endpoints.push_back(*address_it);
+        }
+
+        return ec;
+    }
+
+    /*! Connect to the first endpoint that accepts our connection
+     *
+     * @returns The error from the last attempt if none of them did, or
+     *   FetchError::connect_failed if there was nothing to try.
+     */
+    boost::system::error_code Connect_(tcp::socket& sck,
+                                       const endpoints_t& endpoints,
+                                       boost::asio::yield_context yield,
+                                       Timings *timings = nullptr) {
+        boost::system::error_code ec = FetchError::connect_failed;
+        boost::system::error_code ignored;
+
+        /* Again, our loop looks like a loop. Even if the thread will
+         * be able to do many other things while we wait for network IO
+         * inside the loop.
+         */
+        for(const auto& endpoint : endpoints) {
+            /* If the kernel is out of ports from one local address,
+             * we try the others before we give up on the endpoint.
+             */
+            const std::size_t attempts = sources_
+                ? std::max<std::size_t>(sources_->Count(endpoint), 1) : 1;
+            for(std::size_t attempt = 0; attempt < attempts; ++attempt) {
+                if (sck.is_open()) {
+                    sck.close(ignored);
+                }
+                boost::asio::ip::address source;
+                const auto begin = timings
+                    ? timings->Elapsed() : Timings::duration_t{};
+                ec = PrepareSocket(sck, endpoint, source);
+                if (!ec) {
+                    /* Again, we do an async operation where the stack will
+                     * be saved, the thread released to other tasks, before
+                     * the stack is restored and the processing resumes
+                     * where it left off.
+                     */
+                    sck.async_connect(endpoint, yield[ec]);
+                }
+                if (timings) {
+                    timings->AddAttempt(endpoint, begin, ec);
+                }
+                if (!ec) {
+                    return {};
+                }
+
+                if ((ec != boost::system::errc::address_not_available)
+                    || source.is_unspecified()) {
+                    break;
+                }
+                sources_->Unavailable(endpoint, source);
+            }
+
+            ASYNCLOG("Failed to connect to {}", endpoint);
+
+            // Try another IP
+        }
+
+        return ec;
+    }
+
+    /*! One request and response in a fetch that may be redirected */
+    struct Hop {
+        /*! Ask the server to keep the connection open */
+        bool keep_alive = false;
+
+        /*! The response is a redirect to next, that we will follow */
+        bool redirected = false;
+        Url next;
+
+        /*! The connection can take another request */
+        bool reusable = false;
+    };
+
+    /*! The implementation of the async resolve and fetch.
+     *
+     * This is run from one of the threads we started in the constructor.
+     *
+     * The fetch goes through three stages: resolve, connect and transfer.
+     * Each stage has it's own limit for how many requests it handles at
+     * the same time, and the requests wait in line between the stages.
+     *
+     * With Config::max_redirects, we follow redirects. When the new
+     * location is on the same host and port, the next request goes on
+     * the same connection. Permanent redirects are remembered, so the
+     * next fetch of the same URL goes straight to where it moved.
+     *
+     * Failures are returned as error codes. Nothing on this path throws,
+     * so a batch with lots of dead hosts don't pay for stack unwinding.
+     *
+     * @param result Receives the reply from the server
+     * @param arena Memory for the objects that we don't need after the
+     *   request is done. The response is not allocated from it, as it
+     *   is handed over to the caller.
+     */
+    boost::system::error_code Fetch_(const Url& url, const Body *body,
+                                     FileSink *sink, Result& result,
+                                     pmr::memory_resource *arena,
+                                     boost::asio::yield_context yield) {
+        boost::system::error_code ec, ignored;
+        result.timings.Start();
+
+        // Construct a TCP socket instance
+        tcp::socket sck(io_service_);
+        bool reused = false;
+
+        Url target = url;
+        for(;;) {
+            // URLs that have moved for good go straight to the new place
+            while(redirects_ && (result.redirects < config_.max_redirects)
+                  && redirects_->Lookup(target, target)) {
+                ++result.redirects;
+            }
+
+            if (!sck.is_open()) {
+                ec = Open_(target, sck, result.timings, arena, yield);
+                if (ec) {
+                    return ec;
+                }
+            }
+
+            /* We only keep connections open for redirects. Downloads
+             * read until the server closes, so they don't.
+             */
+            Hop hop;
+            hop.keep_alive = config_.max_redirects && !sink;
+            ec = Exchange_(sck, target, body, sink, result, hop, arena, yield);
+
+            if (reused && result.response.GetData().empty()) {
+                // The server closed the connection before it got our request
+                sck.close(ignored);
+                reused = false;
+                continue;
+            }
+
+            if (ec || !hop.redirected) {
+                return ec;
+            }
+
+            if (result.redirects >= config_.max_redirects) {
+                return FetchError::too_many_redirects;
+            }
+            ++result.redirects;
+
+            const auto status = result.response.GetStatus();
+            if ((status == 301) || (status == 308)) {
+                redirects_->Put(target, hop.next);
+            }
+            if ((status == 301) || (status == 302) || (status == 303)) {
+                body = nullptr; // The next request is a GET
+            }
+
+            reused = hop.reusable && (hop.next.Origin() == target.Origin());
+            if (!reused) {
+                sck.close(ignored);
+            }
+            redirects_->Followed(reused);
+
+            target = std::move(hop.next);
+            result.response = Response();
+        }
+    }
+
+    /*! Get a connection to the host in url
+     *
+     * We use a preconnected socket if we have one. If not, we resolve
+     * the host, and connect to it.
+     */
+    boost::system::error_code Open_(const Url& url, tcp::socket& sck,
+                                    Timings& timings,
+                                    pmr::memory_resource *arena,
+                                    boost::asio::yield_context yield) {
+        if (pool_.Take(url.Origin(), sck)) {
+            // Resolved and connected in advance
+            timings.resolved = timings.connected = timings.Elapsed();
+            return {};
+        }
+
+        // Get the IP address(es) for the host
+        endpoints_t endpoints(arena);
+        boost::system::error_code ec;
+        {
+            Stage::Slot slot(resolving_, yield);
+            ec = Resolve_(url, endpoints, yield);
+        }
+        if (ec) {
+            return ec;
+        }
+        timings.resolved = timings.Elapsed();
+
+        Stage::Slot slot(connecting_, yield);
+        ec = Connect_(sck, endpoints, yield, &timings);
+        if (ec) {
+            // We failed. Tell why the last address did.
+            return ec;
+        }
+        timings.connected = timings.Elapsed();
+        return {};
+    }
+
+    /*! Send a request on a connection, and read the response
+     *
+     * @param hop Tells if we ask for keep-alive, and gets where we are
+     *   redirected to (if we follow redirects), and if the connection
+     *   can be used again. The body of a redirect we will follow is not
+     *   saved to the sink.
+     */
+    boost::system::error_code Exchange_(tcp::socket& sck, const Url& url,
+                                        const Body *body, FileSink *sink,
+                                        Result& result, Hop& hop,
+                                        pmr::memory_resource *arena,
+                                        boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        auto& response = result.response;
+        auto& timings = result.timings;
+        timings.first_byte = {};
+        bool have_headers = false;
+
+        Stage::Slot slot(transferring_, yield);
+
+        /* Here we initiate an async write.
+         *
+         * As before, the thread can be used for other things
+         * before processing resumes.
+         *
+         * If we did not supply [ec] to yield, asio would throw an
+         * exception if async_write failed. (It's pretty awesome that
+         * exception handling works as in traditional code when we
+         * effectively are in a co-routine.) Exceptions are however
+         * expensive, so here we check the error code in stead.
+         */
+        const auto request = GetRequest(url, body, hop.keep_alive, arena);
+        boost::asio::async_write(sck, boost::asio::buffer(request.data(),
+                                                          request.size()),
+                                 yield[ec]);
+        if (ec) {
+            return ec;
+        }
+
+        if (body) {
+            ec = SendBody_(sck, *body, yield);
+            if (ec) {
+                return ec;
+            }
+        }
+        timings.sent = timings.Elapsed();
+
+        std::unique_ptr<capture::Recorder> recorder;
+        if (config_.capture) {
+            recorder = std::make_unique<capture::Recorder>(
+                url.host, ParsePort(url.port), url.path);
+            recorder->Sent();
+        }
+
+        /* The response is read straight into the Response object.
+         * Downloads that are written with pwrite() use the stack - no
+         * need to put data as properties (although it may give better
+         * performance - that is something you can experiment with).
+         */
+        char stack_reply[1024] {}; // Zero-initialize the buffer
+        char *reply = stack_reply;
+        std::size_t reply_size = sizeof(stack_reply);
+
+        /* Or a larger block from the receive pool, that may be backed
+         * by huge pages. We wait for the socket to become readable
+         * before we pick a buffer, and then drain it, so that no read
+         * has a buffer handed to the kernel while we wait for a slow
+         * server, and a block is only held while there is data to read.
+         */
+        BufferPool::Block block;
+        if (!sck.non_blocking()) {
+            sck.non_blocking(true, ec);
+            if (ec) {
+                return ec;
+            }
+        }
+
+        /* The memory we buffer is accounted for in budget_ until we
+         * return. The response we leave behind is the caller's, and is
+         * not counted.
+         */
+        MemoryBudget::Account account(budget_);
+
+        // Async read data until we fail. (As in the other examples)
+        while(!ec) {
+            /* When the body goes to a mapped file, we read straight
+             * into the file's pages.
+             */
+            const bool to_map = sink && sink->IsMapped();
+            const bool to_file = sink && sink->IsOpen() && !to_map;
+            if (to_map && !sink->Remaining()) {
+                break; // We have all of it
+            }
+
+            std::size_t dst_size = reply_size;
+            if (to_map) {
+                dst_size = std::min(sink->Remaining(), max_read_size);
+            } else if (to_file) {
+                if (recv_pool_) {
+                    dst_size = recv_pool_->GetBlockSize();
+                }
+            } else {
+                // Use what the response has room for, if that's more
+                dst_size = std::max(reply_size, std::min(response.GetSpare(),
+                                                         max_read_size));
+            }
+
+            /* Wait here if we are using too much memory. What goes to
+             * a file is not buffered, unless we record it.
+             */
+            account.WaitForRoom((to_map || to_file) && !recorder
+                                ? 0 : dst_size, yield);
+
+            // Wait for data without a buffer, then drain the socket
+            sck.async_wait(tcp::socket::wait_read, yield[ec]);
+            if (ec) {
+                break;
+            }
+
+            char *dst = reply;
+            if (to_map) {
+                dst = sink->Cursor();
+            } else if (to_file) {
+                if (recv_pool_) {
+                    block = recv_pool_->Get();
+                    dst = block.data();
+                }
+            } else {
+                dst = response.Prepare(dst_size);
+            }
+            const auto rlen = ReadReady_(sck, dst, dst_size, ec);
+
+            if (rlen && (timings.first_byte == Timings::duration_t::zero())) {
+                timings.first_byte = timings.Elapsed();
+            }
+            timings.received += rlen;
+
+            if (recorder) {
+                // The recording is a second copy of what we read
+                recorder->Add(dst, rlen);
+                account.Add(rlen);
+            }
+
+            if (to_map) {
+                sink->Advance(rlen);
+            } else if (to_file) {
+                const auto wec = sink->Write(dst, rlen);
+                if (wec) {
+                    return wec;
+                }
+            } else {
+                // The read data is now part of the data we will return
+                account.Add(rlen);
+                response.Commit(rlen);
+
+                if (!have_headers && response.HasHeaders()) {
+                    have_headers = true;
+                    hop.redirected = config_.max_redirects
+                        && GetRedirect_(url, response, hop.next);
+
+                    /* Make room for all of the body up front, so that
+                     * it's not moved as it grows.
+                     */
+                    std::size_t length = 0;
+                    if (!sink && response.GetContentLength(length)) {
+                        response.ReserveBody(std::min(length,
+                                                      max_body_reserve));
+                    }
+                }
+
+                if (sink && have_headers && !hop.redirected) {
+                    const auto wec = StartDownload_(*sink, response);
+                    if (wec) {
+                        return wec;
+                    }
+                }
+            }
+
+            // Back to the pool before we wait again
+            block = {};
+
+            const auto body_size = (sink && sink->IsOpen())
+                ? sink->GetWritten() : response.GetBody().size();
+            if (config_.max_body_size && (body_size > config_.max_body_size)) {
+                if (!config_.truncate_body || sink) {
+                    return FetchError::body_too_large;
+                }
+
+                response.TruncateBody(config_.max_body_size);
+                break;
+            }
+
+            if (hop.keep_alive && response.IsComplete()) {
+                break; // The server won't close the connection
+            }
+        }
+
+        hop.reusable = hop.keep_alive && !ec && response.IsComplete()
+            && response.KeepsAlive();
+
+        if (recorder) {
+            /* The writer thread writes it. It's memory is charged to the
+             * budget until then, in stead of to this request.
+             */
+            const auto size = recorder->Size();
+            budget_.Charge(size);
+            if (!recorder->Finish(*config_.capture,
+                                  ec && (ec != boost::asio::error::eof),
+                                  [this, size]() { budget_.Refund(size); })) {
+                const boost::system::error_code wec(
+                    errno, boost::system::system_category());
+                ASYNCLOG("Failed to record {}{}: {}", url.host, url.path,
+                         wec.message());
+            }
+        }
+
+        /* The server closing the connection is how a response without a
+         * length ends. Anything else, like a reset in the middle of the
+         * body, means that we don't have all of it.
+         *
+         * The caller hands the data over to whoever asked for it.
+         * Since we don't start another async operation, this coroutine
+         * will end.
+         */
+        if (ec && (ec != boost::asio::error::eof)) {
+            return ec;
+        }
+        return {}; // Success!
+    }
+
+    /*! Open the file for a download, when we have the headers
+     *
+     * The part of the body that came with the headers is moved to the
+     * file, and the response is left with just the headers.
+     */
+    static boost::system::error_code StartDownload_(FileSink& sink,
+                                                    Response& response) {
+        std::size_t length = 0;
+        const bool known = response.GetContentLength(length);
+
+        auto ec = sink.Open(known ? &length : nullptr);
+        if (!ec) {
+            const auto body = response.GetBody();
+            ec = sink.Write(body.data(), body.size());
+        }
+        response.TruncateBody(0);
+        return ec;
+    }
+
+    /*! Find where a redirect sends us
+     *
+     * @returns false if the response is not a redirect, or it sends us
+     *   somewhere we can't go (like to https).
+     */
+    static bool GetRedirect_(const Url& url, const Response& response,
+                             Url& next) {
+        switch(response.GetStatus()) {
+        case 301: case 302: case 303: case 307: case 308:
+            break;
+        default:
+            return false;
+        }
+
+        const auto location = response.GetHeader("Location");
+        return !location.empty() && url.Redirect(location.to_string(), next);
+    }
+
+    /*! Read what the socket has ready, without waiting
+     *
+     * Stops when buf is full, or when the socket has nothing more for
+     * us right now. The socket must be in non-blocking mode.
+     *
+     * @param ec Set if the read failed, or the server closed the
+     *   connection. Not set just because there was nothing to read.
+     * @returns The number of bytes read into buf.
+     */
+    static std::size_t ReadReady_(tcp::socket& sck, char *buf,
+                                  std::size_t size,
+                                  boost::system::error_code& ec) {
+        std::size_t len = 0;
+        while(len < size) {
+            const auto bytes = sck.read_some(
+                boost::asio::mutable_buffers_1(buf + len, size - len), ec);
+            len += bytes;
+            if (ec == boost::asio::error::would_block) {
+                ec = {};
+                break;
+            }
+            if (ec) {
+                break;
+            }
+        }
+
+        return len;
+    }
+
+    /*! Send the request body, after the headers
+     *
+     * File bodies go from the page-cache to the socket with sendfile().
+     * Large buffers are sent with MSG_ZEROCOPY, so the kernel sends
+     * straight from our pages in stead of copying them. The kernel
+     * reads the pages until the data is acknowledged, which can be
+     * after send() returned, so we don't return before it has told us
+     * on the error queue that it's done with all of them. After that,
+     * the caller may drop the body.
+     */
+    boost::system::error_code SendBody_(tcp::socket& sck, const Body& body,
+                                        boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        sck.native_non_blocking(true, ec);
+        if (ec) {
+            return ec;
+        }
+
+        int flags = MSG_NOSIGNAL;
+        if (body.data && (body.length >= zerocopy_threshold)) {
+            int on = 1;
+            if (::setsockopt(sck.native_handle(), SOL_SOCKET, SO_ZEROCOPY,
+                             &on, sizeof(on)) == 0) {
+                flags |= MSG_ZEROCOPY;
+            }
+        }
+
+        std::uint32_t zerocopy_sends = 0;
+        ec = SendChunks_(sck, body, flags, zerocopy_sends, yield);
+
+        /* Also when the send failed; the sends before that may still
+         * be in flight.
+         */
+        if (zerocopy_sends) {
+            const auto wec = AwaitZeroCopy_(sck, zerocopy_sends, yield);
+            if (!ec) {
+                ec = wec;
+            }
+        }
+
+        return ec;
+    }
+
+    /*! Send the body, in chunks if it's chunked
+     *
+     * @param zerocopy_sends Incremented for each send() with MSG_ZEROCOPY
+     */
+    boost::system::error_code SendChunks_(tcp::socket& sck, const Body& body,
+                                          int& flags,
+                                          std::uint32_t& zerocopy_sends,
+                                          boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        for(std::size_t sent = 0; sent < body.length;) {
+            const auto len = body.chunked
+                ? std::min(body.length - sent, upload_chunk_size)
+                : body.length - sent;
+
+            if (body.chunked) {
+                char size_line[24];
+                const auto size_len = std::snprintf(size_line,
+                                                    sizeof(size_line),
+                                                    "%zx\r\n", len);
+                boost::asio::async_write(sck, boost::asio::buffer(
+                    size_line, size_len), yield[ec]);
+                if (ec) {
+                    return ec;
+                }
+            }
+
+            ec = SendRange_(sck, body, sent, len, flags, zerocopy_sends,
+                            yield);
+            if (ec) {
+                return ec;
+            }
+            sent += len;
+
+            if (body.chunked) {
+                boost::asio::async_write(sck, boost::asio::buffer("\r\n", 2),
+                                         yield[ec]);
+                if (ec) {
+                    return ec;
+                }
+            }
+        }
+
+        if (body.chunked) {
+            boost::asio::async_write(sck, boost::asio::buffer(
+                "0\r\n\r\n", 5), yield[ec]);
+        }
+
+        return ec;
+    }
+
+    /*! Send len bytes of the body, starting at offset
+     *
+     * @param flags For send(). MSG_ZEROCOPY is removed if the kernel
+     *   runs out of memory for the notifications.
+     * @param zerocopy_sends Incremented for each send() with MSG_ZEROCOPY
+     */
+    boost::system::error_code SendRange_(tcp::socket& sck, const Body& body,
+                                         std::size_t offset, std::size_t len,
+                                         int& flags,
+                                         std::uint32_t& zerocopy_sends,
+                                         boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        const auto fd = sck.native_handle();
+
+        for(std::size_t done = 0; done < len;) {
+            ssize_t bytes = 0;
+            if (body.file) {
+                off_t pos = body.offset + static_cast<off_t>(offset + done);
+                bytes = ::sendfile(fd, body.file->fd, &pos, len - done);
+                if (bytes == 0) {
+                    return FetchError::upload_truncated;
+                }
+            } else {
+                bytes = ::send(fd, body.data->data() + offset + done,
+                               len - done, flags);
+            }
+
+            if (bytes > 0) {
+                if (flags & MSG_ZEROCOPY) {
+                    ++zerocopy_sends;
+                }
+                done += static_cast<std::size_t>(bytes);
+                continue;
+            }
+
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                // The socket buffer is full. Wait for room.
+                sck.async_wait(tcp::socket::wait_write, yield[ec]);
+                if (ec) {
+                    return ec;
+                }
+                continue;
+            }
+
+            if ((errno == ENOBUFS) && (flags & MSG_ZEROCOPY)) {
+                /* Out of memory for the notifications. Copy in stead.
+                 * The ones we have are read by AwaitZeroCopy_().
+                 */
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return {errno, boost::system::system_category()};
+        }
+
+        return {};
+    }
+
+    /*! Wait until the kernel is done with the pages of our zerocopy sends
+     *
+     * The kernel numbers the sends on a socket, and each notification
+     * tells that a range of them is done. The previous body on the
+     * socket was waited for, so we just count the sends in the ranges.
+     *
+     * The error queue is polled with a timer. The socket only signals
+     * the error queue as an edge, and one that comes between a read
+     * and a wait would be lost. The first looks are soon; on loopback
+     * the data is acknowledged in microseconds.
+     */
+    boost::system::error_code AwaitZeroCopy_(tcp::socket& sck,
+                                             std::uint32_t sends,
+                                             boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        boost::asio::steady_timer timer(io_service_);
+        auto delay = std::chrono::microseconds(50);
+        std::uint32_t done = 0;
+
+        for(;;) {
+            if (!DrainZeroCopyCompletions(sck, done)) {
+                return {errno, boost::system::system_category()};
+            }
+            if (done >= sends) {
+                return {};
+            }
+
+            timer.expires_from_now(delay);
+            timer.async_wait(yield[ec]);
+            if (ec) {
+                return ec;
+            }
+            delay = std::min<std::chrono::microseconds>(
+                delay * 2, std::chrono::milliseconds(5));
+        }
+    }
+
+    /*! Read the MSG_ZEROCOPY notifications that are ready
+     *
+     * @param done Incremented with the number of sends they complete
+     * @returns false if the error queue could not be read
+     */
+    static bool DrainZeroCopyCompletions(tcp::socket& sck,
+                                         std::uint32_t& done) {
+        char control[128];
+        for(;;) {
+            msghdr msg = {};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (::recvmsg(sck.native_handle(), &msg, MSG_ERRQUEUE) < 0) {
+                return (errno == EAGAIN) || (errno == EWOULDBLOCK)
+                    || (errno == EINTR);
+            }
+
+            for(auto *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                const auto *err = reinterpret_cast<const sock_extended_err *>(
+                    CMSG_DATA(cm));
+                if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                    // ee_info is the first send in the range, ee_data the last
+                    done += err->ee_data - err->ee_info + 1;
+                }
+            }
+        }
+    }
+
+    /*! Start a fetch
+     *
+     * @param body Upload this, if set.
+     * @param download_path Save the response body to this file, if set.
+     */
+    void TrySend_(const std::string& url, std::shared_ptr<const Body> body,
+                  std::string download_path,
+                  std::function<void(Result& result)> handler) {
+        Url target;
+        if (!Url::TryParse(url, target)) {
+            io_service_.post([handler]() {
+                Result rval;
+                rval.ec = FetchError::invalid_url;
+                handler(rval);
+            });
+            return;
+        }
+
+        boost::asio::spawn(io_service_, [this, target, body, download_path,
+                                         handler](
+            boost::asio::yield_context yield) {
+                Result rval;
+                try {
+                    if (download_path.empty()) {
+                        rval.ec = FetchWithArena_(target, body.get(), nullptr,
+                                                  rval, yield);
+                    } else {
+                        FileSink sink(download_path);
+                        rval.ec = FetchWithArena_(target, body.get(), &sink,
+                                                  rval, yield);
+                        rval.downloaded = sink.GetWritten();
+                    }
+                    rval.timings.total = rval.timings.Elapsed();
+                } catch(const std::bad_alloc&) {
+                    rval.ec = boost::asio::error::no_memory;
+                }
+                handler(rval);
+            });
+    }
+
+    /*! Run Fetch_() with an arena for the request
+     *
+     * The arena starts out with a buffer on the coroutine's stack, and
+     * gets more memory from the heap if it needs to. Nothing is freed
+     * until we return, and then it's all released at once.
+     */
+    boost::system::error_code FetchWithArena_(const Url& url,
+                                              const Body *body,
+                                              FileSink *sink,
+                                              Result& result,
+                                              boost::asio::yield_context yield) {
+        if (!config_.request_arena) {
+            return Fetch_(url, body, sink, result,
+                          pmr::new_delete_resource(), yield);
+        }
+
+        std::array<char, arena_stack_size> buffer;
+        pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size());
+        return Fetch_(url, body, sink, result, &arena, yield);
+    }
+
+    // Construct a simple HTTP request to the host
+    pmr::string GetRequest(const Url& url, const Body *body, bool keep_alive,
+                           pmr::memory_resource *arena) const {
+        pmr::string req(arena);
+        req += body ? body->method.c_str() : "GET";
+        req += ' ';
+        req.append(url.path.data(), url.path.size());
+        req += " HTTP/1.1\r\nHost: ";
+        url.AppendHostHeader(req);
+        req += " \r\n";
+
+        if (body) {
+            req += "Content-Type: ";
+            req.append(body->content_type.data(), body->content_type.size());
+            if (body->chunked) {
+                req += "\r\nTransfer-Encoding: chunked\r\n";
+            } else {
+                req += "\r\nContent-Length: ";
+                req += std::to_string(body->length).c_str();
+                req += "\r\n";
+            }
+        }
+
+        req += keep_alive ? "Connection: keep-alive\r\n\r\n"
+            : "Connection: close\r\n\r\n";
+
+        return req;
+    }
+};
+
+constexpr std::size_t Request::zerocopy_threshold;
+constexpr std::size_t Request::upload_chunk_size;
+constexpr std::size_t Request::max_read_size;
+constexpr std::size_t Request::max_body_reserve;
+
+/*! Open connections to the hosts in urls before we fetch them
+ *
+ * We open one connection per URL to the host, up to count.
+ */
+inline void PreconnectAll(Request& req, const std::vector<std::string>& urls,
+                   std::size_t count) {
+    std::map<std::string, std::pair<std::string, std::size_t>> origins;
+    for(const auto& url : urls) {
+        Url target;
+        if (Url::TryParse(url, target)) {
+            auto& origin = origins[target.Origin()];
+            origin.first = url;
+            ++origin.second;
+        }
+    }
+
+    std::vector<std::future<std::size_t>> warmups;
+    for(const auto& origin : origins) {
+        warmups.push_back(req.Preconnect(origin.second.first,
+            std::min(count, origin.second.second)));
+    }
+
+    // Connections that fail here are retried by the fetches
+    for(auto& warmup : warmups) {
+        try {
+            warmup.get();
+        } catch(const std::exception&) {
+            ;
+        }
+    }
+}
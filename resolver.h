@@ -0,0 +1,581 @@
+/*
+ * A small asynchronous DNS resolver, in stead of the blocking one in
+ * the C library, so that name lookups can run on the io_service with
+ * everything else. See "dns.h" for the wire format.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "dns.h"
+#include "asynclog.h"
+
+/*! A native, asynchronous DNS client
+ *
+ * asio's async_resolve() calls the blocking getaddrinfo() from a hidden
+ * thread, one lookup at a time. With thousands of host-names to resolve,
+ * that thread becomes the bottleneck. This resolver talks directly to the
+ * DNS servers over UDP from the event-loop, so that all the lookups can
+ * be in flight at the same time.
+ *
+ * Queries are queued, and sent in batches with sendmmsg(). Replies are
+ * read in batches with recvmmsg(), and matched to the queries by their
+ * ID, name and type. Queries that time out are retried on the next server,
+ * and truncated replies are repeated over TCP.
+ *
+ * Each host-name gets an AAAA and an A query. Names are looked up as
+ * they are; the search domains in /etc/resolv.conf are not applied.
+ *
+ * All the internal state is only touched from strand_.
+ */
+class DnsResolver
+{
+    using tcp = boost::asio::ip::tcp;
+    using udp = boost::asio::ip::udp;
+
+public:
+    using addresses_t = std::vector<boost::asio::ip::address>;
+    using handler_t = std::function<void(const boost::system::error_code&,
+                                         addresses_t)>;
+
+    struct Options {
+        /*! The DNS servers to use. Empty means the ones in /etc/resolv.conf */
+        std::vector<udp::endpoint> servers;
+
+        /*! How long we wait for a reply before we try again */
+        std::chrono::milliseconds timeout{1000};
+
+        /*! How many times we try again after a time-out */
+        int retries = 2;
+
+        /*! Max number of queries in flight. The rest are queued. */
+        std::size_t max_in_flight = 2000;
+    };
+
+private:
+    // How many messages we send or receive in one system-call
+    static constexpr std::size_t batch_size = 64;
+
+    struct Lookup {
+        std::string host;
+        int pending = 0;
+        addresses_t v6, v4;
+        boost::system::error_code ec;
+        handler_t handler;
+    };
+
+    struct Query {
+        std::shared_ptr<Lookup> lookup;
+        std::uint16_t type = 0;
+        std::uint16_t id = 0;
+        int attempt = 0;
+        std::string packet;
+        udp::endpoint server;
+    };
+
+    using query_ptr_t = std::shared_ptr<Query>;
+
+    // A query waiting to be sent, or to time out
+    struct Pending {
+        query_ptr_t query;
+        int attempt = 0;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    boost::asio::io_service& io_service_;
+    boost::asio::io_service::strand strand_;
+    Options options_;
+    udp::socket socket_;
+    boost::asio::steady_timer timer_;
+    std::deque<query_ptr_t> waiting_;
+    std::deque<Pending> send_queue_;
+    std::deque<Pending> deadlines_;
+    std::map<std::uint16_t, query_ptr_t> in_flight_;
+    std::mt19937 random_{std::random_device{}()};
+    bool sending_ = false;
+    bool receiving_ = false;
+    bool timer_running_ = false;
+
+    // Buffers for recvmmsg()
+    std::vector<std::array<std::uint8_t, dns::max_udp_size>> recv_buffers_;
+    std::vector<sockaddr_storage> recv_addresses_;
+
+public:
+    DnsResolver(boost::asio::io_service& io_service, const Options& options)
+        : io_service_(io_service), strand_(io_service), options_(options)
+        , socket_(io_service), timer_(io_service)
+        , recv_buffers_(batch_size), recv_addresses_(batch_size)
+    {
+        if (options_.servers.empty()) {
+            options_.servers = GetSystemServers();
+        }
+        if (options_.servers.empty()) {
+            throw std::runtime_error("No DNS servers");
+        }
+
+        // We use one socket, so all the servers must be of the same family
+        const auto protocol = options_.servers.front().protocol();
+        options_.servers.erase(std::remove_if(
+            options_.servers.begin(), options_.servers.end(),
+            [&](const udp::endpoint& ep) {
+                if (ep.protocol() == protocol) {
+                    return false;
+                }
+                std::cerr << "Ignoring DNS server " << ep
+                    << ": Mixed IPv4 and IPv6 servers" << std::endl;
+                return true;
+            }), options_.servers.end());
+
+        socket_.open(protocol);
+        socket_.non_blocking(true);
+
+        /* Make room for a burst of replies. The kernel caps this to
+         * net.core.rmem_max
+         */
+        boost::system::error_code ec;
+        socket_.set_option(udp::socket::receive_buffer_size(4 * 1024 * 1024),
+                           ec);
+        socket_.bind(udp::endpoint(protocol, 0));
+    }
+
+    /*! Resolve a host-name to IPv6 and IPv4 addresses.
+     *
+     * The completion signature is
+     *   void(boost::system::error_code, std::vector<address>)
+     * and the IPv6 addresses come first in the list.
+     */
+    template <typename CompletionToken>
+    auto AsyncResolve(const std::string& host, CompletionToken&& token) {
+        return boost::asio::async_initiate<CompletionToken,
+            void(boost::system::error_code, addresses_t)>(
+                [this](auto&& handler, const std::string& host) {
+                    auto lookup = std::make_shared<Lookup>();
+                    lookup->host = host;
+
+                    // Hand the result to the handler via it's own executor
+                    using handler_type = std::decay_t<decltype(handler)>;
+                    auto h = std::make_shared<handler_type>(std::move(handler));
+                    auto executor = boost::asio::get_associated_executor(
+                        *h, io_service_.get_executor());
+                    lookup->handler = [h, executor](
+                        const boost::system::error_code& ec,
+                        addresses_t addresses) {
+                        boost::asio::post(executor, [h, ec, addresses]() {
+                            (*h)(ec, std::move(addresses));
+                        });
+                    };
+
+                    strand_.post([this, lookup]() { Start(lookup); });
+                }, token, host);
+    }
+
+private:
+    static std::vector<udp::endpoint> GetSystemServers() {
+        std::vector<udp::endpoint> servers;
+        std::ifstream in("/etc/resolv.conf");
+        std::string line;
+        while(std::getline(in, line)) {
+            std::istringstream words(line);
+            std::string keyword, address;
+            if ((words >> keyword >> address) && (keyword == "nameserver")) {
+                boost::system::error_code ec;
+                const auto addr = boost::asio::ip::address::from_string(
+                    address.substr(0, address.find('%')), ec);
+                if (!ec) {
+                    servers.emplace_back(addr, 53);
+                }
+            }
+        }
+        return servers;
+    }
+
+    void Start(const std::shared_ptr<Lookup>& lookup) {
+        lookup->pending = 2;
+        for(const auto type : {dns::TYPE_AAAA, dns::TYPE_A}) {
+            auto query = std::make_shared<Query>();
+            query->lookup = lookup;
+            query->type = type;
+
+            if ((waiting_.empty())
+                && (in_flight_.size() < options_.max_in_flight)) {
+                Send(query);
+            } else {
+                waiting_.push_back(query);
+            }
+        }
+    }
+
+    /*! Give the query an ID and queue it for sending.
+     *
+     * The actual sending is done from a posted handler, so that all the
+     * queries that are queued from the handlers that are ready to run,
+     * are sent in one batch.
+     */
+    void Send(const query_ptr_t& query) {
+        if (in_flight_.size() >= 0xffff) {
+            waiting_.push_front(query);
+            return;
+        }
+
+        do {
+            query->id = static_cast<std::uint16_t>(random_());
+        } while(in_flight_.count(query->id));
+
+        if (!dns::MakeQuery(query->packet, query->id, query->lookup->host,
+                            query->type)) {
+            Done(query, boost::asio::error::host_not_found, {});
+            return;
+        }
+
+        query->server = options_.servers[query->attempt
+            % options_.servers.size()];
+        in_flight_[query->id] = query;
+
+        const Pending pending{query, query->attempt,
+            std::chrono::steady_clock::now() + options_.timeout};
+        send_queue_.push_back(pending);
+        deadlines_.push_back(pending);
+
+        if (!sending_) {
+            sending_ = true;
+            strand_.post([this]() { Flush(); });
+        }
+        StartReceive();
+        StartTimer();
+    }
+
+    bool IsCurrent(const Pending& pending) const {
+        const auto it = in_flight_.find(pending.query->id);
+        return (it != in_flight_.end()) && (it->second == pending.query)
+            && (pending.query->attempt == pending.attempt);
+    }
+
+    void Flush() {
+        std::array<mmsghdr, batch_size> msgs;
+        std::array<iovec, batch_size> iovs;
+
+        while(!send_queue_.empty()) {
+            std::size_t count = 0;
+            for(auto it = send_queue_.begin();
+                (it != send_queue_.end()) && (count < batch_size); ++it) {
+                if (!IsCurrent(*it)) {
+                    continue;
+                }
+
+                auto& q = *it->query;
+                iovs[count] = {&q.packet[0], q.packet.size()};
+                msgs[count] = {};
+                msgs[count].msg_hdr.msg_name = q.server.data();
+                msgs[count].msg_hdr.msg_namelen = q.server.size();
+                msgs[count].msg_hdr.msg_iov = &iovs[count];
+                msgs[count].msg_hdr.msg_iovlen = 1;
+                ++count;
+            }
+
+            int sent = 0;
+            if (count) {
+                sent = ::sendmmsg(socket_.native_handle(), msgs.data(),
+                                  static_cast<unsigned>(count), MSG_DONTWAIT);
+                if (sent < 0) {
+                    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                        socket_.async_wait(udp::socket::wait_write,
+                            strand_.wrap([this](
+                                const boost::system::error_code&) {
+                                    Flush();
+                                }));
+                        return;
+                    }
+
+                    /* Skip the first one. If the problem persists, the
+                     * queries will time out.
+                     */
+                    const boost::system::error_code ec(
+                        errno, boost::system::system_category());
+                    ASYNCLOG("DNS: sendmmsg() failed: {}", ec.message());
+                    sent = 1;
+                }
+            }
+
+            // Remove what we sent, and the stale entries in between
+            for(int removed = 0; !send_queue_.empty()
+                && ((removed < sent) || !IsCurrent(send_queue_.front()));) {
+                if (IsCurrent(send_queue_.front())) {
+                    ++removed;
+                }
+                send_queue_.pop_front();
+            }
+        }
+
+        sending_ = false;
+    }
+
+    void StartReceive() {
+        if (receiving_) {
+            return;
+        }
+
+        receiving_ = true;
+        socket_.async_wait(udp::socket::wait_read, strand_.wrap(
+            [this](const boost::system::error_code& ec) {
+                receiving_ = false;
+                if (!ec) {
+                    OnReadable();
+                }
+                if (!in_flight_.empty()) {
+                    StartReceive();
+                }
+            }));
+    }
+
+    void OnReadable() {
+        std::array<mmsghdr, batch_size> msgs;
+        std::array<iovec, batch_size> iovs;
+
+        for(;;) {
+            for(std::size_t i = 0; i < batch_size; ++i) {
+                iovs[i] = {recv_buffers_[i].data(), recv_buffers_[i].size()};
+                msgs[i] = {};
+                msgs[i].msg_hdr.msg_name = &recv_addresses_[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(recv_addresses_[i]);
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            const int received = ::recvmmsg(socket_.native_handle(),
+                                            msgs.data(), batch_size,
+                                            MSG_DONTWAIT, nullptr);
+            if (received <= 0) {
+                break;
+            }
+
+            for(int i = 0; i < received; ++i) {
+                udp::endpoint from;
+                std::memcpy(from.data(), &recv_addresses_[i],
+                            std::min<std::size_t>(msgs[i].msg_hdr.msg_namelen,
+                                                  from.capacity()));
+                OnReply(recv_buffers_[i].data(), msgs[i].msg_len, from);
+            }
+
+            if (received < static_cast<int>(batch_size)) {
+                break;
+            }
+        }
+
+        SendWaiting();
+    }
+
+    void OnReply(const std::uint8_t *data, std::size_t len,
+                 const udp::endpoint& from) {
+        dns::Message msg;
+        if (!dns::Parse(data, len, msg) || !msg.IsResponse()) {
+            return;
+        }
+
+        const auto it = in_flight_.find(msg.id);
+        if (it == in_flight_.end()) {
+            return; // Late reply to a query we gave up on
+        }
+
+        // Don't trust replies that don't match what we asked
+        auto query = it->second;
+        if ((from != query->server) || (msg.qtype != query->type)
+            || !dns::detail::SameName(msg.qname, query->lookup->host)) {
+            return;
+        }
+
+        in_flight_.erase(it);
+
+        if (msg.IsTruncated()) {
+            boost::asio::spawn(strand_, [this, query](auto yield) {
+                QueryTcp(query, yield);
+            });
+            return;
+        }
+
+        OnAnswer(query, msg);
+    }
+
+    void OnAnswer(const query_ptr_t& query, const dns::Message& msg) {
+        switch(msg.Rcode()) {
+        case dns::RCODE_OK:
+            Done(query, {}, msg.addresses);
+            break;
+        case dns::RCODE_NXDOMAIN:
+            Done(query, boost::asio::error::host_not_found, {});
+            break;
+        default:
+            Done(query, boost::asio::error::host_not_found_try_again, {});
+        }
+    }
+
+    /*! Repeat a truncated query over TCP */
+    template <typename YieldContext>
+    void QueryTcp(query_ptr_t query, YieldContext yield) {
+        // The time-out handler may run after we return, so it shares these
+        auto sck = std::make_shared<tcp::socket>(io_service_);
+        auto timed_out = std::make_shared<bool>(false);
+        boost::asio::steady_timer timeout(io_service_);
+        boost::system::error_code ec;
+
+        timeout.expires_from_now(options_.timeout);
+        timeout.async_wait(strand_.wrap(
+            [sck, timed_out](const boost::system::error_code& ec) {
+                if (!ec) {
+                    *timed_out = true;
+                    sck->close();
+                }
+            }));
+
+        const tcp::endpoint server(query->server.address(),
+                                   query->server.port());
+        sck->async_connect(server, yield[ec]);
+
+        std::uint8_t len_bytes[2] = {
+            static_cast<std::uint8_t>(query->packet.size() >> 8),
+            static_cast<std::uint8_t>(query->packet.size() & 0xff)
+        };
+        std::array<boost::asio::const_buffer, 2> request = {{
+            boost::asio::buffer(len_bytes),
+            boost::asio::buffer(query->packet)
+        }};
+        if (!ec) {
+            boost::asio::async_write(*sck, request, yield[ec]);
+        }
+        if (!ec) {
+            boost::asio::async_read(*sck, boost::asio::buffer(len_bytes),
+                                    yield[ec]);
+        }
+
+        std::vector<std::uint8_t> reply((len_bytes[0] << 8) | len_bytes[1]);
+        if (!ec) {
+            boost::asio::async_read(*sck, boost::asio::buffer(reply),
+                                    yield[ec]);
+        }
+        timeout.cancel();
+
+        // Closing the socket makes the pending operation fail with EBADF
+        if (*timed_out) {
+            ec = boost::asio::error::timed_out;
+        }
+
+        dns::Message msg;
+        if (ec || !dns::Parse(reply.data(), reply.size(), msg)
+            || (msg.id != query->id)) {
+            Done(query, ec ? ec : boost::asio::error::host_not_found_try_again,
+                 {});
+            return;
+        }
+
+        OnAnswer(query, msg);
+    }
+
+    void StartTimer() {
+        if (timer_running_ || deadlines_.empty()) {
+            return;
+        }
+
+        timer_running_ = true;
+        timer_.expires_at(deadlines_.front().deadline);
+        timer_.async_wait(strand_.wrap(
+            [this](const boost::system::error_code&) {
+                timer_running_ = false;
+                OnTimer();
+            }));
+    }
+
+    void OnTimer() {
+        const auto now = std::chrono::steady_clock::now();
+
+        // The deadlines are in the order we queued the queries
+        while(!deadlines_.empty() && (deadlines_.front().deadline <= now)) {
+            const auto pending = deadlines_.front();
+            deadlines_.pop_front();
+            if (!IsCurrent(pending)) {
+                continue; // Already answered
+            }
+
+            auto& query = pending.query;
+            in_flight_.erase(query->id);
+            if (++query->attempt > options_.retries) {
+                Done(query, boost::asio::error::timed_out, {});
+                continue;
+            }
+
+            Send(query);
+        }
+
+        SendWaiting();
+
+        if (in_flight_.empty()) {
+            // Don't keep the event-loop alive for stale deadlines
+            deadlines_.clear();
+            socket_.cancel();
+            return;
+        }
+
+        StartTimer();
+    }
+
+    void SendWaiting() {
+        while(!waiting_.empty()
+            && (in_flight_.size() < options_.max_in_flight)) {
+            auto query = waiting_.front();
+            waiting_.pop_front();
+            Send(query);
+        }
+    }
+
+    void Done(const query_ptr_t& query, const boost::system::error_code& ec,
+              const addresses_t& addresses) {
+        auto& lookup = *query->lookup;
+        auto& list = (query->type == dns::TYPE_AAAA) ? lookup.v6 : lookup.v4;
+        list.insert(list.end(), addresses.begin(), addresses.end());
+
+        // NXDOMAIN is more informative than a time-out for the other type
+        if (ec && (!lookup.ec || (ec == boost::asio::error::host_not_found))) {
+            lookup.ec = ec;
+        }
+
+        if (--lookup.pending) {
+            return;
+        }
+
+        addresses_t result = std::move(lookup.v6);
+        result.insert(result.end(), lookup.v4.begin(), lookup.v4.end());
+        if (!result.empty()) {
+            lookup.handler({}, std::move(result));
+        } else {
+            lookup.handler(lookup.ec ? lookup.ec
+                : boost::asio::error::host_not_found, {});
+        }
+        lookup.handler = nullptr;
+    }
+};
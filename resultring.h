@@ -0,0 +1,460 @@
+
+/*
+ * Hands messages to a consumer process through a ring buffer in shared
+ * memory, so that large results (like the pages from "modern
+ * --output-ring") reach a co-located program without being copied
+ * through a pipe.
+ *
+ * The ring lives in a memfd. Both sides map its data area twice, back
+ * to back, so a message that wraps around the end of the ring is still
+ * contiguous in memory. The reader gets a pointer to each message in
+ * the ring, and uses it in place; the only copy is the writer's, from
+ * its buffers into the ring.
+ *
+ * The writer creates the ring, and starts the consumer with the file
+ * descriptors for the memfd and two eventfds in its environment
+ * (RESULTRING_FDS). The eventfds wake up a reader that waits for data,
+ * and a writer that waits for room. They are only written when the
+ * other side has said that it's waiting, so a busy ring costs no system
+ * calls. Several threads can write; they take turns. There is one
+ * reader.
+ *
+ * A consumer is as simple as:
+ *
+ *    resultring::Reader ring;
+ *    const char *data = nullptr;
+ *    std::size_t size = 0;
+ *    while(ring.Next(data, size)) {
+ *        // Use the message in place
+ *    }
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+namespace resultring {
+
+/*! "memfd,data-eventfd,room-eventfd" for the consumer */
+static const char *env_name = "RESULTRING_FDS";
+
+static const char magic[8] = {'R', 'E', 'S', 'R', 'I', 'N', 'G', '1'};
+
+/*! At the start of the memfd, in front of the data */
+struct Control {
+    char magic[8];
+    std::uint64_t capacity;
+    std::int32_t writer_pid;
+
+    // Written by the writer
+    alignas(64) std::atomic<std::uint64_t> head; // Bytes written
+    std::atomic<std::uint32_t> closed;
+    std::atomic<std::uint32_t> reader_waiting;
+
+    // Written by the reader
+    alignas(64) std::atomic<std::uint64_t> tail; // Bytes released
+    std::atomic<std::uint32_t> writer_waiting;
+};
+
+static constexpr std::size_t control_size = 4096;
+static_assert(sizeof(Control) <= control_size, "The control block is too big");
+
+// In front of each message
+using length_t = std::uint64_t;
+static constexpr std::size_t align = sizeof(length_t);
+
+inline std::size_t Align(std::size_t len) {
+    return (len + align - 1) & ~(align - 1);
+}
+
+/*! A file descriptor that is ready when the process exits, or -1 */
+inline int OpenPidFd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return static_cast<int>(::syscall(SYS_pidfd_open, pid, 0));
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+/*! Wait until fd is readable, or the process behind pidfd is gone
+ *
+ * @returns false if the process is gone
+ */
+inline bool WaitFor(int fd, int pidfd) {
+    pollfd fds[2] = {{fd, POLLIN, 0}, {pidfd, POLLIN, 0}};
+    for(;;) {
+        if (::poll(fds, pidfd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if ((pidfd >= 0) && fds[1].revents) {
+            return false;
+        }
+        if (fds[0].revents) {
+            eventfd_t value = 0;
+            ::eventfd_read(fd, &value);
+            return true;
+        }
+    }
+}
+
+/*! The memfd, mapped with the data area twice in a row */
+class Mapping
+{
+    Control *control_ = nullptr;
+    char *data_ = nullptr;
+    std::size_t capacity_ = 0;
+
+public:
+    Mapping() = default;
+    Mapping(const Mapping&) = delete;
+    Mapping& operator = (const Mapping&) = delete;
+
+    ~Mapping() {
+        if (data_) {
+            ::munmap(data_, capacity_ * 2);
+        }
+        if (control_) {
+            ::munmap(control_, control_size);
+        }
+    }
+
+    /*! Map the ring in fd
+     *
+     * @param capacity The size of the data area, or 0 to get it from
+     *   the control block.
+     */
+    void Map(int fd, std::size_t capacity) {
+        void *mem = ::mmap(nullptr, control_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            Fail("mmap");
+        }
+        control_ = static_cast<Control *>(mem);
+
+        if (!capacity) {
+            if (std::memcmp(control_->magic, magic, sizeof(magic)) != 0) {
+                throw std::runtime_error("Not a result ring");
+            }
+            capacity = control_->capacity;
+        }
+        capacity_ = capacity;
+
+        // Reserve the address space, and put the data there twice
+        mem = ::mmap(nullptr, capacity_ * 2, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            Fail("mmap");
+        }
+        data_ = static_cast<char *>(mem);
+
+        for(int i = 0; i < 2; ++i) {
+            if (::mmap(data_ + capacity_ * i, capacity_,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+                       control_size) == MAP_FAILED) {
+                Fail("mmap");
+            }
+        }
+    }
+
+    Control& GetControl() { return *control_; }
+    std::size_t GetCapacity() const { return capacity_; }
+
+    /*! Where the byte at position pos in the stream is.
+     *
+     * The next capacity bytes after it are contiguous.
+     */
+    char *At(std::uint64_t pos) { return data_ + pos % capacity_; }
+
+    [[noreturn]] static void Fail(const char *what) {
+        throw std::runtime_error(std::string(what) + ": " + strerror(errno));
+    }
+};
+
+/*! The producer's end of the ring */
+class Writer
+{
+    int fd_ = -1;
+    int data_fd_ = -1; // Wakes up the reader
+    int room_fd_ = -1; // Wakes up the writer
+    Mapping map_;
+    std::mutex mutex_;
+    pid_t consumer_ = 0;
+    int consumer_fd_ = -1;
+
+public:
+    /*! Create a ring with room for capacity bytes (rounded up to whole
+     * pages) of messages.
+     */
+    explicit Writer(std::size_t capacity) {
+        capacity = (std::max<std::size_t>(capacity, control_size)
+                    + control_size - 1) & ~(control_size - 1);
+
+        fd_ = ::memfd_create("resultring", MFD_CLOEXEC);
+        if (fd_ < 0) {
+            Mapping::Fail("memfd_create");
+        }
+        if (::ftruncate(fd_, control_size + capacity) != 0) {
+            Mapping::Fail("ftruncate");
+        }
+        data_fd_ = ::eventfd(0, EFD_CLOEXEC);
+        room_fd_ = ::eventfd(0, EFD_CLOEXEC);
+        if ((data_fd_ < 0) || (room_fd_ < 0)) {
+            Mapping::Fail("eventfd");
+        }
+
+        map_.Map(fd_, capacity);
+        auto& control = *new(&map_.GetControl()) Control();
+        control.capacity = capacity;
+        control.writer_pid = ::getpid();
+        std::memcpy(control.magic, magic, sizeof(magic));
+    }
+
+    Writer(const Writer&) = delete;
+    Writer& operator = (const Writer&) = delete;
+
+    ~Writer() {
+        Finish();
+        for(const auto fd : {fd_, data_fd_, room_fd_}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    /*! Run command with /bin/sh, as the consumer of the ring.
+     *
+     * Call it before starting any threads.
+     */
+    void StartConsumer(const std::string& command) {
+        const auto fds = std::to_string(fd_) + ',' + std::to_string(data_fd_)
+            + ',' + std::to_string(room_fd_);
+
+        const auto pid = ::fork();
+        if (pid < 0) {
+            Mapping::Fail("fork");
+        }
+
+        if (!pid) {
+            for(const auto fd : {fd_, data_fd_, room_fd_}) {
+                ::fcntl(fd, F_SETFD, 0);
+            }
+            ::setenv(env_name, fds.c_str(), 1);
+            ::execl("/bin/sh", "sh", "-c", command.c_str(),
+                    static_cast<char *>(nullptr));
+            ::_exit(127);
+        }
+
+        consumer_ = pid;
+        consumer_fd_ = OpenPidFd(pid);
+    }
+
+    /*! Write one message, made from count parts. Can be called from any
+     * thread.
+     *
+     * Waits while the ring is full.
+     *
+     * @returns false if the message can't fit in the ring (EMSGSIZE),
+     *   or the consumer has exited (EPIPE).
+     */
+    bool Write(const iovec *parts, int count) {
+        std::size_t size = 0;
+        for(int i = 0; i < count; ++i) {
+            size += parts[i].iov_len;
+        }
+
+        const auto needed = Align(sizeof(length_t) + size);
+        if (needed > map_.GetCapacity()) {
+            errno = EMSGSIZE;
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& control = map_.GetControl();
+        const auto head = control.head.load(std::memory_order_relaxed);
+        while(!HasRoom(head, needed)) {
+            // Tell the reader to wake us up, and check again before we sleep
+            control.writer_waiting = 1;
+            if (HasRoom(head, needed)) {
+                control.writer_waiting = 0;
+                break;
+            }
+            if (!WaitFor(room_fd_, consumer_fd_)) {
+                errno = EPIPE;
+                return false;
+            }
+        }
+
+        char *dst = map_.At(head);
+        const length_t len = size;
+        std::memcpy(dst, &len, sizeof(len));
+        dst += sizeof(len);
+        for(int i = 0; i < count; ++i) {
+            std::memcpy(dst, parts[i].iov_base, parts[i].iov_len);
+            dst += parts[i].iov_len;
+        }
+
+        control.head = head + needed;
+        if (control.reader_waiting.exchange(0)) {
+            ::eventfd_write(data_fd_, 1);
+        }
+        return true;
+    }
+
+    /*! Tell the consumer that there is no more, and wait for it to exit
+     *
+     * @returns The status from waitpid(), or 0 if we did not start a
+     *   consumer.
+     */
+    int Finish() {
+        auto& control = map_.GetControl();
+        if (!control.closed.exchange(1)) {
+            ::eventfd_write(data_fd_, 1);
+        }
+
+        if (!consumer_) {
+            return 0;
+        }
+
+        int status = 0;
+        while((::waitpid(consumer_, &status, 0) < 0) && (errno == EINTR))
+            ;
+        consumer_ = 0;
+        if (consumer_fd_ >= 0) {
+            ::close(consumer_fd_);
+            consumer_fd_ = -1;
+        }
+        return status;
+    }
+
+private:
+    bool HasRoom(std::uint64_t head, std::size_t needed) {
+        return map_.GetCapacity() - (head - map_.GetControl().tail)
+            >= needed;
+    }
+};
+
+/*! The consumer's end of the ring */
+class Reader
+{
+    int data_fd_ = -1;
+    int room_fd_ = -1;
+    int writer_fd_ = -1;
+    Mapping map_;
+    std::uint64_t tail_ = 0;
+    std::size_t held_ = 0; // The bytes of the message we gave out
+
+public:
+    /*! Attach to the ring that the writer gave us
+     *
+     * @param fds The value of RESULTRING_FDS
+     */
+    explicit Reader(const char *fds = std::getenv(env_name)) {
+        int fd = -1;
+        if (!fds || (std::sscanf(fds, "%d,%d,%d", &fd, &data_fd_,
+                                 &room_fd_) != 3)) {
+            throw std::runtime_error(std::string("No result ring in ")
+                                     + env_name);
+        }
+
+        map_.Map(fd, 0);
+        ::close(fd);
+        tail_ = map_.GetControl().tail;
+        writer_fd_ = OpenPidFd(map_.GetControl().writer_pid);
+    }
+
+    Reader(const Reader&) = delete;
+    Reader& operator = (const Reader&) = delete;
+
+    ~Reader() {
+        for(const auto fd : {data_fd_, room_fd_, writer_fd_}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    /*! Wait for the next message
+     *
+     * The message is in the ring, and stays valid until the next call
+     * to Next() or Release().
+     *
+     * @returns false when the writer is done (or gone), and we have
+     *   read all the messages.
+     */
+    bool Next(const char *& data, std::size_t& size) {
+        Release();
+
+        auto& control = map_.GetControl();
+        for(;;) {
+            const bool closed = control.closed;
+            if (control.head != tail_) {
+                const char *msg = map_.At(tail_);
+                length_t len = 0;
+                std::memcpy(&len, msg, sizeof(len));
+                data = msg + sizeof(len);
+                size = static_cast<std::size_t>(len);
+                held_ = Align(sizeof(len) + size);
+                return true;
+            }
+
+            if (closed) {
+                return false;
+            }
+
+            // Tell the writer to wake us up, and check again before we sleep
+            control.reader_waiting = 1;
+            if ((control.head != tail_) || control.closed) {
+                control.reader_waiting = 0;
+                continue;
+            }
+            if (!WaitFor(data_fd_, writer_fd_)) {
+                // The writer died. Take what it finished.
+                if (control.head == tail_) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    /*! Give the room of the last message back to the writer */
+    void Release() {
+        if (!held_) {
+            return;
+        }
+
+        auto& control = map_.GetControl();
+        tail_ += held_;
+        held_ = 0;
+        control.tail = tail_;
+        if (control.writer_waiting.exchange(0)) {
+            ::eventfd_write(room_fd_, 1);
+        }
+    }
+};
+
+} // namespace resultring
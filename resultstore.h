@@ -0,0 +1,302 @@
+/*
+ * Keeps the results of the fetches, compressed, until they can be
+ * printed in the order the URLs were given.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#ifdef WITH_LZ4
+#   include <lz4.h>
+#else
+#   include <zlib.h>
+#endif
+#include <boost/system/error_code.hpp>
+
+#include "asynclog.h"
+
+/*! Keeps the results of a batch compressed in memory.
+ *
+ * Callers that collect all the pages before they process them would
+ * otherwise keep every page as a raw string. The store compresses each
+ * result as it is added. When the compressed data grows beyond the
+ * memory budget, the entries that were least recently used are moved
+ * to a temporary file. Get() reads them back, and decompresses them.
+ *
+ * The compression uses LZ4 when we are built with it (WITH_LZ4), and
+ * zlib at the fastest level if not; we care more about keeping up with
+ * the network than about the ratio.
+ */
+class ResultStore
+{
+    struct Entry {
+        bool present = false;
+        bool compressed = false;
+        bool on_disk = false;
+        bool spilling = false; // Being written to disk, without the lock
+        std::size_t raw_size = 0;
+        std::size_t stored_size = 0;
+        off_t offset = 0;
+        std::string data; // When in memory
+        std::list<std::size_t>::iterator lru;
+    };
+
+    const std::size_t budget_;
+    std::vector<Entry> entries_;
+    std::list<std::size_t> lru_; // Most recently used first, if not spilling
+    std::size_t in_memory_ = 0; // Not counting the ones being spilled
+    std::size_t raw_bytes_ = 0;
+    std::size_t spilled_bytes_ = 0;
+    int fd_ = -1;
+    off_t file_size_ = 0;
+    std::string dir_;
+    mutable std::mutex mutex_;
+
+public:
+    /*! Constructor
+     *
+     * @param count How many results we can hold. They are numbered
+     *   from 0 to count - 1.
+     * @param budget Max bytes of compressed data to keep in memory.
+     *   0 is unlimited.
+     * @param dir Where to put the temporary file, if we need it.
+     */
+    ResultStore(std::size_t count, std::size_t budget, std::string dir)
+        : budget_(budget), entries_(count), dir_(std::move(dir)) {}
+
+    ResultStore(const ResultStore&) = delete;
+
+    ~ResultStore() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    /*! Add a result. Can be called from any thread. */
+    void Put(std::size_t index, const std::string& data) {
+        // Compress before we take the lock, so the IO threads run in parallel
+        std::string compressed;
+        const bool deflated = Compress(data, compressed);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto& entry = entries_.at(index);
+        if (entry.present) {
+            throw std::logic_error("Result already stored");
+        }
+
+        entry.present = true;
+        entry.compressed = deflated;
+        entry.raw_size = data.size();
+        if (deflated) {
+            entry.data = std::move(compressed);
+        } else {
+            // Not worth it. Keep it as it is.
+            entry.data = data;
+        }
+        entry.stored_size = entry.data.size();
+
+        raw_bytes_ += entry.raw_size;
+        in_memory_ += entry.stored_size;
+        lru_.push_front(index);
+        entry.lru = lru_.begin();
+
+        auto victims = PickVictims();
+        lock.unlock();
+
+        // The IO threads don't wait for each other's disk writes
+        Spill(victims);
+    }
+
+    /*! Get a result back, as it was added */
+    std::string Get(std::size_t index) {
+        std::string stored;
+        bool compressed = false;
+        std::size_t raw_size = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& entry = entries_.at(index);
+            if (!entry.present) {
+                throw std::out_of_range("No such result");
+            }
+
+            compressed = entry.compressed;
+            raw_size = entry.raw_size;
+            if (entry.on_disk) {
+                stored.resize(entry.stored_size);
+                if (::pread(fd_, &stored[0], stored.size(), entry.offset)
+                    != static_cast<ssize_t>(stored.size())) {
+                    throw std::runtime_error(
+                        std::string("Failed to read spilled result: ")
+                        + strerror(errno));
+                }
+            } else {
+                stored = entry.data;
+                if (!entry.spilling) {
+                    lru_.splice(lru_.begin(), lru_, entry.lru);
+                }
+            }
+        }
+
+        if (!compressed) {
+            return stored;
+        }
+
+        std::string rval(raw_size, '\0');
+        if (!Decompress(stored, rval)) {
+            throw std::runtime_error("Failed to decompress result");
+        }
+        return rval;
+    }
+
+    void PrintStats(std::ostream& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "result store: raw=" << raw_bytes_
+            << " in-memory=" << in_memory_
+            << " spilled=" << spilled_bytes_ << std::endl;
+    }
+
+private:
+    /*! Compress data to out
+     *
+     * @returns false if it did not get smaller. Then out is not used.
+     */
+    static bool Compress(const std::string& data, std::string& out) {
+#ifdef WITH_LZ4
+        if (data.size() > LZ4_MAX_INPUT_SIZE) {
+            return false;
+        }
+        out.resize(LZ4_compressBound(static_cast<int>(data.size())));
+        const auto len = LZ4_compress_default(
+            data.data(), &out[0], static_cast<int>(data.size()),
+            static_cast<int>(out.size()));
+        if ((len <= 0) || (static_cast<std::size_t>(len) >= data.size())) {
+            return false;
+        }
+        out.resize(static_cast<std::size_t>(len));
+#else
+        auto len = ::compressBound(data.size());
+        out.resize(len);
+        if ((::compress2(reinterpret_cast<Bytef *>(&out[0]), &len,
+                         reinterpret_cast<const Bytef *>(data.data()),
+                         data.size(), Z_BEST_SPEED) != Z_OK)
+            || (len >= data.size())) {
+            return false;
+        }
+        out.resize(len);
+#endif
+        out.shrink_to_fit();
+        return true;
+    }
+
+    /*! Decompress stored to out, that has the size it had */
+    static bool Decompress(const std::string& stored, std::string& out) {
+#ifdef WITH_LZ4
+        return LZ4_decompress_safe(stored.data(), &out[0],
+                                   static_cast<int>(stored.size()),
+                                   static_cast<int>(out.size()))
+            == static_cast<int>(out.size());
+#else
+        uLongf len = out.size();
+        return (::uncompress(reinterpret_cast<Bytef *>(&out[0]), &len,
+                             reinterpret_cast<const Bytef *>(stored.data()),
+                             stored.size()) == Z_OK)
+            && (len == out.size());
+#endif
+    }
+
+    /*! Take the coldest entries out of the LRU list until we are within
+     * the budget, and give each of them a place in the file.
+     *
+     * Called with the lock held. The entries keep their data until
+     * Spill() has written it, so Get() can still read them.
+     */
+    std::vector<std::size_t> PickVictims() {
+        std::vector<std::size_t> victims;
+        if (!budget_ || (in_memory_ <= budget_) || !OpenFile()) {
+            return victims;
+        }
+
+        while((in_memory_ > budget_) && !lru_.empty()) {
+            const auto index = lru_.back();
+            auto& entry = entries_[index];
+            lru_.pop_back();
+
+            entry.spilling = true;
+            entry.offset = file_size_;
+            file_size_ += entry.stored_size;
+            in_memory_ -= entry.stored_size;
+            victims.push_back(index);
+        }
+        return victims;
+    }
+
+    /*! Write the victims to the file, without the lock */
+    void Spill(const std::vector<std::size_t>& victims) {
+        for(const auto index : victims) {
+            auto& entry = entries_[index];
+            boost::system::error_code ec;
+            if (::pwrite(fd_, entry.data.data(), entry.data.size(),
+                         entry.offset)
+                != static_cast<ssize_t>(entry.data.size())) {
+                ec = {errno ? errno : EIO, boost::system::system_category()};
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            entry.spilling = false;
+            if (ec) {
+                /* It's still stored; just not where we wanted it. Keep
+                 * it in memory, as the coldest entry.
+                 */
+                ASYNCLOG("Failed to spill result {}: {}", index, ec.message());
+                in_memory_ += entry.stored_size;
+                lru_.push_back(index);
+                entry.lru = std::prev(lru_.end());
+                continue;
+            }
+
+            entry.on_disk = true;
+            spilled_bytes_ += entry.stored_size;
+            std::string().swap(entry.data);
+        }
+    }
+
+    /*! Create the file for spilled results, if we don't have it
+     *
+     * Called with the lock held.
+     *
+     * @returns false if we can't, and must keep the results in memory
+     */
+    bool OpenFile() {
+        if (fd_ >= 0) {
+            return true;
+        }
+
+        auto path = dir_ + "/modern-results-XXXXXX";
+        fd_ = ::mkstemp(&path[0]);
+        if (fd_ < 0) {
+            const boost::system::error_code ec(
+                errno, boost::system::system_category());
+            ASYNCLOG("Cannot create a file in {}: {}", dir_, ec.message());
+            return false;
+        }
+
+        // It's ours alone, and goes away when we close it
+        ::unlink(path.c_str());
+        return true;
+    }
+};
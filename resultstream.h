@@ -0,0 +1,178 @@
+
+/*
+ * A binary stream of fetch results, for programs that consume the
+ * output of "modern --output-format binary".
+ *
+ * Each result is one record: a fixed-size RecordHeader, followed by the
+ * URL, the error message (if the fetch failed), the HTTP headers, and
+ * the body, back to back. The header has the sizes of all the parts,
+ * and the size of the whole record, so a consumer can skip a record, or
+ * find the body in a mapped file, without looking at the bytes of the
+ * response. The numbers are in host byte order, as the stream is meant
+ * for a pipe or a file on the same machine.
+ *
+ * The records are not aligned. Copy the header out (as Next() does) in
+ * stead of casting a pointer into the stream.
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/uio.h>
+
+namespace resultstream {
+
+static const char magic[4] = {'H', 'R', 'S', '1'};
+
+/*! In front of each record */
+struct RecordHeader {
+    enum : std::uint32_t {
+        FLAG_FAILED = 1 // The fetch failed; see the error message
+    };
+
+    char magic[4];
+    /*! sizeof(RecordHeader) for this version. Later versions can add
+     * fields at the end, and older consumers skip them.
+     */
+    std::uint32_t header_size = sizeof(RecordHeader);
+    /*! The bytes after the header in this record */
+    std::uint64_t record_size = 0;
+    /*! The position of the URL in the input */
+    std::uint32_t index = 0;
+    /*! The HTTP status code, or 0 if we did not get one */
+    std::int32_t status = 0;
+    std::uint32_t flags = 0;
+    std::uint32_t url_size = 0;
+    std::uint32_t error_size = 0;
+    std::uint32_t http_header_size = 0; // Including the empty line
+    std::uint64_t body_size = 0;
+
+    /*! Micro-seconds from the start of the fetch until the host was
+     * resolved, we were connected, the request was sent, the first
+     * byte of the response arrived, and we were done. The steps we
+     * did not get to are 0.
+     */
+    std::uint64_t resolved_us = 0;
+    std::uint64_t connected_us = 0;
+    std::uint64_t sent_us = 0;
+    std::uint64_t first_byte_us = 0;
+    std::uint64_t total_us = 0;
+
+    RecordHeader() {
+        std::memcpy(this->magic, resultstream::magic, sizeof(this->magic));
+    }
+};
+
+/*! A record in a stream that is in memory (or mapped) */
+struct Record {
+    RecordHeader header;
+    const char *url = nullptr;
+    const char *error = nullptr;
+    const char *http_headers = nullptr;
+    const char *body = nullptr;
+};
+
+/*! Point parts at the pieces of a record, and set the sizes in the
+ * header from them.
+ *
+ * The header must stay where it is until the parts are written.
+ *
+ * @param data The HTTP headers, followed by the body
+ */
+inline void Gather(RecordHeader& header, const std::string& url,
+                   const std::string& error, const char *data,
+                   std::size_t data_size, iovec (&parts)[4]) {
+    header.url_size = static_cast<std::uint32_t>(url.size());
+    header.error_size = static_cast<std::uint32_t>(error.size());
+    if (header.http_header_size > data_size) {
+        header.http_header_size = static_cast<std::uint32_t>(data_size);
+    }
+    header.body_size = data_size - header.http_header_size;
+    header.record_size = url.size() + error.size() + data_size;
+
+    parts[0] = {&header, sizeof(header)};
+    parts[1] = {const_cast<char *>(url.data()), url.size()};
+    parts[2] = {const_cast<char *>(error.data()), error.size()};
+    parts[3] = {const_cast<char *>(data), data_size};
+}
+
+/*! Write the parts with as few writev() calls as we can
+ *
+ * @returns false if the write failed (see errno).
+ */
+inline bool WriteAll(int fd, iovec *part, int count) {
+    // A pipe may take it in pieces
+    while(count) {
+        const auto bytes = ::writev(fd, part, count);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        auto left = static_cast<std::size_t>(bytes);
+        while(count && (left >= part->iov_len)) {
+            left -= part->iov_len;
+            ++part;
+            --count;
+        }
+        if (count) {
+            part->iov_base = static_cast<char *>(part->iov_base) + left;
+            part->iov_len -= left;
+        }
+    }
+
+    return true;
+}
+
+/*! Write a record with a single gather-write, when we can.
+ *
+ * The parts are written straight from the caller's buffers.
+ *
+ * @returns false if the write failed (see errno).
+ */
+inline bool Write(int fd, RecordHeader header, const std::string& url,
+                  const std::string& error, const char *data,
+                  std::size_t data_size) {
+    iovec parts[4];
+    Gather(header, url, error, data, data_size, parts);
+    return WriteAll(fd, parts, 4);
+}
+
+/*! Get the record at pos, and move pos to the next one.
+ *
+ * @returns false at the end of the data, or if the record is cut short
+ *   or is not a record.
+ */
+inline bool Next(const char *& pos, const char *end, Record& rec) {
+    const auto avail = static_cast<std::size_t>(end - pos);
+    if (avail < sizeof(RecordHeader)) {
+        return false;
+    }
+
+    std::memcpy(&rec.header, pos, sizeof(RecordHeader));
+    const auto& h = rec.header;
+    if ((std::memcmp(h.magic, magic, sizeof(magic)) != 0)
+        || (h.header_size < sizeof(RecordHeader))
+        || (h.header_size > avail)
+        || (h.record_size > avail - h.header_size)
+        || (static_cast<std::uint64_t>(h.url_size) + h.error_size
+            + h.http_header_size + h.body_size != h.record_size)) {
+        return false;
+    }
+
+    rec.url = pos + h.header_size;
+    rec.error = rec.url + h.url_size;
+    rec.http_headers = rec.error + h.error_size;
+    rec.body = rec.http_headers + h.http_header_size;
+    pos += h.header_size + h.record_size;
+    return true;
+}
+
+} // namespace resultstream
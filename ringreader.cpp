@@ -0,0 +1,113 @@
+
+/*
+ * A minimal consumer for "modern --output-ring". It gets the results
+ * through shared memory ("resultring.h"), as binary records
+ * ("resultstream.h"), and looks at them in place.
+ *
+ *    modern --output-ring "ringreader" --urls-file sites.txt
+ *
+ * By default it prints one line per result. With --save-dir, it saves
+ * the bodies, written straight from the ring.
+ *
+ * This code is in the public domain.
+ */
+
+#include <iostream>
+#include <string>
+#include <boost/program_options.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "resultring.h"
+#include "resultstream.h"
+
+int main(int argc, char *argv[])
+{
+    namespace po = boost::program_options;
+
+    std::string save_dir;
+    bool quiet = false;
+
+    po::options_description opts("Options");
+    opts.add_options()
+        ("help,h", "Print help and exit")
+        ("save-dir", po::value(&save_dir),
+            "Save the bodies to files named by their index in this directory")
+        ("quiet", po::bool_switch(&quiet),
+            "Only print the totals")
+        ;
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, opts), vm);
+
+        if (vm.count("help")) {
+            std::cout << "Usage: " << argv[0] << " [options]" << std::endl
+                << "Started by modern --output-ring" << std::endl
+                << opts << std::endl;
+            return 0;
+        }
+
+        po::notify(vm);
+    } catch(const std::exception& ex) {
+        std::cerr << ex.what() << std::endl
+            << "Usage: " << argv[0] << " [options]" << std::endl
+            << opts << std::endl;
+        return -1;
+    }
+
+    std::size_t records = 0, failed = 0, bytes = 0;
+    try {
+        resultring::Reader ring;
+        const char *data = nullptr;
+        std::size_t size = 0;
+        while(ring.Next(data, size)) {
+            const char *pos = data;
+            resultstream::Record rec;
+            if (!resultstream::Next(pos, data + size, rec)) {
+                std::cerr << "Not a record (" << size << " bytes)" << std::endl;
+                continue;
+            }
+
+            const auto& h = rec.header;
+            ++records;
+            bytes += h.body_size;
+            if (h.flags & resultstream::RecordHeader::FLAG_FAILED) {
+                ++failed;
+            }
+
+            if (!quiet) {
+                std::cout << h.index << ' '
+                    << std::string(rec.url, h.url_size) << ' ' << h.status
+                    << ' ' << h.body_size << " bytes " << h.total_us << " us";
+                if (h.error_size) {
+                    std::cout << ' ' << std::string(rec.error, h.error_size);
+                }
+                std::cout << std::endl;
+            }
+
+            if (!save_dir.empty() && h.body_size) {
+                const auto path = save_dir + '/' + std::to_string(h.index);
+                const int fd = ::open(path.c_str(),
+                                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                      0644);
+                if ((fd < 0)
+                    || (::write(fd, rec.body, h.body_size)
+                        != static_cast<ssize_t>(h.body_size))) {
+                    std::cerr << "Cannot write " << path << ": "
+                        << strerror(errno) << std::endl;
+                }
+                if (fd >= 0) {
+                    ::close(fd);
+                }
+            }
+        }
+    } catch(const std::exception& ex) {
+        std::cerr << "Caught exception " << ex.what() << std::endl;
+        return -1;
+    }
+
+    std::cout << records << " results, " << failed << " failed, " << bytes
+        << " bytes of bodies" << std::endl;
+    return 0;
+}
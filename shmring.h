@@ -0,0 +1,286 @@
+
+/*
+ * A single-producer, single-consumer ring buffer in shared memory, for
+ * passing messages from one process to another without copying them
+ * through pipes or sockets.
+ *
+ * The ring is mapped before fork(), so that the parent and the child
+ * share it. Messages larger than a quarter of the ring are split in
+ * chunks, and put together again by the reader.
+ *
+ * If the writer dies in the middle of a message, the chunks it did not
+ * finish are never seen by the reader, and the reader can drop the
+ * chunks it got with DiscardPartial().
+ *
+ * A side that has to wait says so in the header, and sleeps on an
+ * eventfd that the other side writes. The eventfds are only written
+ * when the other side is waiting, so a busy ring costs no system calls.
+ * The reader can poll DataFd() together with other descriptors.
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+class ShmRing
+{
+    struct Header {
+        // Written by the writer
+        alignas(64) std::atomic<std::uint64_t> head; // Bytes written
+        std::atomic<std::uint32_t> reader_waiting;
+
+        // Written by the reader
+        alignas(64) std::atomic<std::uint64_t> tail; // Bytes read
+        std::atomic<std::uint32_t> writer_waiting;
+    };
+
+    struct Chunk {
+        std::uint32_t len;
+        std::uint32_t flags;
+    };
+
+    enum : std::uint32_t {
+        FLAG_MORE = 1, // More chunks follow for this message
+        FLAG_PAD = 2   // Skip to the start of the ring
+    };
+
+    static constexpr std::size_t align = sizeof(Chunk);
+
+    std::size_t capacity_ = 0;
+    std::size_t mapped_size_ = 0;
+    Header *header_ = nullptr;
+    char *data_ = nullptr;
+    int data_fd_ = -1; // Wakes up the reader
+    int room_fd_ = -1; // Wakes up the writer
+    std::string partial_;
+
+public:
+    /*! Map an anonymous ring of capacity bytes, shared with children */
+    explicit ShmRing(std::size_t capacity)
+        : capacity_(Align(std::max<std::size_t>(capacity, 4096)))
+        , mapped_size_(sizeof(Header) + capacity_)
+    {
+        void *mem = ::mmap(nullptr, mapped_size_, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            throw std::runtime_error(std::string("mmap: ") + strerror(errno));
+        }
+
+        header_ = new(mem) Header;
+        header_->head = 0;
+        header_->tail = 0;
+        header_->writer_waiting = 0;
+        header_->reader_waiting = 0;
+        data_ = static_cast<char *>(mem) + sizeof(Header);
+
+        data_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        room_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if ((data_fd_ < 0) || (room_fd_ < 0)) {
+            const std::string error = std::string("eventfd: ")
+                + strerror(errno);
+            Close();
+            throw std::runtime_error(error);
+        }
+    }
+
+    ShmRing(const ShmRing&) = delete;
+    ShmRing& operator = (const ShmRing&) = delete;
+
+    ~ShmRing() {
+        Close();
+    }
+
+    /*! Write one message, made from count parts.
+     *
+     * Sleeps on an eventfd while the ring is full.
+     */
+    void Write(const iovec *parts, int count) {
+        std::size_t left = 0;
+        for(int i = 0; i < count; ++i) {
+            left += parts[i].iov_len;
+        }
+
+        const std::size_t max_chunk = capacity_ / 4 - sizeof(Chunk);
+        int part = 0;
+        std::size_t part_offset = 0;
+
+        do {
+            const auto len = std::min(left, max_chunk);
+            left -= len;
+
+            char *dst = Reserve(len);
+            auto *chunk = reinterpret_cast<Chunk *>(dst);
+            chunk->len = static_cast<std::uint32_t>(len);
+            chunk->flags = left ? FLAG_MORE : 0;
+            dst += sizeof(Chunk);
+
+            for(std::size_t copied = 0; copied < len;) {
+                const auto& src = parts[part];
+                const auto bytes = std::min(len - copied,
+                                            src.iov_len - part_offset);
+                std::memcpy(dst + copied,
+                            static_cast<const char *>(src.iov_base)
+                                + part_offset, bytes);
+                copied += bytes;
+                part_offset += bytes;
+                if (part_offset == src.iov_len) {
+                    ++part;
+                    part_offset = 0;
+                }
+            }
+
+            header_->head = header_->head.load(std::memory_order_relaxed)
+                + Align(sizeof(Chunk) + len);
+            if (header_->reader_waiting.exchange(0)) {
+                ::eventfd_write(data_fd_, 1);
+            }
+        } while(left);
+    }
+
+    /*! Read one message, if a complete one is available
+     *
+     * @returns true if message was set.
+     */
+    bool Read(std::string& message) {
+        auto tail = header_->tail.load(std::memory_order_relaxed);
+
+        for(;;) {
+            const auto head = header_->head.load(std::memory_order_acquire);
+            if (tail == head) {
+                return false;
+            }
+
+            const auto pos = tail % capacity_;
+            const auto *chunk = reinterpret_cast<const Chunk *>(data_ + pos);
+            if (chunk->flags & FLAG_PAD) {
+                tail += capacity_ - pos;
+                Release(tail);
+                continue;
+            }
+
+            partial_.append(data_ + pos + sizeof(Chunk), chunk->len);
+            const bool more = chunk->flags & FLAG_MORE;
+            tail += Align(sizeof(Chunk) + chunk->len);
+            Release(tail);
+
+            if (!more) {
+                message.swap(partial_);
+                partial_.clear();
+                return true;
+            }
+        }
+    }
+
+    /*! Forget the chunks we have of a message the writer did not finish */
+    void DiscardPartial() {
+        partial_.clear();
+    }
+
+    /*! Readable when the writer has written since WantData() */
+    int DataFd() const { return data_fd_; }
+
+    /*! Ask the writer to make DataFd() readable when it writes.
+     *
+     * Call it when Read() returns false, before waiting for DataFd().
+     *
+     * @returns false if there is something to read already. Then
+     *   don't wait.
+     */
+    bool WantData() {
+        ClearData();
+        header_->reader_waiting = 1;
+        if (header_->head != header_->tail) {
+            header_->reader_waiting = 0;
+            return false;
+        }
+        return true;
+    }
+
+    /*! Make DataFd() not readable again */
+    void ClearData() {
+        eventfd_t value = 0;
+        ::eventfd_read(data_fd_, &value);
+    }
+
+private:
+    void Close() {
+        for(const auto fd : {data_fd_, room_fd_}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        ::munmap(header_, mapped_size_);
+    }
+
+    static std::size_t Align(std::size_t len) {
+        return (len + align - 1) & ~(align - 1);
+    }
+
+    /*! Wait for room for a chunk of len bytes, contiguous in data_
+     *
+     * @returns Where to write the chunk.
+     */
+    char *Reserve(std::size_t len) {
+        const auto needed = Align(sizeof(Chunk) + len);
+        auto head = header_->head.load(std::memory_order_relaxed);
+
+        for(;;) {
+            const auto pos = head % capacity_;
+            const auto to_end = capacity_ - pos;
+            const auto want = (to_end < needed) ? to_end + needed : needed;
+            const auto used = head - header_->tail.load(
+                std::memory_order_acquire);
+
+            if (capacity_ - used < want) {
+                // Tell the reader to wake us up, and check again before we sleep
+                header_->writer_waiting = 1;
+                if (capacity_ - (head - header_->tail) >= want) {
+                    header_->writer_waiting = 0;
+                    continue;
+                }
+                WaitForRoom();
+                continue;
+            }
+
+            if (to_end < needed) {
+                // Not enough room at the end. Start over at the beginning.
+                reinterpret_cast<Chunk *>(data_ + pos)->flags = FLAG_PAD;
+                head += to_end;
+                header_->head = head;
+                continue;
+            }
+
+            return data_ + pos;
+        }
+    }
+
+    /*! Give the room up to tail back to the writer */
+    void Release(std::uint64_t tail) {
+        header_->tail = tail;
+        if (header_->writer_waiting.exchange(0)) {
+            ::eventfd_write(room_fd_, 1);
+        }
+    }
+
+    void WaitForRoom() {
+        pollfd fd = {room_fd_, POLLIN, 0};
+        while((::poll(&fd, 1, -1) < 0) && (errno == EINTR))
+            ;
+        eventfd_t value = 0;
+        ::eventfd_read(room_fd_, &value);
+    }
+};
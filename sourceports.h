@@ -0,0 +1,166 @@
+/*
+ * Bookkeeping of the local (source) ports we use, so that we can open
+ * more connections to one server than the ephemeral port range allows.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <boost/asio.hpp>
+
+/*! Spreads new connections over several local addresses.
+ *
+ * Each local address gives us one range of ephemeral ports towards a
+ * destination, and the closed connections keep their ports in
+ * TIME_WAIT for a minute. At high connection rates to a few backends,
+ * one address runs out. Here we count the connections opened from each
+ * local address to each destination during the last TIME_WAIT period,
+ * and pick the address with the fewest. This is an estimate of the
+ * ports in use; the kernel has the final word, and when it says
+ * EADDRNOTAVAIL, we leave that address alone for a second.
+ *
+ * Can be used from any thread.
+ */
+class SourcePorts
+{
+    using tcp = boost::asio::ip::tcp;
+
+    static constexpr int time_wait_seconds = 60;
+
+    struct Usage {
+        std::array<std::uint32_t, time_wait_seconds> opened{}; // Per second
+        std::int64_t last_second = 0;
+        std::int64_t unavailable_until = 0;
+        std::uint64_t connects = 0;
+        std::uint64_t unavailable = 0;
+
+        /*! Connections opened during the last TIME_WAIT period */
+        std::uint64_t Recent(std::int64_t now) {
+            const auto expired = std::min<std::int64_t>(now - last_second,
+                                                        time_wait_seconds);
+            for(std::int64_t i = 1; i <= expired; ++i) {
+                opened[(last_second + i) % time_wait_seconds] = 0;
+            }
+            last_second = now;
+
+            std::uint64_t sum = 0;
+            for(const auto count : opened) {
+                sum += count;
+            }
+            return sum;
+        }
+    };
+
+    const std::vector<boost::asio::ip::address> addresses_;
+    mutable std::mutex mutex_;
+    std::map<tcp::endpoint, std::vector<Usage>> destinations_;
+
+public:
+    SourcePorts(const std::vector<boost::asio::ip::address>& addresses)
+        : addresses_(addresses) {}
+
+    /*! Pick the local address for a connection to destination
+     *
+     * @returns false if we have no local address of the right family.
+     */
+    bool Pick(const tcp::endpoint& destination,
+              boost::asio::ip::address& source) {
+        const auto now = Now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& usage = Get(destination);
+
+        int best = -1;
+        std::uint64_t best_recent = 0;
+        bool best_available = false;
+        for(std::size_t i = 0; i < addresses_.size(); ++i) {
+            if (addresses_[i].is_v4() != destination.address().is_v4()) {
+                continue;
+            }
+
+            const auto recent = usage[i].Recent(now);
+            const bool available = usage[i].unavailable_until <= now;
+            if ((best < 0) || (available && !best_available)
+                || ((available == best_available) && (recent < best_recent))) {
+                best = static_cast<int>(i);
+                best_recent = recent;
+                best_available = available;
+            }
+        }
+
+        if (best < 0) {
+            return false;
+        }
+
+        auto& chosen = usage[best];
+        ++chosen.opened[now % time_wait_seconds];
+        ++chosen.connects;
+        source = addresses_[best];
+        return true;
+    }
+
+    /*! The kernel had no free port from source to destination */
+    void Unavailable(const tcp::endpoint& destination,
+                     const boost::asio::ip::address& source) {
+        const auto now = Now();
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& usage = Get(destination);
+        for(std::size_t i = 0; i < addresses_.size(); ++i) {
+            if (addresses_[i] == source) {
+                ++usage[i].unavailable;
+                usage[i].unavailable_until = now + 1;
+            }
+        }
+    }
+
+    /*! How many local addresses we can use towards destination */
+    std::size_t Count(const tcp::endpoint& destination) const {
+        return std::count_if(addresses_.begin(), addresses_.end(),
+                             [&](const boost::asio::ip::address& a) {
+            return a.is_v4() == destination.address().is_v4();
+        });
+    }
+
+    void PrintStats(std::ostream& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for(const auto& dest : destinations_) {
+            for(std::size_t i = 0; i < addresses_.size(); ++i) {
+                const auto& usage = dest.second[i];
+                if (!usage.connects && !usage.unavailable) {
+                    continue;
+                }
+                out << "source " << addresses_[i] << " -> " << dest.first
+                    << ": connects=" << usage.connects
+                    << " addr-unavailable=" << usage.unavailable
+                    << std::endl;
+            }
+        }
+    }
+
+private:
+    static std::int64_t Now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::vector<Usage>& Get(const tcp::endpoint& destination) {
+        auto& usage = destinations_[destination];
+        if (usage.empty()) {
+            usage.resize(addresses_.size());
+        }
+        return usage;
+    }
+};
+
+constexpr int SourcePorts::time_wait_seconds;
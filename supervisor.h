@@ -0,0 +1,396 @@
+/*
+ * Runs the fetches in several worker processes, and prints their results
+ * in the order the URLs were given.
+ *
+ * Used by "modern.cpp".
+ *
+ * This code is in the public domain.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "request.h"
+#include "output.h"
+#include "shmring.h"
+#include "resultring.h"
+#include "asynclog.h"
+
+/*! Runs the fetches in several worker processes.
+ *
+ * One process eventually runs into the limit for open files, contention
+ * in the memory allocator, and the throughput of a single resolver. The
+ * supervisor forks workers, and gives each of them a shard of the URLs,
+ * by the hash of the host-name, so that all the requests to a host are
+ * made by the same worker.
+ *
+ * The workers send their results back over shared-memory rings. The
+ * supervisor prints them in the order the URLs were given. If a worker
+ * dies, it is restarted with the URLs it had not finished. While there
+ * is nothing to do, the supervisor sleeps in poll() on the rings'
+ * eventfds and the workers' pidfds.
+ */
+class Supervisor
+{
+public:
+    struct Options {
+        std::size_t workers = 2;
+        std::size_t ring_size = 16 * 1024 * 1024;
+        int max_restarts = 3;
+        std::size_t preconnect = 0;
+        Output output;
+        bool stage_stats = false;
+        bool completion_order = false;
+    };
+
+private:
+    // In front of each result in the ring
+    struct Message {
+        std::uint32_t index;
+        std::uint32_t failed;
+        std::int32_t status;
+        std::uint32_t header_size;
+        Request::Timings timings;
+        std::uint32_t redirects;
+    };
+
+    struct Worker {
+        std::size_t id = 0;
+        pid_t pid = 0;
+        int pidfd = -1; // Readable when the process has exited
+        std::unique_ptr<ShmRing> ring;
+        std::set<std::size_t> pending; // Indexes in urls_
+        int restarts = 0;
+    };
+
+    const Config& config_;
+    const std::vector<std::string>& urls_;
+    const Options options_;
+    std::vector<Worker> workers_;
+    std::vector<Outcome> outcomes_;
+    std::vector<bool> ready_;
+    std::vector<std::size_t> completed_; // In completion order
+    std::size_t next_to_print_ = 0;
+    std::size_t running_ = 0;
+    int rval_ = 0;
+
+public:
+    Supervisor(const Config& config, const std::vector<std::string>& urls,
+               const Options& options)
+        : config_(config), urls_(urls), options_(options)
+        , workers_(std::max<std::size_t>(options.workers, 1))
+        , outcomes_(urls.size()), ready_(urls.size())
+    {
+        for(std::size_t i = 0; i < workers_.size(); ++i) {
+            workers_[i].id = i;
+            workers_[i].ring = std::make_unique<ShmRing>(options_.ring_size);
+        }
+
+        for(std::size_t i = 0; i < urls_.size(); ++i) {
+            workers_[Shard(urls_[i])].pending.insert(i);
+        }
+    }
+
+    /*! Run all the fetches, and print the results
+     *
+     * @returns The exit code for the program
+     */
+    int Run() {
+        // Or the children get a copy of what we have not written yet
+        std::cout.flush();
+
+        for(auto& worker : workers_) {
+            if (!worker.pending.empty()) {
+                Start(worker);
+            }
+        }
+
+        while(running_) {
+            bool busy = false;
+            for(auto& worker : workers_) {
+                busy |= Drain(worker);
+            }
+
+            // Only our workers; main() may have other children
+            for(auto& worker : workers_) {
+                int status = 0;
+                if (worker.pid
+                    && (::waitpid(worker.pid, &status, WNOHANG) > 0)) {
+                    OnExit(worker, status);
+                    busy = true;
+                }
+            }
+
+            PrintReady();
+
+            if (!busy) {
+                Wait();
+            }
+        }
+
+        PrintReady();
+        return rval_;
+    }
+
+private:
+    std::size_t Shard(const std::string& url) const {
+        Url target;
+        if (!Url::TryParse(url, target)) {
+            return 0; // The worker reports it as invalid
+        }
+
+        auto host = target.host;
+        std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+        return std::hash<std::string>()(host) % workers_.size();
+    }
+
+    void Start(Worker& worker) {
+        const auto pid = ::fork();
+        if (pid < 0) {
+            throw std::runtime_error(std::string("fork: ") + strerror(errno));
+        }
+
+        if (!pid) {
+            int status = 1;
+            try {
+                RunWorker(worker);
+                status = 0;
+            } catch(const std::exception& ex) {
+                std::cerr << "Worker " << worker.id << ": Caught exception "
+                    << ex.what() << std::endl;
+            }
+
+            // Don't run our parent's exit handlers or flush it's buffers
+            asynclog::Flush();
+            ::_exit(status);
+        }
+
+        worker.pid = pid;
+        worker.pidfd = resultring::OpenPidFd(pid);
+        ++running_;
+    }
+
+    /*! Sleep until a worker writes to it's ring, or exits
+     *
+     * Without pidfds (before Linux 5.3), we look for exited workers
+     * every 100 milliseconds.
+     */
+    void Wait() {
+        std::vector<pollfd> fds;
+        int timeout = -1;
+        for(auto& worker : workers_) {
+            if (!worker.pid) {
+                continue;
+            }
+            if (!worker.ring->WantData()) {
+                return; // It wrote after we looked
+            }
+            fds.push_back({worker.ring->DataFd(), POLLIN, 0});
+            if (worker.pidfd >= 0) {
+                fds.push_back({worker.pidfd, POLLIN, 0});
+            } else {
+                timeout = 100;
+            }
+        }
+
+        if (!fds.empty()) {
+            ::poll(fds.data(), fds.size(), timeout);
+        }
+    }
+
+    /*! The body of the worker process */
+    void RunWorker(Worker& worker) {
+        /* Each process has it's own table of open files. Use as much of
+         * it as we are allowed to.
+         */
+        rlimit limit = {};
+        if (!::getrlimit(RLIMIT_NOFILE, &limit)
+            && (limit.rlim_cur < limit.rlim_max)) {
+            limit.rlim_cur = limit.rlim_max;
+            ::setrlimit(RLIMIT_NOFILE, &limit);
+        }
+
+        std::vector<std::string> urls;
+        for(const auto index : worker.pending) {
+            urls.push_back(urls_[index]);
+        }
+
+        Request req(config_);
+
+        if (options_.preconnect) {
+            PreconnectAll(req, urls, options_.preconnect);
+        }
+
+        /* Send each result as soon as it's done; the parent puts them
+         * in order if it has to. The ring has one writer, so the IO
+         * threads take turns.
+         */
+        const std::vector<std::size_t> indexes(worker.pending.begin(),
+                                               worker.pending.end());
+        std::mutex mutex;
+        std::condition_variable all_done;
+        std::size_t left = urls.size();
+
+        for(std::size_t i = 0; i < urls.size(); ++i) {
+            req.TryFetch(urls[i], [&, i](Request::Result& result) {
+                const auto outcome = Outcome::Make(urls[i], result,
+                                                   options_.output.format);
+
+                const Message msg = {
+                    static_cast<std::uint32_t>(indexes[i]),
+                    outcome.failed ? 1u : 0u,
+                    outcome.status,
+                    static_cast<std::uint32_t>(outcome.header_size),
+                    outcome.timings,
+                    static_cast<std::uint32_t>(outcome.redirects)};
+                const iovec parts[2] = {
+                    {const_cast<Message *>(&msg), sizeof(msg)},
+                    {const_cast<char *>(outcome.text.data()),
+                     outcome.text.size()}
+                };
+
+                std::lock_guard<std::mutex> lock(mutex);
+                worker.ring->Write(parts, 2);
+                if (--left == 0) {
+                    all_done.notify_one();
+                }
+            });
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            all_done.wait(lock, [&]() { return left == 0; });
+        }
+
+        std::ostringstream stats;
+        if (options_.stage_stats) {
+            req.PrintStageStats(stats);
+            req.PrintPoolStats(stats);
+            req.PrintSourceStats(stats);
+            req.PrintRedirectStats(stats);
+        }
+        req.PrintLoopStats(stats);
+        if (!stats.str().empty()) {
+            std::clog << "Worker " << worker.id << ":" << std::endl
+                << stats.str();
+        }
+    }
+
+    /*! Collect the results from a worker
+     *
+     * @returns true if we got any
+     */
+    bool Drain(Worker& worker) {
+        bool got_any = false;
+        std::string data;
+        while(worker.ring->Read(data)) {
+            Message msg = {};
+            if (data.size() < sizeof(msg)) {
+                continue;
+            }
+            std::memcpy(&msg, data.data(), sizeof(msg));
+
+            if (worker.pending.erase(msg.index)) {
+                auto& outcome = outcomes_[msg.index];
+                outcome.failed = msg.failed;
+                outcome.status = msg.status;
+                outcome.header_size = msg.header_size;
+                outcome.timings = msg.timings;
+                outcome.redirects = msg.redirects;
+                outcome.text = data.substr(sizeof(msg));
+                MarkReady(msg.index);
+            }
+            got_any = true;
+        }
+        return got_any;
+    }
+
+    void OnExit(Worker& worker, int status) {
+        --running_;
+        worker.pid = 0;
+        if (worker.pidfd >= 0) {
+            ::close(worker.pidfd);
+            worker.pidfd = -1;
+        }
+
+        // Pick up what it sent before it died
+        Drain(worker);
+        worker.ring->DiscardPartial();
+
+        if (worker.pending.empty()) {
+            return;
+        }
+
+        std::cerr << "Worker " << worker.id;
+        if (WIFSIGNALED(status)) {
+            std::cerr << " was killed by signal " << WTERMSIG(status);
+        } else {
+            std::cerr << " exited with status " << WEXITSTATUS(status);
+        }
+        std::cerr << " with " << worker.pending.size() << " URLs left";
+
+        if (worker.restarts++ < options_.max_restarts) {
+            std::cerr << ". Restarting it." << std::endl;
+            Start(worker);
+            return;
+        }
+
+        std::cerr << ". Giving up." << std::endl;
+        for(const auto index : worker.pending) {
+            outcomes_[index].failed = true;
+            outcomes_[index].text = "The worker process died";
+            MarkReady(index);
+        }
+        worker.pending.clear();
+    }
+
+    void MarkReady(std::size_t index) {
+        ready_[index] = true;
+        completed_.push_back(index);
+    }
+
+    void PrintReady() {
+        if (options_.completion_order) {
+            for(const auto index : completed_) {
+                Print(index);
+            }
+        } else {
+            for(; (next_to_print_ < urls_.size()) && ready_[next_to_print_];
+                ++next_to_print_) {
+                Print(next_to_print_);
+            }
+        }
+        completed_.clear();
+        std::cout.flush();
+    }
+
+    void Print(std::size_t index) {
+        auto& outcome = outcomes_[index];
+        if (!outcome.Print(index, urls_[index], urls_.size() > 1,
+                           options_.output)) {
+            rval_ = -1;
+        }
+        outcome.text.clear();
+        outcome.text.shrink_to_fit();
+    }
+};
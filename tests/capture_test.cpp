@@ -0,0 +1,134 @@
+/*
+ * Tests for the record format in "capture.h".
+ *
+ * This code is in the public domain.
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <boost/test/unit_test.hpp>
+
+#include "capture.h"
+
+namespace {
+
+capture::Exchange MakeExchange(const std::string& path,
+                               const std::string& data) {
+    capture::Exchange ex;
+    ex.host = "example.com";
+    ex.port = 8080;
+    ex.path = path;
+    ex.data = data;
+
+    // Split the data in uneven chunks, with delays across varint sizes
+    std::uint32_t delay = 1;
+    for(std::size_t offset = 0; offset < data.size();) {
+        const auto len = std::min<std::size_t>(offset + 1,
+                                               data.size() - offset);
+        ex.chunks.push_back({delay, static_cast<std::uint32_t>(len)});
+        offset += len;
+        delay *= 131;
+    }
+    return ex;
+}
+
+void CheckSame(const capture::Exchange& a, const capture::Exchange& b) {
+    BOOST_CHECK_EQUAL(a.host, b.host);
+    BOOST_CHECK_EQUAL(a.port, b.port);
+    BOOST_CHECK_EQUAL(a.path, b.path);
+    BOOST_CHECK_EQUAL(a.flags, b.flags);
+    BOOST_CHECK_EQUAL(a.data, b.data);
+    BOOST_REQUIRE_EQUAL(a.chunks.size(), b.chunks.size());
+    for(std::size_t i = 0; i < a.chunks.size(); ++i) {
+        BOOST_CHECK_EQUAL(a.chunks[i].delay_us, b.chunks[i].delay_us);
+        BOOST_CHECK_EQUAL(a.chunks[i].len, b.chunks[i].len);
+    }
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(capture_decode)
+
+BOOST_AUTO_TEST_CASE(varints) {
+    for(const std::uint64_t value : {std::uint64_t(0), std::uint64_t(127),
+                                     std::uint64_t(128), std::uint64_t(16383),
+                                     std::uint64_t(16384), ~std::uint64_t(0)}) {
+        std::string data;
+        capture::AppendVarint(data, value);
+
+        const char *p = data.data();
+        std::uint64_t decoded = 0;
+        BOOST_CHECK(capture::ReadVarint(p, data.data() + data.size(),
+                                        decoded));
+        BOOST_CHECK_EQUAL(decoded, value);
+        BOOST_CHECK(p == data.data() + data.size());
+
+        p = data.data();
+        BOOST_CHECK(!capture::ReadVarint(p, data.data() + data.size() - 1,
+                                         decoded));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(round_trip) {
+    auto first = MakeExchange("/a", "HTTP/1.1 200 OK\r\n\r\nhello, world");
+    auto second = MakeExchange("/b", "");
+    second.flags = capture::Exchange::FLAG_RESET;
+    const auto data = capture::Encode(first) + capture::Encode(second);
+
+    const char *p = data.data();
+    const char *end = p + data.size();
+    capture::Exchange ex;
+    BOOST_REQUIRE(capture::Decode(p, end, ex));
+    CheckSame(ex, first);
+    BOOST_REQUIRE(capture::Decode(p, end, ex));
+    CheckSame(ex, second);
+    BOOST_CHECK(p == end);
+    BOOST_CHECK(!capture::Decode(p, end, ex));
+}
+
+BOOST_AUTO_TEST_CASE(cut_short) {
+    const auto data = capture::Encode(MakeExchange("/a", "0123456789"));
+    for(std::size_t len = 0; len < data.size(); ++len) {
+        const char *p = data.data();
+        capture::Exchange ex;
+        BOOST_CHECK_MESSAGE(!capture::Decode(p, data.data() + len, ex),
+                            "Decoded " << len << " of " << data.size()
+                            << " bytes");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(chunks_dont_add_up) {
+    auto ex = MakeExchange("/a", "0123456789");
+    ex.chunks.back().len += 1;
+    const auto data = capture::Encode(ex);
+
+    const char *p = data.data();
+    BOOST_CHECK(!capture::Decode(p, data.data() + data.size(), ex));
+}
+
+BOOST_AUTO_TEST_CASE(load_skips_a_partial_record) {
+    const auto first = MakeExchange("/a", "0123456789");
+    const auto second = capture::Encode(MakeExchange("/b", "abcdef"));
+    char path[] = "/tmp/capture_test.XXXXXX";
+    const int fd = ::mkstemp(path);
+    BOOST_REQUIRE(fd >= 0);
+    ::close(fd);
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << capture::magic << capture::Encode(first)
+            << second.substr(0, second.size() - 1);
+    }
+
+    const auto loaded = capture::Load(path);
+    ::unlink(path);
+    BOOST_REQUIRE_EQUAL(loaded.size(), 1);
+    CheckSame(loaded[0], first);
+
+    BOOST_CHECK_THROW(capture::Load(path), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
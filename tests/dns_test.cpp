@@ -0,0 +1,124 @@
+/*
+ * Tests for "dns.h".
+ *
+ * This code is in the public domain.
+ */
+
+#include <string>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "dns.h"
+
+namespace {
+
+const std::uint8_t *Bytes(const std::string& data) {
+    return reinterpret_cast<const std::uint8_t *>(data.data());
+}
+
+dns::Message Query(const std::string& name, std::uint16_t type) {
+    std::string wire;
+    BOOST_REQUIRE(dns::MakeQuery(wire, 0x1234, name, type));
+
+    dns::Message query;
+    BOOST_REQUIRE(dns::Parse(Bytes(wire), wire.size(), query));
+    return query;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(dns_parse)
+
+BOOST_AUTO_TEST_CASE(query) {
+    const auto query = Query("www.Example.com", dns::TYPE_AAAA);
+    BOOST_CHECK_EQUAL(query.id, 0x1234);
+    BOOST_CHECK(!query.IsResponse());
+    BOOST_CHECK(query.flags & dns::FLAG_RECURSION_DESIRED);
+    BOOST_CHECK_EQUAL(query.qname, "www.Example.com");
+    BOOST_CHECK_EQUAL(query.qtype, dns::TYPE_AAAA);
+    BOOST_CHECK(query.addresses.empty());
+}
+
+BOOST_AUTO_TEST_CASE(bad_names) {
+    std::string wire;
+    BOOST_CHECK(!dns::MakeQuery(wire, 1, "www..example.com", dns::TYPE_A));
+    BOOST_CHECK(!dns::MakeQuery(wire, 1, std::string(64, 'a') + ".com",
+                                dns::TYPE_A));
+}
+
+BOOST_AUTO_TEST_CASE(response_with_the_asked_type_only) {
+    const auto query = Query("example.com", dns::TYPE_A);
+    const std::vector<boost::asio::ip::address> addresses = {
+        boost::asio::ip::address::from_string("10.0.0.1"),
+        boost::asio::ip::address::from_string("::1"),
+        boost::asio::ip::address::from_string("10.0.0.2")
+    };
+
+    std::string wire;
+    dns::MakeResponse(wire, query, dns::RCODE_OK, addresses);
+
+    dns::Message response;
+    BOOST_REQUIRE(dns::Parse(Bytes(wire), wire.size(), response));
+    BOOST_CHECK(response.IsResponse());
+    BOOST_CHECK(!response.IsTruncated());
+    BOOST_CHECK_EQUAL(response.Rcode(), dns::RCODE_OK);
+    BOOST_CHECK_EQUAL(response.id, 0x1234);
+    BOOST_CHECK_EQUAL(response.qname, "example.com");
+    BOOST_REQUIRE_EQUAL(response.addresses.size(), 2);
+    BOOST_CHECK_EQUAL(response.addresses[0].to_string(), "10.0.0.1");
+    BOOST_CHECK_EQUAL(response.addresses[1].to_string(), "10.0.0.2");
+}
+
+BOOST_AUTO_TEST_CASE(truncated_response) {
+    const auto query = Query("example.com", dns::TYPE_AAAA);
+    std::vector<boost::asio::ip::address> addresses;
+    for(int i = 1; i <= 40; ++i) {
+        addresses.push_back(boost::asio::ip::address::from_string(
+            "2001:db8::" + std::to_string(i)));
+    }
+
+    std::string wire;
+    dns::MakeResponse(wire, query, dns::RCODE_OK, addresses);
+    BOOST_CHECK_LE(wire.size(), dns::max_udp_size);
+
+    dns::Message response;
+    BOOST_REQUIRE(dns::Parse(Bytes(wire), wire.size(), response));
+    BOOST_CHECK(response.IsTruncated());
+    BOOST_CHECK(!response.addresses.empty());
+    BOOST_CHECK_LT(response.addresses.size(), addresses.size());
+}
+
+BOOST_AUTO_TEST_CASE(nxdomain) {
+    const auto query = Query("nowhere.example", dns::TYPE_A);
+    std::string wire;
+    dns::MakeResponse(wire, query, dns::RCODE_NXDOMAIN, {});
+
+    dns::Message response;
+    BOOST_REQUIRE(dns::Parse(Bytes(wire), wire.size(), response));
+    BOOST_CHECK_EQUAL(response.Rcode(), dns::RCODE_NXDOMAIN);
+    BOOST_CHECK(response.addresses.empty());
+}
+
+BOOST_AUTO_TEST_CASE(cut_short) {
+    const auto query = Query("example.com", dns::TYPE_A);
+    std::string wire;
+    dns::MakeResponse(wire, query, dns::RCODE_OK,
+        {boost::asio::ip::address::from_string("10.0.0.1")});
+
+    dns::Message response;
+    for(std::size_t len = 0; len < wire.size(); ++len) {
+        BOOST_CHECK_MESSAGE(!dns::Parse(Bytes(wire), len, response),
+                            "Parsed " << len << " of " << wire.size()
+                            << " bytes");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(pointer_loop) {
+    // A header with one question, whose name points at itself
+    const std::string wire("\x00\x01\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+                           "\xc0\x0c\x00\x01\x00\x01", 18);
+    dns::Message msg;
+    BOOST_CHECK(!dns::Parse(Bytes(wire), wire.size(), msg));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,11 @@
+/*
+ * Unit tests for the header-only parts of the examples.
+ *
+ * Run them with "ctest", or run the "tests" program directly (see
+ * "tests --help" for how to pick tests).
+ *
+ * This code is in the public domain.
+ */
+
+#define BOOST_TEST_MODULE examples
+#include <boost/test/unit_test.hpp>
@@ -0,0 +1,188 @@
+/*
+ * Tests for Response in "http.h": how it finds the end of the headers
+ * and of the body, as the data arrives in pieces.
+ *
+ * This code is in the public domain.
+ */
+
+#include <cstring>
+#include <string>
+#include <boost/test/unit_test.hpp>
+
+#include "http.h"
+
+namespace {
+
+/*! Feed data one byte at a time, and check that the response is
+ * complete after the last byte, and not before.
+ */
+void AppendByBytes(Response& response, const std::string& data) {
+    for(std::size_t i = 0; i < data.size(); ++i) {
+        BOOST_REQUIRE_MESSAGE(!response.IsComplete(),
+                              "Complete after " << i << " bytes");
+        response.Append(&data[i], 1);
+    }
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(response)
+
+BOOST_AUTO_TEST_CASE(content_length) {
+    const std::string headers = "HTTP/1.1 200 OK\r\n"
+                                "content-length:  5 \r\n"
+                                "X-Test:\tvalue\r\n\r\n";
+    Response response;
+    AppendByBytes(response, headers + "hello");
+
+    BOOST_CHECK(response.IsComplete());
+    BOOST_CHECK(response.HasHeaders());
+    BOOST_CHECK_EQUAL(response.GetStatus(), 200);
+    BOOST_CHECK_EQUAL(response.GetHeaderSize(), headers.size());
+    BOOST_CHECK_EQUAL(response.GetHeader("X-TEST"), "value");
+    BOOST_CHECK(response.GetHeader("X-Other").empty());
+    BOOST_CHECK_EQUAL(response.GetBody(), "hello");
+    BOOST_CHECK(response.KeepsAlive());
+
+    std::size_t length = 0;
+    BOOST_CHECK(response.GetContentLength(length));
+    BOOST_CHECK_EQUAL(length, 5);
+}
+
+BOOST_AUTO_TEST_CASE(bad_content_length) {
+    Response response;
+    const std::string data = "HTTP/1.1 200 OK\r\nContent-Length: 5x\r\n\r\n";
+    response.Append(data.data(), data.size());
+
+    std::size_t length = 0;
+    BOOST_CHECK(!response.GetContentLength(length));
+    BOOST_CHECK(!response.IsComplete());
+}
+
+BOOST_AUTO_TEST_CASE(no_body) {
+    for(const auto status : {"204 No Content", "304 Not Modified"}) {
+        Response response;
+        const auto data = std::string("HTTP/1.1 ") + status + "\r\n\r\n";
+        AppendByBytes(response, data);
+        BOOST_CHECK(response.IsComplete());
+        BOOST_CHECK(response.GetBody().empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(until_close) {
+    Response response;
+    const std::string data = "HTTP/1.0 200 OK\r\n\r\nsome data";
+    response.Append(data.data(), data.size());
+    BOOST_CHECK(!response.IsComplete());
+    BOOST_CHECK(!response.KeepsAlive());
+    BOOST_CHECK_EQUAL(response.GetBody(), "some data");
+}
+
+BOOST_AUTO_TEST_CASE(keep_alive) {
+    const auto keeps_alive = [](const std::string& headers) {
+        Response response;
+        const auto data = headers + "\r\n";
+        response.Append(data.data(), data.size());
+        return response.KeepsAlive();
+    };
+
+    BOOST_CHECK(keeps_alive("HTTP/1.1 200 OK\r\n"));
+    BOOST_CHECK(!keeps_alive("HTTP/1.1 200 OK\r\nConnection: Close\r\n"));
+    BOOST_CHECK(!keeps_alive("HTTP/1.0 200 OK\r\n"));
+    BOOST_CHECK(keeps_alive("HTTP/1.0 200 OK\r\nConnection: keep-alive\r\n"));
+}
+
+BOOST_AUTO_TEST_CASE(bad_status_line) {
+    Response response;
+    const std::string data = "HTTP/1.1 2x0 OK\r\nContent-Length: 0\r\n\r\n";
+    response.Append(data.data(), data.size());
+    BOOST_CHECK(response.HasHeaders());
+    BOOST_CHECK_EQUAL(response.GetStatus(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(chunked) {
+    // The second chunk holds what looks like the last chunk
+    const std::string body = "5\r\nhello\r\n"
+                             "7;name=value\r\n0\r\n\r\nab\r\n"
+                             "A\r\n0123456789\r\n"
+                             "0\r\n\r\n";
+    Response response;
+    AppendByBytes(response, "HTTP/1.1 200 OK\r\n"
+                            "Transfer-Encoding: chunked\r\n\r\n" + body);
+    BOOST_CHECK(response.IsComplete());
+    BOOST_CHECK_EQUAL(response.GetBody(), body);
+}
+
+BOOST_AUTO_TEST_CASE(chunked_trailers) {
+    Response response;
+    AppendByBytes(response, "HTTP/1.1 200 OK\r\n"
+                            "Transfer-Encoding: gzip, Chunked\r\n\r\n"
+                            "3\r\nabc\r\n"
+                            "0\r\n"
+                            "X-Checksum: 1\r\n"
+                            "X-Other: 2\r\n"
+                            "\r\n");
+    BOOST_CHECK(response.IsComplete());
+}
+
+BOOST_AUTO_TEST_CASE(chunked_in_one_piece) {
+    Response response;
+    const std::string data = "HTTP/1.1 200 OK\r\n"
+                             "Transfer-Encoding: chunked\r\n\r\n"
+                             "3\r\nabc\r\n0\r\n\r\n";
+    response.Append(data.data(), data.size());
+    BOOST_CHECK(response.IsComplete());
+}
+
+BOOST_AUTO_TEST_CASE(bad_chunk_size) {
+    for(const auto size : {"xyz", "1000000000000000"}) {
+        Response response;
+        const auto data = std::string("HTTP/1.1 200 OK\r\n"
+                                      "Transfer-Encoding: chunked\r\n\r\n")
+            + size + "\r\nabc\r\n0\r\n\r\n";
+        response.Append(data.data(), data.size());
+        BOOST_CHECK_MESSAGE(!response.IsComplete(), "Size " << size);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(prepare_and_commit) {
+    const std::string data = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc";
+
+    Response response;
+    std::size_t offset = 0;
+    while(offset < data.size()) {
+        // Offer more room than the "socket" fills
+        char *buf = response.Prepare(64);
+        const auto len = std::min<std::size_t>(7, data.size() - offset);
+        std::memcpy(buf, data.data() + offset, len);
+        response.Commit(len);
+        offset += len;
+    }
+
+    BOOST_CHECK(response.IsComplete());
+    BOOST_CHECK_EQUAL(response.GetData(), data);
+    BOOST_CHECK_EQUAL(response.GetBody(), "abc");
+}
+
+BOOST_AUTO_TEST_CASE(reserve_body) {
+    Response response;
+    const std::string headers = "HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n";
+    response.Append(headers.data(), headers.size());
+    response.ReserveBody(1000);
+    BOOST_CHECK_GE(response.GetSpare(), 1000);
+}
+
+BOOST_AUTO_TEST_CASE(truncate_and_take) {
+    Response response;
+    const std::string data = "HTTP/1.1 200 OK\r\n\r\n0123456789";
+    response.Append(data.data(), data.size());
+    response.TruncateBody(4);
+    BOOST_CHECK_EQUAL(response.GetBody(), "0123");
+
+    const auto taken = response.TakeData();
+    BOOST_CHECK_EQUAL(taken, "HTTP/1.1 200 OK\r\n\r\n0123");
+    BOOST_CHECK(!response.HasHeaders());
+    BOOST_CHECK_EQUAL(response.GetStatus(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
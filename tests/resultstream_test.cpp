@@ -0,0 +1,162 @@
+/*
+ * Tests for the record format in "resultstream.h".
+ *
+ * This code is in the public domain.
+ */
+
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <boost/test/unit_test.hpp>
+
+#include "resultstream.h"
+
+namespace {
+
+/*! Write records to a pipe, and get back what came out */
+class Pipe
+{
+    int fds_[2] = {-1, -1};
+
+public:
+    Pipe() {
+        BOOST_REQUIRE(::pipe(fds_) == 0);
+    }
+
+    ~Pipe() {
+        ::close(fds_[0]);
+        ::close(fds_[1]);
+    }
+
+    int In() const { return fds_[1]; }
+
+    std::string ReadAll() {
+        ::close(fds_[1]);
+        fds_[1] = -1;
+
+        std::string rval;
+        char buf[4096];
+        for(;;) {
+            const auto bytes = ::read(fds_[0], buf, sizeof(buf));
+            if (bytes <= 0) {
+                return rval;
+            }
+            rval.append(buf, bytes);
+        }
+    }
+};
+
+std::string AsString(const char *data, std::size_t size) {
+    return {data, size};
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(resultstream_decode)
+
+BOOST_AUTO_TEST_CASE(round_trip) {
+    const std::string response = "HTTP/1.1 200 OK\r\n\r\nhello";
+    resultstream::RecordHeader ok;
+    ok.index = 3;
+    ok.status = 200;
+    ok.http_header_size = 19;
+    ok.total_us = 1234;
+
+    resultstream::RecordHeader failed;
+    failed.index = 4;
+    failed.flags = resultstream::RecordHeader::FLAG_FAILED;
+
+    Pipe pipe;
+    BOOST_REQUIRE(resultstream::Write(pipe.In(), ok, "http://a/", "",
+                                      response.data(), response.size()));
+    BOOST_REQUIRE(resultstream::Write(pipe.In(), failed, "http://b/",
+                                      "Connection refused", nullptr, 0));
+    const auto data = pipe.ReadAll();
+
+    const char *pos = data.data();
+    const char *end = pos + data.size();
+    resultstream::Record rec;
+
+    BOOST_REQUIRE(resultstream::Next(pos, end, rec));
+    BOOST_CHECK_EQUAL(rec.header.index, 3);
+    BOOST_CHECK_EQUAL(rec.header.status, 200);
+    BOOST_CHECK_EQUAL(rec.header.total_us, 1234);
+    BOOST_CHECK_EQUAL(AsString(rec.url, rec.header.url_size), "http://a/");
+    BOOST_CHECK_EQUAL(rec.header.error_size, 0);
+    BOOST_CHECK_EQUAL(AsString(rec.http_headers, rec.header.http_header_size),
+                      "HTTP/1.1 200 OK\r\n\r\n");
+    BOOST_CHECK_EQUAL(AsString(rec.body, rec.header.body_size), "hello");
+
+    BOOST_REQUIRE(resultstream::Next(pos, end, rec));
+    BOOST_CHECK_EQUAL(rec.header.index, 4);
+    BOOST_CHECK(rec.header.flags & resultstream::RecordHeader::FLAG_FAILED);
+    BOOST_CHECK_EQUAL(AsString(rec.url, rec.header.url_size), "http://b/");
+    BOOST_CHECK_EQUAL(AsString(rec.error, rec.header.error_size),
+                      "Connection refused");
+    BOOST_CHECK_EQUAL(rec.header.http_header_size, 0);
+    BOOST_CHECK_EQUAL(rec.header.body_size, 0);
+
+    BOOST_CHECK(pos == end);
+    BOOST_CHECK(!resultstream::Next(pos, end, rec));
+}
+
+BOOST_AUTO_TEST_CASE(headers_larger_than_the_data) {
+    resultstream::RecordHeader header;
+    header.http_header_size = 100;
+    iovec parts[4];
+    resultstream::Gather(header, "u", "", "abc", 3, parts);
+    BOOST_CHECK_EQUAL(header.http_header_size, 3);
+    BOOST_CHECK_EQUAL(header.body_size, 0);
+    BOOST_CHECK_EQUAL(header.record_size, 4);
+}
+
+BOOST_AUTO_TEST_CASE(newer_header) {
+    // A later version, with a field we don't know about
+    struct {
+        resultstream::RecordHeader header;
+        std::uint64_t extra = 42;
+    } newer;
+    newer.header.header_size = sizeof(newer);
+    newer.header.url_size = 1;
+    newer.header.record_size = 1;
+
+    const auto data = std::string(reinterpret_cast<const char *>(&newer),
+                                  sizeof(newer)) + "u";
+    const char *pos = data.data();
+    resultstream::Record rec;
+    BOOST_REQUIRE(resultstream::Next(pos, data.data() + data.size(), rec));
+    BOOST_CHECK_EQUAL(AsString(rec.url, rec.header.url_size), "u");
+    BOOST_CHECK(pos == data.data() + data.size());
+}
+
+BOOST_AUTO_TEST_CASE(damaged) {
+    Pipe pipe;
+    resultstream::RecordHeader header;
+    BOOST_REQUIRE(resultstream::Write(pipe.In(), header, "http://a/", "",
+                                      "abc", 3));
+    const auto data = pipe.ReadAll();
+    resultstream::Record rec;
+
+    for(std::size_t len = 0; len < data.size(); ++len) {
+        const char *pos = data.data();
+        BOOST_CHECK_MESSAGE(!resultstream::Next(pos, data.data() + len, rec),
+                            "Decoded " << len << " of " << data.size()
+                            << " bytes");
+    }
+
+    auto bad_magic = data;
+    bad_magic[0] = 'X';
+    const char *pos = bad_magic.data();
+    BOOST_CHECK(!resultstream::Next(pos, pos + bad_magic.size(), rec));
+
+    // The sizes of the parts must add up to the size of the record
+    resultstream::RecordHeader wrong_sizes;
+    std::memcpy(&wrong_sizes, data.data(), sizeof(wrong_sizes));
+    wrong_sizes.body_size += 1;
+    auto mismatch = data;
+    std::memcpy(&mismatch[0], &wrong_sizes, sizeof(wrong_sizes));
+    pos = mismatch.data();
+    BOOST_CHECK(!resultstream::Next(pos, pos + mismatch.size(), rec));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
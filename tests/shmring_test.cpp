@@ -0,0 +1,175 @@
+/*
+ * Tests for "shmring.h".
+ *
+ * This code is in the public domain.
+ */
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <boost/test/unit_test.hpp>
+
+#include "shmring.h"
+
+namespace {
+
+void Write(ShmRing& ring, const std::string& message) {
+    const iovec part = {const_cast<char *>(message.data()), message.size()};
+    ring.Write(&part, 1);
+}
+
+/*! A message that tells where it's from, and has a size of its own */
+std::string Message(std::size_t index, std::size_t size) {
+    std::string rval = std::to_string(index) + ':';
+    while(rval.size() < size) {
+        rval += static_cast<char>('a' + (rval.size() + index) % 26);
+    }
+    return rval;
+}
+
+bool IsReadable(int fd, int timeout_ms) {
+    pollfd pfd = {fd, POLLIN, 0};
+    return ::poll(&pfd, 1, timeout_ms) == 1;
+}
+
+/*! Read the next message, and wait for it like a reader should */
+std::string WaitAndRead(ShmRing& ring) {
+    std::string message;
+    while(!ring.Read(message)) {
+        if (ring.WantData()) {
+            BOOST_REQUIRE(IsReadable(ring.DataFd(), 10000));
+        }
+    }
+    return message;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(shmring)
+
+BOOST_AUTO_TEST_CASE(empty) {
+    ShmRing ring(4096);
+    std::string message;
+    BOOST_CHECK(!ring.Read(message));
+    BOOST_CHECK(ring.WantData());
+    BOOST_CHECK(!IsReadable(ring.DataFd(), 0));
+}
+
+BOOST_AUTO_TEST_CASE(parts) {
+    ShmRing ring(4096);
+    const std::string a = "Hello", b = ", ", c = "world";
+    const iovec parts[3] = {
+        {const_cast<char *>(a.data()), a.size()},
+        {const_cast<char *>(b.data()), b.size()},
+        {const_cast<char *>(c.data()), c.size()}
+    };
+    ring.Write(parts, 3);
+    Write(ring, "");
+
+    std::string message;
+    BOOST_REQUIRE(ring.Read(message));
+    BOOST_CHECK_EQUAL(message, "Hello, world");
+    BOOST_REQUIRE(ring.Read(message));
+    BOOST_CHECK_EQUAL(message, "");
+    BOOST_CHECK(!ring.Read(message));
+}
+
+BOOST_AUTO_TEST_CASE(wakes_the_reader) {
+    ShmRing ring(4096);
+    std::string message;
+    BOOST_CHECK(!ring.Read(message));
+    BOOST_REQUIRE(ring.WantData());
+
+    Write(ring, "x");
+    BOOST_CHECK(IsReadable(ring.DataFd(), 0));
+    BOOST_CHECK(ring.Read(message));
+
+    // Nobody asked since, so the writer leaves the eventfd alone
+    ring.ClearData();
+    Write(ring, "y");
+    BOOST_CHECK(!IsReadable(ring.DataFd(), 0));
+    BOOST_CHECK(!ring.WantData());
+}
+
+BOOST_AUTO_TEST_CASE(wraps_around) {
+    ShmRing ring(4096);
+    std::string message;
+    // Odd sizes, so that the chunks end at all kinds of places
+    for(std::size_t i = 0; i < 1000; ++i) {
+        const auto expected = Message(i, 1 + (i * 37) % 900);
+        Write(ring, expected);
+        BOOST_REQUIRE(ring.Read(message));
+        BOOST_REQUIRE_EQUAL(message, expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(larger_than_the_ring) {
+    ShmRing ring(4096);
+    const auto expected = Message(1, 100000);
+
+    // The writer waits for the reader to make room
+    std::thread writer([&] { Write(ring, expected); });
+    const auto message = WaitAndRead(ring);
+    writer.join();
+    BOOST_CHECK(message == expected);
+}
+
+BOOST_AUTO_TEST_CASE(writer_dies) {
+    ShmRing ring(4096);
+
+    // The writer fills the ring with the start of a message, and waits
+    // for room for the rest, until we kill it.
+    const auto pid = ::fork();
+    BOOST_REQUIRE(pid >= 0);
+    if (pid == 0) {
+        Write(ring, Message(1, 100000));
+        ::_exit(0);
+    }
+
+    if (ring.WantData()) {
+        BOOST_REQUIRE(IsReadable(ring.DataFd(), 10000));
+    }
+    ::usleep(100000);
+    ::kill(pid, SIGKILL);
+    int status = 0;
+    BOOST_REQUIRE(::waitpid(pid, &status, 0) == pid);
+    BOOST_REQUIRE(WIFSIGNALED(status));
+
+    std::string message;
+    BOOST_CHECK(!ring.Read(message));
+    ring.DiscardPartial();
+
+    // A new writer can take over
+    Write(ring, "whole");
+    BOOST_REQUIRE(ring.Read(message));
+    BOOST_CHECK_EQUAL(message, "whole");
+}
+
+BOOST_AUTO_TEST_CASE(between_processes) {
+    ShmRing ring(8192);
+    const std::size_t count = 500;
+
+    const auto pid = ::fork();
+    BOOST_REQUIRE(pid >= 0);
+    if (pid == 0) {
+        for(std::size_t i = 0; i < count; ++i) {
+            Write(ring, Message(i, 1 + (i * 997) % 5000));
+        }
+        ::_exit(0);
+    }
+
+    for(std::size_t i = 0; i < count; ++i) {
+        BOOST_REQUIRE_EQUAL(WaitAndRead(ring),
+                            Message(i, 1 + (i * 997) % 5000));
+    }
+
+    int status = 0;
+    BOOST_REQUIRE(::waitpid(pid, &status, 0) == pid);
+    BOOST_CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,123 @@
+/*
+ * Tests for Url in "http.h".
+ *
+ * This code is in the public domain.
+ */
+
+#include <stdexcept>
+#include <string>
+#include <boost/test/unit_test.hpp>
+
+#include "http.h"
+
+BOOST_AUTO_TEST_SUITE(url)
+
+BOOST_AUTO_TEST_CASE(defaults) {
+    Url url;
+    BOOST_REQUIRE(Url::TryParse("http://example.com", url));
+    BOOST_CHECK_EQUAL(url.host, "example.com");
+    BOOST_CHECK_EQUAL(url.port, "80");
+    BOOST_CHECK_EQUAL(url.path, "/");
+}
+
+BOOST_AUTO_TEST_CASE(without_scheme) {
+    Url url;
+    BOOST_REQUIRE(Url::TryParse("example.com:8080/a/b?x=1:2", url));
+    BOOST_CHECK_EQUAL(url.host, "example.com");
+    BOOST_CHECK_EQUAL(url.port, "8080");
+    BOOST_CHECK_EQUAL(url.path, "/a/b?x=1:2");
+}
+
+BOOST_AUTO_TEST_CASE(ipv6) {
+    Url url;
+    BOOST_REQUIRE(Url::TryParse("http://[::1]:8080/x", url));
+    BOOST_CHECK_EQUAL(url.host, "::1");
+    BOOST_CHECK_EQUAL(url.port, "8080");
+    BOOST_CHECK_EQUAL(url.HostHeader(), "[::1]:8080");
+
+    Url other;
+    BOOST_REQUIRE(Url::TryParse("http://[2001:db8::1]/", other));
+    BOOST_CHECK_EQUAL(other.host, "2001:db8::1");
+    BOOST_CHECK_EQUAL(other.port, "80");
+    BOOST_CHECK_EQUAL(other.HostHeader(), "[2001:db8::1]");
+}
+
+BOOST_AUTO_TEST_CASE(invalid) {
+    for(const auto text : {"", "http://", "http://:80/", "example.com:",
+                           "example.com:0", "example.com:65536",
+                           "example.com:123456", "example.com:8a/",
+                           "example.com:-1"}) {
+        Url url;
+        BOOST_CHECK_MESSAGE(!Url::TryParse(text, url), "Accepted " << text);
+    }
+    BOOST_CHECK_THROW(Url::Parse("http://example.com:99999/"),
+                      std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(origin) {
+    const auto url = Url::Parse("http://WWW.Example.COM:81/Path");
+    BOOST_CHECK_EQUAL(url.Origin(), "www.example.com:81");
+    BOOST_CHECK_EQUAL(url.HostHeader(), "WWW.Example.COM:81");
+    BOOST_CHECK_EQUAL(url.path, "/Path");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(redirect)
+
+namespace {
+
+// What location in a response for "from" points to, or "" if we can't go
+std::string Resolve(const std::string& from, const std::string& location) {
+    Url target;
+    if (!Url::Parse(from).Redirect(location, target)) {
+        return {};
+    }
+    return target.host + ":" + target.port + target.path;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(absolute_path) {
+    BOOST_CHECK_EQUAL(Resolve("http://example.com:81/a/b", "/c?d"),
+                      "example.com:81/c?d");
+}
+
+BOOST_AUTO_TEST_CASE(relative_path) {
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a/b", "c"),
+                      "example.com:80/a/c");
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a/", "c"),
+                      "example.com:80/a/c");
+    BOOST_CHECK_EQUAL(Resolve("http://example.com", "c"),
+                      "example.com:80/c");
+    // A '/' in the query is not part of the directory
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a/b?next=/x/y", "c"),
+                      "example.com:80/a/c");
+}
+
+BOOST_AUTO_TEST_CASE(other_host) {
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a", "http://other:8080/b"),
+                      "other:8080/b");
+    BOOST_CHECK_EQUAL(Resolve("http://example.com:81/a", "//other/b"),
+                      "other:80/b");
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a", "http://[::1]/b"),
+                      "::1:80/b");
+}
+
+BOOST_AUTO_TEST_CASE(fragment) {
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a", "/b#top"),
+                      "example.com:80/b");
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a", "#top"), "");
+}
+
+BOOST_AUTO_TEST_CASE(cant_follow) {
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a", ""), "");
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a", "https://example.com/"),
+                      "");
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a", "ftp://example.com/"),
+                      "");
+    BOOST_CHECK_EQUAL(Resolve("http://example.com/a", "http://example.com:0/"),
+                      "");
+}
+
+BOOST_AUTO_TEST_SUITE_END()